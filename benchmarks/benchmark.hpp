@@ -0,0 +1,114 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+
+// A minimal benchmarking harness. Benchmarks are declared much like tests:
+//
+//   BENCHMARK( Suite, Name )
+//   {
+//     state.run( "label", iterations, [&] { ... } );
+//   }
+//
+// Each call to State::run times `iterations` invocations of the body,
+// repeats that a few times and reports the fastest average per invocation.
+namespace bench
+{
+
+// Prevents the compiler from discarding a value it can prove unused
+template<typename T>
+inline void do_not_optimize( const T& value )
+{
+#if __GNUC__ || __clang__
+  asm volatile( "" : : "r,m"( value ) : "memory" );
+#else
+  static volatile const void* sink;
+  sink = &value;
+#endif
+}
+
+class State
+{
+public:
+
+  State( const char* suite, const char* name )
+  : m_suite( suite ), m_name( name )
+  {
+  }
+
+  template<typename F>
+  double run( const char* label, std::size_t iterations, F&& body )
+  {
+    using clock = std::chrono::steady_clock;
+
+    constexpr int repetitions = 3;
+
+    double best = 0.0;
+    for ( int r = 0; r < repetitions; r++ )
+    {
+      auto start = clock::now();
+
+      for ( std::size_t i = 0; i < iterations; i++ )
+        body();
+
+      std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+
+      double perIteration = elapsed.count() / double( iterations );
+      if ( r == 0 || perIteration < best )
+        best = perIteration;
+    }
+
+    report( label, best, "ns/op" );
+    return best;
+  }
+
+  // Reports a value measured by the benchmark itself
+  void report( const char* label, double value, const char* unit )
+  {
+    std::printf( "%s.%s/%-40s %14.2f %s\n", m_suite, m_name, label, value, unit );
+    std::fflush( stdout );
+  }
+
+private:
+
+  const char* m_suite;
+  const char* m_name;
+};
+
+using benchmark_function = void ( * )( State& );
+
+struct Registration
+{
+  Registration( const char* suite, const char* name, benchmark_function function )
+  : suite( suite ), name( name ), function( function )
+  {
+    Registration*& last = tail();
+    ( last ? last->next : head() ) = this;
+    last = this;
+  }
+
+  static Registration*& head()
+  {
+    static Registration* registration = nullptr;
+    return registration;
+  }
+
+  static Registration*& tail()
+  {
+    static Registration* registration = nullptr;
+    return registration;
+  }
+
+  const char*        suite;
+  const char*        name;
+  benchmark_function function;
+  Registration*      next = nullptr;
+};
+
+} // namespace bench
+
+#define BENCHMARK( Suite, Name )                                                 \
+  static void Suite##_##Name##_benchmark( bench::State& state );                 \
+  static bench::Registration Suite##_##Name##_registration(                      \
+    #Suite, #Name, &Suite##_##Name##_benchmark );                                \
+  static void Suite##_##Name##_benchmark( [[maybe_unused]] bench::State& state )
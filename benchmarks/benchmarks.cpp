@@ -0,0 +1,916 @@
+#include "benchmark.hpp"
+#include "common/atomic_shared_ptr.hpp"
+#include "common/caching_resource.hpp"
+#include "common/coroutine.hpp"
+#include "common/event_dispatcher.hpp"
+#include "common/functional.hpp"
+#include "common/huge_page_resource.hpp"
+#include "common/list.hpp"
+#include "common/mapped_vector.hpp"
+#include "common/object_pool.hpp"
+#include "common/memory.hpp"
+#include "common/memory_resource.hpp"
+#include "common/ref_ptr.hpp"
+#include "common/string.hpp"
+#include "common/task_graph.hpp"
+#include "common/thread.hpp"
+#include "common/thread_pool.hpp"
+#include "common/unrolled_list.hpp"
+#include "common/vector.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+BENCHMARK( List, Iterate )
+{
+  constexpr std::size_t count = 1'000'000;
+
+  ql::List<std::uint64_t>         list;
+  ql::UnrolledList<std::uint64_t> unrolled;
+  ql::Vector<std::uint64_t>       vector( count );
+
+  for ( std::size_t i = 0; i < count; i++ )
+  {
+    list.push_back( i );
+    unrolled.push_back( i );
+    vector[ i ] = i;
+  }
+
+  auto sum = []( const auto& container )
+  {
+    std::uint64_t total = 0;
+    for ( std::uint64_t value : container )
+      total += value;
+
+    bench::do_not_optimize( total );
+  };
+
+  state.run( "ql::List", 20, [&] { sum( list ); } );
+  state.run( "ql::UnrolledList", 20, [&] { sum( unrolled ); } );
+  state.run( "ql::Vector", 20, [&] { sum( vector ); } );
+}
+
+BENCHMARK( MemoryResource, MonotonicThroughput )
+{
+  // A request's worth of small, mixed-size allocations, all freed together
+  constexpr std::size_t count = 10'000;
+
+  std::size_t sizes[ count ];
+  for ( std::size_t i = 0; i < count; i++ )
+    sizes[ i ] = 16 + ( i * 37 ) % 240;
+
+  static void* pointers[ count ];
+
+  state.run( "malloc/free", 100, [&]
+  {
+    for ( std::size_t i = 0; i < count; i++ )
+      pointers[ i ] = std::malloc( sizes[ i ] );
+
+    bench::do_not_optimize( pointers );
+
+    for ( std::size_t i = 0; i < count; i++ )
+      std::free( pointers[ i ] );
+  } );
+
+  ql::MonotonicBufferResource arena;
+  state.run( "MonotonicBufferResource", 100, [&]
+  {
+    ql::ScopedArena scope( arena );
+
+    for ( std::size_t i = 0; i < count; i++ )
+      pointers[ i ] = scope.allocate( sizes[ i ] );
+
+    bench::do_not_optimize( pointers );
+  } );
+}
+
+BENCHMARK( MemoryResource, RequestGraph )
+{
+  // A request's worth of nested containers, built and thrown away
+  auto build = []( auto& headers, auto& lines )
+  {
+    for ( int i = 0; i < 64; i++ )
+      headers.emplace_back( "X-Some-Fairly-Long-Header-Name: and its value" );
+
+    for ( int i = 0; i < 16; i++ )
+    {
+      auto& line = lines.emplace_back();
+      for ( int j = 0; j < 32; j++ )
+        line.push_back( j );
+    }
+
+    bench::do_not_optimize( headers );
+    bench::do_not_optimize( lines );
+  };
+
+  state.run( "Default allocator", 1000, [&]
+  {
+    ql::Vector<ql::String>     headers;
+    ql::List<ql::Vector<int>> lines;
+    build( headers, lines );
+  } );
+
+  ql::MonotonicBufferResource arena;
+  state.run( "PolymorphicAllocator + arena", 1000, [&]
+  {
+    ql::ScopedArena scope( arena );
+
+    ql::pmr::Vector<ql::pmr::String>     headers( &scope );
+    ql::pmr::List<ql::pmr::Vector<int>> lines( &scope );
+    build( headers, lines );
+  } );
+}
+
+BENCHMARK( MemoryResource, ProducerConsumer )
+{
+  // One thread allocates messages and hands them to another which frees
+  // them, so every block is freed on a thread other than its allocator's.
+  constexpr std::size_t count    = 200'000;
+  constexpr std::size_t capacity = 1024;
+
+  struct Ring
+  {
+    void*                    slots[ capacity ];
+    alignas( 64 ) std::atomic<std::size_t> head = 0;
+    alignas( 64 ) std::atomic<std::size_t> tail = 0;
+  };
+
+  auto run = [&]( auto allocate, auto deallocate )
+  {
+    static Ring ring;
+    ring.head = 0;
+    ring.tail = 0;
+
+    ql::Thread consumer = [&]
+    {
+      for ( std::size_t i = 0; i < count; i++ )
+      {
+        const std::size_t head = ring.head.load( std::memory_order_relaxed );
+        while ( ring.tail.load( std::memory_order_acquire ) == head )
+          std::this_thread::yield();
+
+        deallocate( ring.slots[ head % capacity ], 16 + i % 8 * 16 );
+        ring.head.store( head + 1, std::memory_order_release );
+      }
+    };
+
+    for ( std::size_t i = 0; i < count; i++ )
+    {
+      const std::size_t tail = ring.tail.load( std::memory_order_relaxed );
+      while ( tail - ring.head.load( std::memory_order_acquire ) == capacity )
+        std::this_thread::yield();
+
+      ring.slots[ tail % capacity ] = allocate( 16 + i % 8 * 16 );
+      ring.tail.store( tail + 1, std::memory_order_release );
+    }
+  };
+
+  state.run( "malloc/free", 5, [&]
+  {
+    run( []( std::size_t size ) { return std::malloc( size ); },
+         []( void* memory, std::size_t ) { std::free( memory ); } );
+  } );
+
+  ql::SynchronizedPoolResource pool;
+  state.run( "SynchronizedPoolResource", 5, [&]
+  {
+    run( [&]( std::size_t size ) { return pool.allocate( size ); },
+         [&]( void* memory, std::size_t size ) { pool.deallocate( memory, size ); } );
+  } );
+
+  ql::ThreadCachingResource caching;
+  state.run( "ThreadCachingResource", 5, [&]
+  {
+    run( [&]( std::size_t size ) { return caching.allocate( size ); },
+         [&]( void* memory, std::size_t size ) { caching.deallocate( memory, size ); } );
+  } );
+}
+
+BENCHMARK( MemoryResource, HugePageRandomAccess )
+{
+  // Random reads over a table far larger than the TLB can cover with
+  // 4 KiB pages
+  constexpr std::size_t count    = 32 * 1024 * 1024;
+  constexpr std::size_t accesses = 1'000'000;
+
+  auto gather = []( const auto& table )
+  {
+    std::uint64_t index = 1;
+    std::uint64_t total = 0;
+    for ( std::size_t i = 0; i < accesses; i++ )
+    {
+      index = index * 6364136223846793005ull + 1442695040888963407ull;
+      total += table[ ( index >> 16 ) % count ];
+    }
+
+    bench::do_not_optimize( total );
+  };
+
+  {
+    ql::Vector<std::uint64_t> table( count );
+    state.run( "Default allocator", 10, [&] { gather( table ); } );
+  }
+
+  ql::HugePageResource resource;
+  {
+    ql::pmr::Vector<std::uint64_t> table( count, &resource );
+    state.run( "HugePageResource", 10, [&] { gather( table ); } );
+
+    state.report( "Huge pages granted", double( resource.huge_page_bytes() ) / ( 1024 * 1024 ), "MiB" );
+  }
+}
+
+BENCHMARK( MappedVector, Load )
+{
+  // A lookup table that is expensive to build, rebuilt on every start
+  // versus mapped from the file a previous run left behind
+  constexpr std::size_t count = 4 * 1024 * 1024;
+  const char*           path  = "ql_mapped_vector_benchmark.bin";
+
+  auto build = []( std::size_t i )
+  {
+    std::uint64_t value = i;
+    for ( int round = 0; round < 16; round++ )
+      value = value * 6364136223846793005ull + 1442695040888963407ull;
+
+    return value;
+  };
+
+  state.run( "Rebuild", 3, [&]
+  {
+    ql::Vector<std::uint64_t> table;
+    table.reserve( count );
+
+    for ( std::size_t i = 0; i < count; i++ )
+      table.push_back( build( i ) );
+
+    bench::do_not_optimize( table[ count / 2 ] );
+  } );
+
+  std::remove( path );
+  {
+    ql::MappedVector<std::uint64_t> table( path );
+    table.reserve( count );
+
+    for ( std::size_t i = 0; i < count; i++ )
+      table.push_back( build( i ) );
+  }
+
+  state.run( "Map existing", 3, [&]
+  {
+    ql::MappedVector<std::uint64_t> table( path, ql::MapMode::read_only );
+    bench::do_not_optimize( table[ count / 2 ] );
+  } );
+
+  std::remove( path );
+}
+
+BENCHMARK( SharedPtr, Copy )
+{
+  // The cost of copying and releasing a shared pointer, which is one count
+  // increment and decrement. Atomic counts pay for a locked read-modify-write
+  // each time even without contention.
+  constexpr std::size_t copies = 10'000'000;
+
+  auto run = [&]( const auto& shared )
+  {
+    for ( std::size_t i = 0; i < copies; i++ )
+    {
+      auto copy = shared;
+      bench::do_not_optimize( copy );
+    }
+  };
+
+  ql::SharedPtr<int> atomic = 1;
+  state.run( "AtomicRefCount", 5, [&] { run( atomic ); } );
+
+  ql::LocalSharedPtr<int> local = 1;
+  state.run( "LocalRefCount", 5, [&] { run( local ); } );
+}
+
+BENCHMARK( SharedPtr, CreateAndCopy )
+{
+  // Creates many shared objects, then copies each and reads through the
+  // copy. Adopting a new'd object costs a second allocation for the counts,
+  // and a second cache miss whenever the counts and the object are touched
+  // together.
+  constexpr std::size_t count = 200'000;
+
+  struct Message
+  {
+    std::uint64_t id;
+    std::uint64_t payload[ 3 ];
+  };
+
+  auto run = [&]( auto create )
+  {
+    ql::Vector<ql::SharedPtr<Message>> messages;
+    messages.reserve( count );
+
+    for ( std::size_t i = 0; i < count; i++ )
+      messages.push_back( create( i ) );
+
+    std::uint64_t sum = 0;
+    for ( const ql::SharedPtr<Message>& message : messages )
+    {
+      ql::SharedPtr<Message> copy = message;
+      sum += copy->id;
+    }
+
+    bench::do_not_optimize( sum );
+  };
+
+  state.run( "adopt new", 5, [&]
+  {
+    run( []( std::size_t i ) { return ql::SharedPtr<Message>( new Message { i, {} } ); } );
+  } );
+
+  state.run( "make_shared", 5, [&]
+  {
+    run( []( std::size_t i ) { return ql::make_shared<Message>( Message { i, {} } ); } );
+  } );
+
+  ql::UnsynchronizedPoolResource pool;
+  state.run( "allocate_shared (pool)", 5, [&]
+  {
+    run( [&]( std::size_t i ) { return ql::allocate_shared<Message>( &pool, Message { i, {} } ); } );
+  } );
+}
+
+BENCHMARK( RefPtr, GraphChurn )
+{
+  // Builds and tears down chains of nodes, each holding a handle to the
+  // next, as graph rewrites do. RefPtr keeps the count in the node, so there
+  // is no control block to allocate or visit.
+  constexpr std::size_t count = 200'000;
+
+  struct SharedNode
+  {
+    ql::SharedPtr<SharedNode> next;
+    std::uint64_t             value;
+  };
+
+  struct RefNode : ql::RefCounted<RefNode>
+  {
+    ql::RefPtr<RefNode> next;
+    std::uint64_t       value;
+  };
+
+  state.run( "SharedPtr", 5, [&]
+  {
+    ql::SharedPtr<SharedNode> head;
+    for ( std::size_t i = 0; i < count; i++ )
+    {
+      ql::SharedPtr<SharedNode> node = ql::make_shared<SharedNode>();
+      node->value = i;
+      node->next  = head;
+      head        = node;
+    }
+
+    // Unlink iteratively, as recursive destruction would overflow the stack
+    while ( head )
+    {
+      ql::SharedPtr<SharedNode> next = head->next;
+      head = next;
+    }
+  } );
+
+  state.run( "RefPtr", 5, [&]
+  {
+    ql::RefPtr<RefNode> head;
+    for ( std::size_t i = 0; i < count; i++ )
+    {
+      ql::RefPtr<RefNode> node = ql::make_ref<RefNode>();
+      node->value = i;
+      node->next  = head;
+      head        = node;
+    }
+
+    while ( head )
+    {
+      ql::RefPtr<RefNode> next = head->next;
+      head = next;
+    }
+  } );
+}
+
+BENCHMARK( AtomicSharedPtr, ReadScaling )
+{
+  // Reader threads repeatedly fetch the current table and read from it
+  // while a writer publishes a new one now and then. A mutex serialises the
+  // readers on its lock word; AtomicSharedPtr readers make an atomic
+  // increment and never wait, and Readers write nothing shared until the
+  // table is replaced.
+  constexpr std::size_t reads   = 200'000;
+  constexpr std::size_t entries = 64;
+
+  struct Table
+  {
+    std::uint64_t routes[ entries ];
+  };
+
+  auto run = [&]( std::size_t readers, auto load, auto store )
+  {
+    std::atomic<std::size_t> finished = 0;
+
+    auto read = [&]
+    {
+      std::uint64_t sum = 0;
+      for ( std::size_t i = 0; i < reads; i++ )
+        sum += load()->routes[ i % entries ];
+
+      bench::do_not_optimize( sum );
+      finished.fetch_add( 1, std::memory_order_release );
+    };
+
+    ql::Thread threads[ 4 ];
+    for ( std::size_t i = 0; i < readers; i++ )
+      threads[ i ] = read;
+
+    while ( finished.load( std::memory_order_acquire ) != readers )
+    {
+      store( ql::make_shared<Table>() );
+      std::this_thread::yield();
+    }
+  };
+
+  for ( std::size_t readers : { 1, 2, 4 } )
+  {
+    char label[ 64 ];
+
+    ql::SharedPtr<Table> guarded = ql::make_shared<Table>();
+    std::mutex           mutex;
+
+    std::snprintf( label, sizeof( label ), "mutex, %zu readers", readers );
+    state.run( label, 5, [&]
+    {
+      run( readers,
+           [&] { std::lock_guard lock( mutex ); return guarded; },
+           [&]( ql::SharedPtr<Table> table ) { std::lock_guard lock( mutex ); guarded = table; } );
+    } );
+
+    ql::AtomicSharedPtr<Table> atomic = ql::make_shared<Table>();
+
+    std::snprintf( label, sizeof( label ), "AtomicSharedPtr, %zu readers", readers );
+    state.run( label, 5, [&]
+    {
+      run( readers,
+           [&] { return atomic.load(); },
+           [&]( ql::SharedPtr<Table> table ) { atomic.store( ql::move( table ) ); } );
+    } );
+
+    std::snprintf( label, sizeof( label ), "AtomicSharedPtr::Reader, %zu readers", readers );
+    state.run( label, 5, [&]
+    {
+      run( readers,
+           [&]() -> const ql::SharedPtr<Table>&
+           {
+             thread_local auto reader = atomic.reader();
+             return reader.get();
+           },
+           [&]( ql::SharedPtr<Table> table ) { atomic.store( ql::move( table ) ); } );
+    } );
+  }
+}
+
+BENCHMARK( ObjectPool, AcquireLatency )
+{
+  // Times each allocation individually while a window of messages stays
+  // live, and reports the latency distribution rather than the mean: new
+  // occasionally stalls in the system allocator, a pool rarely leaves its
+  // thread's free list.
+  constexpr std::size_t samples = 200'000;
+  constexpr std::size_t window  = 1024;
+
+  struct Message
+  {
+    std::uint64_t id;
+    ql::byte_t    payload[ 248 ];
+  };
+
+  using clock = std::chrono::steady_clock;
+
+  auto measure = [&]( const char* label, auto acquire, auto& live )
+  {
+    ql::Vector<std::uint32_t> latencies;
+    latencies.reserve( samples );
+
+    for ( std::size_t i = 0; i < samples; i++ )
+    {
+      const clock::time_point start = clock::now();
+      auto                    message = acquire( i );
+      const clock::time_point end = clock::now();
+
+      latencies.push_back( std::uint32_t( std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count() ) );
+      live[ i % window ] = ql::move( message );
+    }
+
+    std::sort( latencies.begin(), latencies.end() );
+
+    char name[ 64 ];
+    for ( double percentile : { 50.0, 99.0, 99.9 } )
+    {
+      std::snprintf( name, sizeof( name ), "%s p%g", label, percentile );
+      state.report( name, latencies[ std::size_t( percentile / 100 * ( samples - 1 ) ) ], "ns" );
+    }
+  };
+
+  // What reading the clock itself costs, to subtract from the others
+  {
+    ql::Vector<int> live;
+    live.resize( window );
+
+    measure( "clock only", []( std::size_t i ) { return int( i ); }, live );
+  }
+
+  {
+    ql::Vector<ql::UniquePtr<Message>> live;
+    live.resize( window );
+
+    measure( "new", []( std::size_t i ) { return ql::UniquePtr<Message>( new Message { i, {} } ); }, live );
+  }
+
+  {
+    ql::ObjectPool<Message> pool;
+
+    ql::Vector<ql::ObjectPool<Message>::Handle> live;
+    live.resize( window );
+
+    measure( "ObjectPool", [&]( std::size_t i ) { return pool.acquire( i ); }, live );
+  }
+}
+
+BENCHMARK( Function, CallOverhead )
+{
+  // Calls a small capturing callable through each wrapper. The wrappers are
+  // hidden from the optimiser before the loop, so every call goes through
+  // the type erasure rather than being inlined.
+  constexpr std::size_t calls = 10'000'000;
+
+  std::uint64_t step = 3;
+  auto          add  = [step]( std::uint64_t x ) { return x + step; };
+
+  auto run = [&]( const auto& f )
+  {
+    bench::do_not_optimize( f );
+
+    std::uint64_t sum = 0;
+    for ( std::size_t i = 0; i < calls; i++ )
+      sum = f( sum );
+
+    bench::do_not_optimize( sum );
+  };
+
+  std::uint64_t ( *pointer )( std::uint64_t ) = []( std::uint64_t x ) { return x + 3; };
+  state.run( "function pointer", 5, [&] { run( pointer ); } );
+
+  std::function<std::uint64_t( std::uint64_t )> standard = add;
+  state.run( "std::function", 5, [&] { run( standard ); } );
+
+  ql::Function<std::uint64_t( std::uint64_t )> function = add;
+  state.run( "ql::Function", 5, [&] { run( function ); } );
+
+  ql::InplaceFunction<std::uint64_t( std::uint64_t )> inplace = add;
+  state.run( "ql::InplaceFunction", 5, [&] { run( inplace ); } );
+}
+
+BENCHMARK( EventDispatcher, Fire )
+{
+  // Fires an event with more listeners than fit in cache, each too large
+  // for a wrapper's inline buffer, as listeners keeping some state often
+  // are. The Vectors of wrappers reach every callable through its own
+  // allocation, scattered by allocations made in between as in a long
+  // running program; the dispatcher walks one arena.
+  constexpr std::size_t listeners = 16'384;
+  constexpr std::size_t fires     = 500;
+
+  auto listener = []( std::size_t i )
+  {
+    std::array<std::uint64_t, 3> weights = { i, i + 1, i + 2 };
+    return [weights, sum = std::uint64_t( 0 )]( std::uint64_t x ) mutable { sum += x * weights[ x % 3 ]; };
+  };
+
+  auto scatter = [&]( auto&& subscribe )
+  {
+    ql::Vector<void*> noise;
+    for ( std::size_t i = 0; i < listeners; i++ )
+    {
+      subscribe( listener( i ) );
+      noise.push_back( std::malloc( 16 + std::rand() % 512 ) );
+    }
+
+    for ( void* block : noise )
+      std::free( block );
+  };
+
+  {
+    ql::Vector<std::function<void( std::uint64_t )>> event;
+    scatter( [&]( auto f ) { event.push_back( f ); } );
+
+    state.run( "Vector<std::function>", 5, [&]
+    {
+      for ( std::size_t i = 0; i < fires; i++ )
+      {
+        for ( auto& f : event )
+          f( i );
+      }
+    } );
+  }
+
+  {
+    ql::Vector<ql::Function<void( std::uint64_t )>> event;
+    scatter( [&]( auto f ) { event.push_back( f ); } );
+
+    state.run( "Vector<ql::Function>", 5, [&]
+    {
+      for ( std::size_t i = 0; i < fires; i++ )
+      {
+        for ( auto& f : event )
+          f( i );
+      }
+    } );
+  }
+
+  {
+    ql::EventDispatcher<void( std::uint64_t )> event;
+    scatter( [&]( auto f ) { event.subscribe( f ); } );
+
+    state.run( "EventDispatcher", 5, [&]
+    {
+      for ( std::size_t i = 0; i < fires; i++ )
+        event.fire( i );
+    } );
+
+    state.report( "EventDispatcher arena", double( event.arena_bytes() ) / listeners, "bytes/listener" );
+  }
+}
+
+BENCHMARK( ThreadPool, SpawnLatency )
+{
+  // The round trip of handing a small task to another thread and seeing it
+  // finish: a new ql::Thread pays for creating and joining the thread, a
+  // pool only for queueing the task and waking a worker. Spawning from a
+  // worker goes to its own deque, without the injection queue's lock.
+  std::atomic<bool> done = false;
+
+  auto wait = [&]
+  {
+    while ( !done.load( std::memory_order_acquire ) )
+      std::this_thread::yield();
+
+    done.store( false, std::memory_order_relaxed );
+  };
+
+  state.run( "ql::Thread", 200, [&]
+  {
+    ql::Thread thread = [&] { done.store( true, std::memory_order_release ); };
+  } );
+
+  ql::ThreadPool pool;
+
+  state.run( "ThreadPool::spawn", 20'000, [&]
+  {
+    pool.spawn( [&] { done.store( true, std::memory_order_release ); } );
+    wait();
+  } );
+
+  constexpr std::size_t batch = 10'000;
+
+  const double perBatch = state.run( "ThreadPool::spawn from a worker, 10000 tasks", 20, [&]
+  {
+    std::atomic<std::size_t> remaining = batch;
+
+    pool.spawn( [&]
+    {
+      for ( std::size_t i = 0; i < batch; i++ )
+        pool.spawn( [&] { remaining.fetch_sub( 1, std::memory_order_release ); } );
+    } );
+
+    pool.help_until( [&] { return remaining.load( std::memory_order_acquire ) == 0; } );
+  } );
+
+  state.report( "ThreadPool::spawn from a worker, per task", perBatch / batch, "ns/op" );
+}
+
+static void parallel_sum( ql::ThreadPool& pool, const std::uint64_t* values, std::size_t count, std::atomic<std::uint64_t>& sum )
+{
+  if ( count <= 4096 )
+  {
+    std::uint64_t local = 0;
+    for ( std::size_t i = 0; i < count; i++ )
+      local += values[ i ] * values[ i ];
+
+    sum.fetch_add( local, std::memory_order_relaxed );
+    return;
+  }
+
+  const std::size_t half = count / 2;
+  std::atomic<bool> done = false;
+
+  pool.spawn( [&]
+  {
+    parallel_sum( pool, values + half, count - half, sum );
+    done.store( true, std::memory_order_release );
+  } );
+
+  parallel_sum( pool, values, half, sum );
+  pool.help_until( [&] { return done.load( std::memory_order_acquire ); } );
+}
+
+BENCHMARK( ThreadPool, ForkJoinScaling )
+{
+  // Recursively splits a sum over 16M values into tasks of 4096, forking
+  // one half and working on the other, across growing numbers of workers.
+  // Scaling stops at the number of hardware threads.
+  constexpr std::size_t count = 1 << 24;
+
+  ql::Vector<std::uint64_t> values;
+  values.resize( count );
+  for ( std::size_t i = 0; i < count; i++ )
+    values[ i ] = i;
+
+  for ( std::size_t threads : { 1, 2, 4, 8 } )
+  {
+    ql::ThreadPool pool( threads );
+
+    char label[ 64 ];
+    std::snprintf( label, sizeof( label ), "%zu threads", threads );
+
+    state.run( label, 5, [&]
+    {
+      std::atomic<std::uint64_t> sum  = 0;
+      std::atomic<bool>          done = false;
+
+      pool.spawn( [&]
+      {
+        parallel_sum( pool, values.data(), count, sum );
+        done.store( true, std::memory_order_release );
+      } );
+
+      pool.help_until( [&] { return done.load( std::memory_order_acquire ); } );
+      bench::do_not_optimize( sum );
+    } );
+  }
+}
+
+BENCHMARK( TaskGraph, Frame )
+{
+  // A frame of 48 small jobs in 6 stages of 8, each job depending on two of
+  // the previous stage's. Hand-rolled, every stage starts a ql::Thread per
+  // job and joins them all before the next; the graph runs each job as soon
+  // as its own dependencies are done, on a pool started once.
+  constexpr std::size_t stages = 6;
+  constexpr std::size_t width  = 8;
+
+  std::atomic<std::uint64_t> sink = 0;
+
+  auto job = [&]
+  {
+    std::uint64_t x = 1;
+    for ( int i = 0; i < 2000; i++ )
+      x = x * 6364136223846793005 + 1442695040888963407;
+
+    sink.fetch_add( x, std::memory_order_relaxed );
+  };
+
+  state.run( "ql::Thread per job, join per stage", 20, [&]
+  {
+    for ( std::size_t stage = 0; stage < stages; stage++ )
+    {
+      ql::Thread threads[ width ];
+      for ( ql::Thread& thread : threads )
+        thread = job;
+    }
+  } );
+
+  ql::ThreadPool pool;
+  ql::TaskGraph  graph;
+
+  ql::TaskGraph::Task previous[ width ];
+  for ( std::size_t stage = 0; stage < stages; stage++ )
+  {
+    ql::TaskGraph::Task current[ width ];
+    for ( std::size_t i = 0; i < width; i++ )
+    {
+      current[ i ] = graph.add( "job", job );
+
+      if ( stage != 0 )
+      {
+        graph.precede( previous[ i ], current[ i ] );
+        graph.precede( previous[ ( i + 1 ) % width ], current[ i ] );
+      }
+    }
+
+    std::copy( current, current + width, previous );
+  }
+
+  state.run( "TaskGraph", 200, [&] { graph.run( pool ); } );
+
+  state.report( "TaskGraph last run, elapsed", double( graph.elapsed_time() ), "ns" );
+  state.report( "TaskGraph last run, critical path", double( graph.critical_path_time() ), "ns" );
+}
+
+static ql::Task<std::uint64_t> next_value( std::uint64_t x )
+{
+  co_return x + 1;
+}
+
+static ql::Task<std::uint64_t> await_chain( std::size_t count )
+{
+  std::uint64_t value = 0;
+  for ( std::size_t i = 0; i < count; i++ )
+    value = co_await next_value( value );
+
+  co_return value;
+}
+
+static ql::Generator<std::uint64_t> iota()
+{
+  for ( std::uint64_t i = 0;; i++ )
+    co_yield i;
+}
+
+static ql::Task<void> hop( ql::Scheduler& scheduler, std::size_t count )
+{
+  for ( std::size_t i = 0; i < count; i++ )
+    co_await scheduler.schedule();
+}
+
+BENCHMARK( Coroutine, ContextSwitch )
+{
+  // The cost of passing control from one flow of execution to another and
+  // back. Awaiting a task creates its frame and transfers into and out of
+  // it; a generator only resumes and suspends. Threads hand off through an
+  // atomic wait, and a scheduler hop moves a coroutine onto a pool worker.
+  constexpr std::size_t switches = 1'000'000;
+
+  // Reports the fastest of a few runs, per switch
+  auto measure = [&]( const char* label, std::size_t count, auto&& body )
+  {
+    double best = 0.0;
+    for ( int r = 0; r < 3; r++ )
+    {
+      const auto start = std::chrono::steady_clock::now();
+      body();
+      const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+      if ( r == 0 || elapsed.count() < best )
+        best = elapsed.count();
+    }
+
+    state.report( label, best / double( count ), "ns/switch" );
+  };
+
+  measure( "Task await, pooled frames", 2 * switches, [&] { bench::do_not_optimize( ql::sync_wait( await_chain( switches ) ) ); } );
+
+  ql::MemoryResource* pooled = ql::set_coroutine_resource( ql::new_delete_resource() );
+  measure( "Task await, frames from new", 2 * switches, [&] { bench::do_not_optimize( ql::sync_wait( await_chain( switches ) ) ); } );
+  ql::set_coroutine_resource( pooled );
+
+  measure( "Generator resume", 2 * switches, [&]
+  {
+    std::uint64_t sum = 0;
+    for ( std::uint64_t value : iota() )
+    {
+      if ( value == switches )
+        break;
+
+      sum += value;
+    }
+
+    bench::do_not_optimize( sum );
+  } );
+
+  constexpr std::size_t handoffs = 20'000;
+
+  measure( "thread handoff", 2 * handoffs, [&]
+  {
+    std::atomic<std::uint32_t> turn = 0;
+
+    auto play = [&]( std::uint32_t self )
+    {
+      for ( std::uint32_t i = self; i < 2 * handoffs; i += 2 )
+      {
+        for ( std::uint32_t current; ( current = turn.load( std::memory_order_acquire ) ) != i; )
+          turn.wait( current, std::memory_order_acquire );
+
+        turn.store( i + 1, std::memory_order_release );
+        turn.notify_one();
+      }
+    };
+
+    ql::Thread ping = [&] { play( 0 ); };
+    ql::Thread pong = [&] { play( 1 ); };
+  } );
+
+  ql::ThreadPool pool( 2 );
+  ql::Scheduler  scheduler( pool );
+
+  measure( "Scheduler hop", handoffs, [&] { ql::sync_wait( hop( scheduler, handoffs ) ); } );
+}
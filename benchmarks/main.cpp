@@ -0,0 +1,22 @@
+#include "benchmark.hpp"
+#include <cstring>
+
+// Usage: benchmarks [filter]
+// Runs every benchmark whose "Suite.Name" contains filter.
+int main( int argc, char** argv )
+{
+  const char* filter = argc > 1 ? argv[ 1 ] : "";
+
+  char fullName[ 256 ];
+  for ( bench::Registration* r = bench::Registration::head(); r != nullptr; r = r->next )
+  {
+    std::snprintf( fullName, sizeof( fullName ), "%s.%s", r->suite, r->name );
+    if ( std::strstr( fullName, filter ) == nullptr )
+      continue;
+
+    bench::State state( r->suite, r->name );
+    r->function( state );
+  }
+
+  return 0;
+}
@@ -5,7 +5,6 @@
 #include <type_traits>
 #include <memory>
 #include "common/utility.hpp"
-#include "common/memory.hpp"
 
 namespace ql
 {
@@ -13,17 +12,20 @@ namespace ql
 using std::addressof;
 
 template<typename T, typename... Args>
-constexpr T* construct_at( T* ptr, Args&&... args ) noexcept
+constexpr T* construct_at( T* ptr, Args&&... args ) noexcept( std::is_nothrow_constructible_v<T, Args...> )
 {
-  return std::construct_at( ptr, forward<Args>( args )... );
+  return std::construct_at( ptr, ql::forward<Args>( args )... );
 }
 
+template<typename ForwardIterator>
+constexpr void destroy( ForwardIterator first, ForwardIterator last );
+
 template<typename T>
 constexpr void destroy_at( T* object )
 {
   if constexpr ( std::is_array_v<T> )
   {
-    destroy( std::begin( *object ), std::end( *object ) );
+    ql::destroy( std::begin( *object ), std::end( *object ) );
   }
   else
   {
@@ -36,7 +38,7 @@ constexpr void destroy( ForwardIterator first, ForwardIterator last )
 {
   while ( first != last )
   {
-    destroy_at( addressof( *first ) );
+    ql::destroy_at( addressof( *first ) );
     first++;
   }
 }
@@ -44,7 +46,7 @@ constexpr void destroy( ForwardIterator first, ForwardIterator last )
 template<typename ForwardIterator>
 constexpr void destroy_n( ForwardIterator first, std::size_t count )
 {
-  destroy( first, first + count );
+  ql::destroy( first, first + count );
 }
 
 template<typename InputIterator, typename OutputIterator>
@@ -61,7 +63,7 @@ constexpr OutputIterator copy( InputIterator first, InputIterator last, OutputIt
 template<typename InputIterator, typename OutputIterator>
 constexpr OutputIterator copy_n( InputIterator input, std::size_t count, OutputIterator out )
 {
-  return copy( input, input + count, out );
+  return ql::copy( input, input + count, out );
 }
 
 template<typename InputIterator, typename OutputIterator>
@@ -69,7 +71,7 @@ constexpr OutputIterator move( InputIterator first, InputIterator last, OutputIt
 {
   while ( first != last )
   {
-    *out++ = move( *first++ );
+    *out++ = ql::move( *first++ );
   }
 
   return out;
@@ -78,7 +80,7 @@ constexpr OutputIterator move( InputIterator first, InputIterator last, OutputIt
 template<typename InputIterator, typename OutputIterator>
 constexpr OutputIterator move_n( InputIterator input, std::size_t count, OutputIterator out )
 {
-  return move( input, input + count, out );
+  return ql::move( input, input + count, out );
 }
 
 template<typename ForwardIterator, typename T>
@@ -94,7 +96,7 @@ constexpr void fill( ForwardIterator first, ForwardIterator last, const T& value
 template<typename ForwardIterator, typename T>
 constexpr void fill_n( ForwardIterator input, std::size_t count, const T& value )
 {
-  fill( input, input + count, value );
+  ql::fill( input, input + count, value );
 }
 
 template<typename InputIterator, typename OutputIterator>
@@ -102,7 +104,7 @@ constexpr OutputIterator uninitialized_copy( InputIterator first, InputIterator
 {
   while ( first != last )
   {
-    construct_at( out, *first );
+    ql::construct_at( out, *first );
     first++, out++;
   }
 
@@ -112,7 +114,7 @@ constexpr OutputIterator uninitialized_copy( InputIterator first, InputIterator
 template<typename InputIterator, typename OutputIterator>
 constexpr OutputIterator uninitialized_copy_n( InputIterator first, std::size_t count, OutputIterator out )
 {
-  return uninitialized_copy( first, first + count, out );
+  return ql::uninitialized_copy( first, first + count, out );
 }
 
 template<typename InputIterator, typename OutputIterator>
@@ -120,7 +122,7 @@ constexpr OutputIterator uninitialized_move( InputIterator first, InputIterator
 {
   while ( first != last )
   {
-    construct_at( out, move( *first ) );
+    ql::construct_at( out, ql::move( *first ) );
     first++, out++;
   }
 
@@ -130,7 +132,7 @@ constexpr OutputIterator uninitialized_move( InputIterator first, InputIterator
 template<typename InputIterator, typename OutputIterator>
 constexpr OutputIterator uninitialized_move_n( InputIterator input, std::size_t count, OutputIterator out )
 {
-  return uninitialized_move( input, input + count, out );
+  return ql::uninitialized_move( input, input + count, out );
 }
 
 template<typename ForwardIterator, typename T>
@@ -138,7 +140,7 @@ constexpr void uninitialized_fill( ForwardIterator first, ForwardIterator last,
 {
   while ( first != last )
   {
-    construct_at( first, value );
+    ql::construct_at( first, value );
     first++;
   }
 }
@@ -146,7 +148,7 @@ constexpr void uninitialized_fill( ForwardIterator first, ForwardIterator last,
 template<typename ForwardIterator, typename T>
 constexpr void uninitialized_fill_n( ForwardIterator input, std::size_t count, const T& value )
 {
-  uninitialized_fill( input, input + count, value );
+  ql::uninitialized_fill( input, input + count, value );
 }
 
 template<typename ForwardIterator>
@@ -154,7 +156,7 @@ constexpr void uninitialized_default_construct( ForwardIterator first, ForwardIt
 {
   while ( first != last )
   {
-    construct_at( first );
+    ql::construct_at( first );
     first++;
   }
 }
@@ -162,7 +164,7 @@ constexpr void uninitialized_default_construct( ForwardIterator first, ForwardIt
 template<typename ForwardIterator>
 constexpr void uninitialized_default_construct_n( ForwardIterator input, std::size_t count )
 {
-  uninitialized_default_construct( input, input + count );
+  ql::uninitialized_default_construct( input, input + count );
 }
 
 template<typename ForwardIterator, typename Compare>
@@ -211,13 +213,13 @@ constexpr auto min( const auto& lhs, const auto& rhs, Compare compare )
 template<typename T>
 constexpr auto min( std::initializer_list<T> list )
 {
-  return *min_element( list.begin(), list.end() );
+  return *ql::min_element( list.begin(), list.end() );
 }
 
 template<typename T, typename Compare>
 constexpr auto min( std::initializer_list<T> list, Compare compare )
 {
-  return *min_element( list.begin(), list.end(), compare );
+  return *ql::min_element( list.begin(), list.end(), compare );
 }
 
 
@@ -267,13 +269,13 @@ constexpr auto max( const auto& lhs, const auto& rhs, Compare compare )
 template<typename T>
 constexpr auto max( std::initializer_list<T> list )
 {
-  return *max_element( list.begin(), list.end() );
+  return *ql::max_element( list.begin(), list.end() );
 }
 
 template<typename T, typename Compare>
 constexpr auto max( std::initializer_list<T> list, Compare compare )
 {
-  return *max_element( list.begin(), list.end(), compare );
+  return *ql::max_element( list.begin(), list.end(), compare );
 }
 
 constexpr auto& clamp( const auto& value, const auto& min, const auto& max )
@@ -300,16 +302,16 @@ constexpr auto& clamp( const auto& value, const auto& min, const auto& max, Comp
 template<typename T>
 constexpr void swap( T& lhs, T& rhs )
 {
-  T tmp    = move( lhs );
-  lhs      = move( rhs );
-  rhs      = move( tmp );
+  T tmp    = ql::move( lhs );
+  lhs      = ql::move( rhs );
+  rhs      = ql::move( tmp );
 }
 
 template<std::size_t N>
 constexpr void swap( auto ( &lhs )[N], auto ( &rhs )[N] )
 {
   for ( std::size_t i = 0; i < N; i++ )
-    swap( lhs[i], rhs[i] );
+    ql::swap( lhs[i], rhs[i] );
 }
 
 template<typename ForwardIterator>
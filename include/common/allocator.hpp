@@ -1,6 +1,11 @@
 #pragma once
+#include <atomic>
+#include <bit>
 #include <cstddef>
 #include <cmath>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 namespace ql
 {
@@ -19,36 +24,127 @@ public:
 
   using value_type = T;
 
+  constexpr Allocator() = default;
+
+  template<typename U>
+  constexpr Allocator( const Allocator<U>& )
+  {
+  }
+
+  // Over-aligned types go through the aligned operator new, as plain
+  // operator new only guarantees __STDCPP_DEFAULT_NEW_ALIGNMENT__.
   constexpr value_type* allocate( std::size_t size )
   {
-    return reinterpret_cast<value_type*>( ::operator new( size * sizeof( T ) ) );
+    if constexpr ( alignof( T ) > __STDCPP_DEFAULT_NEW_ALIGNMENT__ )
+      return reinterpret_cast<value_type*>( ::operator new( size * sizeof( T ), std::align_val_t( alignof( T ) ) ) );
+    else
+      return reinterpret_cast<value_type*>( ::operator new( size * sizeof( T ) ) );
   }
 
   constexpr AllocationResult<value_type*> allocate_at_least( std::size_t size )
   {
-    constexpr std::size_t minimum_allocation = 4;
-    size += minimum_allocation - ( minimum_allocation % size );
     return AllocationResult<value_type*> { allocate( size ), size };
   }
 
   constexpr void deallocate( value_type* memory, std::size_t size )
   {
-    ::operator delete( memory );
+    if constexpr ( alignof( T ) > __STDCPP_DEFAULT_NEW_ALIGNMENT__ )
+      ::operator delete( memory, size * sizeof( T ), std::align_val_t( alignof( T ) ) );
+    else
+      ::operator delete( memory, size * sizeof( T ) );
+  }
+
+  template<typename U>
+  constexpr bool operator==( const Allocator<U>& ) const
+  {
+    return true;
   }
 
 };
 
-template<typename T>
+// An allocator whose allocations start on an Alignment boundary, whatever
+// the alignment of T; for example a cache line (64), an AVX-512 register
+// (64) or a page (4096) for direct I/O.
+//
+// allocate_at_least() rounds up to a whole multiple of Alignment, so a SIMD
+// loop can run over the padding at the end instead of handling a tail.
+template<typename T, std::size_t Alignment>
+class AlignedAllocator
+{
+  static_assert( std::has_single_bit( Alignment ), "AlignedAllocator: Alignment must be a power of two" );
+
+public:
+
+  using value_type = T;
+
+  static constexpr std::size_t alignment = Alignment > alignof( T ) ? Alignment : alignof( T );
+
+  // Needed explicitly, as std::allocator_traits can only rebind type
+  // template arguments
+  template<typename U>
+  struct rebind
+  {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  constexpr AlignedAllocator() = default;
+
+  template<typename U>
+  constexpr AlignedAllocator( const AlignedAllocator<U, Alignment>& )
+  {
+  }
+
+  [[nodiscard]] value_type* allocate( std::size_t size )
+  {
+    return static_cast<value_type*>( ::operator new( size * sizeof( T ), std::align_val_t( alignment ) ) );
+  }
+
+  AllocationResult<value_type*> allocate_at_least( std::size_t size )
+  {
+    const std::size_t bytes = ( size * sizeof( T ) + alignment - 1 ) & ~( alignment - 1 );
+    return AllocationResult<value_type*> { allocate( bytes / sizeof( T ) ), bytes / sizeof( T ) };
+  }
+
+  void deallocate( value_type* memory, std::size_t size )
+  {
+    ::operator delete( memory, size * sizeof( T ), std::align_val_t( alignment ) );
+  }
+
+  template<typename U>
+  constexpr bool operator==( const AlignedAllocator<U, Alignment>& ) const
+  {
+    return true;
+  }
+
+};
+
+// Allocates at least size objects through allocator, using its own
+// allocate_at_least() when it has one.
+template<typename Allocator>
+constexpr auto allocate_at_least( Allocator& allocator, std::size_t size )
+{
+  using pointer = typename std::allocator_traits<Allocator>::pointer;
+
+  if constexpr ( requires { allocator.allocate_at_least( size ); } )
+    return allocator.allocate_at_least( size );
+  else
+    return AllocationResult<pointer> { allocator.allocate( size ), size };
+}
+
+// An abstract source of memory, selected at runtime rather than through a
+// container's template arguments.
 class MemoryResource
 {
 public:
 
-  void* allocate( std::size_t bytes, std::size_t alignment )
+  virtual ~MemoryResource() = default;
+
+  [[nodiscard]] void* allocate( std::size_t bytes, std::size_t alignment = alignof( std::max_align_t ) )
   {
     return do_allocate( bytes, alignment );
   }
 
-  void deallocate( void* memory, std::size_t bytes, std::size_t alignment )
+  void deallocate( void* memory, std::size_t bytes, std::size_t alignment = alignof( std::max_align_t ) )
   {
     do_deallocate( memory, bytes, alignment );
   }
@@ -58,6 +154,11 @@ public:
     return do_is_equal( other );
   }
 
+  bool operator==( const MemoryResource& other ) const
+  {
+    return this == &other || is_equal( other );
+  }
+
 private:
 
   virtual void* do_allocate( std::size_t bytes, std::size_t alignment ) = 0;
@@ -66,50 +167,209 @@ private:
 
 };
 
+namespace detail
+{
+
+// Forwards to the global operator new and delete
+class NewDeleteResource final : public MemoryResource
+{
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    if ( alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ )
+      return ::operator new( bytes, std::align_val_t( alignment ) );
+
+    return ::operator new( bytes );
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    if ( alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ )
+      ::operator delete( memory, bytes, std::align_val_t( alignment ) );
+    else
+      ::operator delete( memory, bytes );
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+};
+
+// Fails every allocation; useful as the upstream of a resource that must
+// never reach past its initial buffer.
+class NullMemoryResource final : public MemoryResource
+{
+  void* do_allocate( std::size_t, std::size_t ) override
+  {
+    throw std::bad_alloc();
+  }
+
+  void do_deallocate( void*, std::size_t, std::size_t ) override
+  {
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+};
+
+} // namespace detail
+
+inline MemoryResource* new_delete_resource() noexcept
+{
+  static detail::NewDeleteResource resource;
+  return &resource;
+}
+
+inline MemoryResource* null_memory_resource() noexcept
+{
+  static detail::NullMemoryResource resource;
+  return &resource;
+}
+
+namespace detail
+{
+
+inline std::atomic<MemoryResource*>& default_resource()
+{
+  static std::atomic<MemoryResource*> resource = new_delete_resource();
+  return resource;
+}
+
+} // namespace detail
+
+inline MemoryResource* get_default_resource() noexcept
+{
+  return detail::default_resource().load( std::memory_order_acquire );
+}
+
+// Replaces the resource used when none is given, returning the previous one.
+// Passing nullptr restores new_delete_resource().
+inline MemoryResource* set_default_resource( MemoryResource* resource ) noexcept
+{
+  if ( resource == nullptr )
+    resource = new_delete_resource();
+
+  return detail::default_resource().exchange( resource, std::memory_order_acq_rel );
+}
+
+// An allocator drawing from a MemoryResource chosen at runtime, so that
+// containers sharing an element type can use different memory without
+// changing their type.
+//
+// Containers pass it on to the elements they construct (uses-allocator
+// construction), so a Vector of Strings places the strings' characters in
+// the same resource as the vector itself. Like std::pmr, it is never
+// propagated by assignment or swap, and copies of a container use the
+// default resource.
 template<typename T>
 class PolymorphicAllocator
 {
 public:
 
-  using value_type = T*;
+  using value_type = T;
 
-  PolymorphicAllocator( MemoryResource<T>* resource )
+  PolymorphicAllocator() noexcept
+  : m_resource( get_default_resource() )
+  {
+  }
+
+  PolymorphicAllocator( MemoryResource* resource ) noexcept
   : m_resource( resource )
   {
   }
 
+  template<typename U>
+  PolymorphicAllocator( const PolymorphicAllocator<U>& other ) noexcept
+  : m_resource( other.resource() )
+  {
+  }
+
+  PolymorphicAllocator& operator=( const PolymorphicAllocator& ) = delete;
+
   [[nodiscard]] T* allocate( std::size_t size )
   {
-    return m_resource->allocate( size * sizeof( T ), alignof( T ) );
+    return static_cast<T*>( m_resource->allocate( size * sizeof( T ), alignof( T ) ) );
   }
 
   void deallocate( T* memory, std::size_t size )
   {
-    return m_resource->deallocate( memory, size * sizeof( T ), alignof( T ) );
+    m_resource->deallocate( memory, size * sizeof( T ), alignof( T ) );
   }
 
-  // construct
+  // Constructs object from args, passing this allocator along if U is
+  // allocator-aware.
+  template<typename U, typename... Args>
+  void construct( U* object, Args&&... args )
+  {
+    std::uninitialized_construct_using_allocator( object, *this, std::forward<Args>( args )... );
+  }
 
-  // allocate_bytes
-  // deallocate_bytes
+  [[nodiscard]] void* allocate_bytes( std::size_t bytes, std::size_t alignment = alignof( std::max_align_t ) )
+  {
+    return m_resource->allocate( bytes, alignment );
+  }
 
-  // allocate_object
-  // deallocate_object
+  void deallocate_bytes( void* memory, std::size_t bytes, std::size_t alignment = alignof( std::max_align_t ) )
+  {
+    m_resource->deallocate( memory, bytes, alignment );
+  }
 
-  // new_object
-  // delete_object
+  template<typename U>
+  [[nodiscard]] U* allocate_object( std::size_t count = 1 )
+  {
+    return static_cast<U*>( allocate_bytes( count * sizeof( U ), alignof( U ) ) );
+  }
+
+  template<typename U>
+  void deallocate_object( U* memory, std::size_t count = 1 )
+  {
+    deallocate_bytes( memory, count * sizeof( U ), alignof( U ) );
+  }
+
+  template<typename U, typename... Args>
+  [[nodiscard]] U* new_object( Args&&... args )
+  {
+    U* object = allocate_object<U>();
+
+    try
+    {
+      construct( object, std::forward<Args>( args )... );
+    }
+    catch ( ... )
+    {
+      deallocate_object( object );
+      throw;
+    }
+
+    return object;
+  }
+
+  template<typename U>
+  void delete_object( U* object )
+  {
+    object->~U();
+    deallocate_object( object );
+  }
 
   PolymorphicAllocator select_on_container_copy_construction() const
   {
     return PolymorphicAllocator();
   }
 
-  MemoryResource<T>* resource() const { return m_resource; }
+  MemoryResource* resource() const { return m_resource; }
+
+  template<typename U>
+  bool operator==( const PolymorphicAllocator<U>& other ) const
+  {
+    return *m_resource == *other.resource();
+  }
 
 private:
 
-  MemoryResource<T>* m_resource = nullptr;
+  MemoryResource* m_resource = nullptr;
 
 };
 
-}
+} // namespace ql
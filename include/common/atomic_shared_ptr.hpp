@@ -0,0 +1,247 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/memory.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace ql
+{
+
+// A SharedPtr that may be loaded and replaced by many threads at once
+// without a lock, for read-mostly data such as configuration or routing
+// tables that is swapped out whole.
+//
+// The pointer and a count of references handed out to readers share one
+// word, using split reference counts: the AtomicSharedPtr holds a batch of
+// strong references in advance, and load() claims one of them by
+// incrementing the word. load() itself therefore makes a single atomic
+// increment of the word, and only reads the object's address from the
+// control block, which can't be freed under it since the batch outlives its
+// claims. Releasing the SharedPtr it returns decrements the block's strong
+// count like any other, so a load and release together make two atomic
+// writes to shared lines: the word, then the block. The claims are settled
+// against the batch when the pointer is replaced, or topped up by the reader
+// that finds the batch half spent.
+//
+// Readers on the hot path use a Reader instead, which keeps its own
+// reference to the current object and only reads the word to check it is
+// still current. Until the pointer is replaced, reading writes no shared
+// cache line at all; afterwards each Reader pays for one load() to catch up.
+//
+// Control block addresses must fit in 48 bits, as on current x86-64 and
+// AArch64 systems.
+template<typename T>
+class AtomicSharedPtr
+{
+  using block_type = detail::ControlBlock<AtomicRefCount>;
+
+  static constexpr unsigned      count_shift = 48;
+  static constexpr std::uint64_t count_one   = std::uint64_t( 1 ) << count_shift;
+  static constexpr std::uint64_t block_mask  = count_one - 1;
+
+  // References held per pointer; claims may never reach it
+  static constexpr std::uint64_t batch = std::uint64_t( 1 ) << 14;
+
+public:
+
+  using value_type = SharedPtr<T>;
+
+  AtomicSharedPtr() = default;
+  AtomicSharedPtr( value_type desired ) : m_word( take( desired ) ) {}
+
+  AtomicSharedPtr( const AtomicSharedPtr& ) = delete;
+  AtomicSharedPtr& operator=( const AtomicSharedPtr& ) = delete;
+
+  ~AtomicSharedPtr()
+  {
+    settle( m_word.load( std::memory_order_relaxed ) );
+  }
+
+  AtomicSharedPtr& operator=( value_type desired )
+  {
+    store( ql::move( desired ) );
+    return *this;
+  }
+
+  operator value_type() const { return load(); }
+
+  value_type load() const
+  {
+    // Nothing to claim from an empty pointer
+    if ( block( m_word.load( std::memory_order_relaxed ) ) == nullptr )
+      return value_type();
+
+    const std::uint64_t word    = m_word.fetch_add( count_one, std::memory_order_acquire );
+    block_type*         current = block( word );
+    if ( current == nullptr )
+      return value_type();
+
+    const std::uint64_t claimed = ( word >> count_shift ) + 1;
+    ql::assert( claimed < batch, "AtomicSharedPtr: too many concurrent loads" );
+
+    if ( claimed >= batch / 2 )
+      replenish( current );
+
+    return adopt( current );
+  }
+
+  void store( value_type desired )
+  {
+    settle( m_word.exchange( take( desired ), std::memory_order_acq_rel ) );
+  }
+
+  value_type exchange( value_type desired )
+  {
+    const std::uint64_t word = m_word.exchange( take( desired ), std::memory_order_acq_rel );
+    if ( block( word ) == nullptr )
+      return value_type();
+
+    // Keep one of the returned batch's references for the caller
+    release( block( word ), batch - ( word >> count_shift ) - 1 );
+    return adopt( block( word ) );
+  }
+
+  // Replaces the pointer with desired if it still points to expected's
+  // object. Otherwise loads it into expected.
+  bool compare_exchange_strong( value_type& expected, value_type desired )
+  {
+    block_type* const   wanted      = expected.m_refCount;
+    const std::uint64_t replacement = take( desired );
+
+    std::uint64_t word = m_word.load( std::memory_order_relaxed );
+    while ( block( word ) == wanted )
+    {
+      // Fails spuriously whenever a reader claims a reference, so retry
+      if ( m_word.compare_exchange_weak( word, replacement, std::memory_order_acq_rel, std::memory_order_relaxed ) )
+      {
+        settle( word );
+        return true;
+      }
+    }
+
+    // Return the references taken for desired
+    settle( replacement );
+    expected = load();
+    return false;
+  }
+
+  bool compare_exchange_weak( value_type& expected, value_type desired )
+  {
+    return compare_exchange_strong( expected, ql::move( desired ) );
+  }
+
+  bool is_lock_free() const { return m_word.is_lock_free(); }
+
+  // A reader's cached reference to the current object, kept by one thread,
+  // such as a worker's member or a thread_local. get() reads the shared
+  // word and reloads only if the pointer has been replaced, so the object
+  // it returned last stays alive until the next get().
+  class Reader
+  {
+  public:
+
+    explicit Reader( const AtomicSharedPtr& source )
+    : m_source( &source )
+    {
+    }
+
+    const value_type& get()
+    {
+      // Holding a reference to the cached block keeps its address from
+      // being reused, so an equal address means the same object
+      const std::uint64_t word = m_source->m_word.load( std::memory_order_acquire );
+      if ( block( word ) != m_cached.m_refCount ) [[unlikely]]
+        m_cached = m_source->load();
+
+      return m_cached;
+    }
+
+    const T& operator*() { return *get(); }
+    const T* operator->() { return get().get(); }
+
+    // Drops the cached reference, letting a replaced object go
+    void reset() { m_cached.reset(); }
+
+  private:
+
+    const AtomicSharedPtr* m_source;
+    value_type             m_cached;
+  };
+
+  Reader reader() const { return Reader( *this ); }
+
+private:
+
+  static block_type* block( std::uint64_t word )
+  {
+    return reinterpret_cast<block_type*>( word & block_mask );
+  }
+
+  // Takes over desired's reference and adds the rest of a batch
+  static std::uint64_t take( value_type& desired )
+  {
+    block_type* taken = desired.m_refCount;
+    if ( taken == nullptr )
+      return 0;
+
+    const std::uint64_t address = reinterpret_cast<std::uintptr_t>( taken );
+    ql::assert( ( address & ~block_mask ) == 0, "AtomicSharedPtr: address exceeds 48 bits" );
+
+    taken->strong.increment( batch - 1 );
+
+    desired.m_refCount = nullptr;
+    desired.m_object   = nullptr;
+    return address;
+  }
+
+  static value_type adopt( block_type* current )
+  {
+    value_type shared;
+    shared.m_object   = static_cast<T*>( current->object );
+    shared.m_refCount = current;
+    return shared;
+  }
+
+  static void release( block_type* current, std::uint64_t references )
+  {
+    if ( references != 0 && current->strong.decrement( references ) )
+    {
+      current->dispose( current );
+
+      if ( current->weak.decrement() )
+        current->destroy( current );
+    }
+  }
+
+  // Returns the references a replaced word held that were never claimed
+  static void settle( std::uint64_t word )
+  {
+    if ( block( word ) != nullptr )
+      release( block( word ), batch - ( word >> count_shift ) );
+  }
+
+  // Adds references to the block and takes as many claims off the word, so
+  // long as it still points to the block. The block is safe to touch as this
+  // thread's claim keeps it alive.
+  void replenish( block_type* current ) const
+  {
+    constexpr std::uint64_t refill = batch / 2;
+    current->strong.increment( refill );
+
+    std::uint64_t word = m_word.load( std::memory_order_relaxed );
+    while ( block( word ) == current && ( word >> count_shift ) >= refill )
+    {
+      if ( m_word.compare_exchange_weak( word, word - refill * count_one, std::memory_order_relaxed ) )
+        return;
+    }
+
+    // Replaced, or replenished by another reader first
+    current->strong.decrement( refill );
+  }
+
+  mutable std::atomic<std::uint64_t> m_word = 0;
+};
+
+} // namespace ql
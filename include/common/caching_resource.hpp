@@ -0,0 +1,448 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/allocator.hpp"
+#include "common/thread_local.hpp"
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace ql
+{
+
+// A memory resource for small allocations that are made on one thread and
+// often freed on another.
+//
+// Blocks are carved from slabs, each owned by one thread's cache. A thread
+// allocates from and frees into its own per-size-class magazine without any
+// synchronisation. A block freed by a thread other than its slab's owner is
+// pushed onto the owner's lock-free remote free list, which the owner drains
+// once its magazine runs dry. Magazines that overfill are handed, as a batch,
+// to a global depot from which any thread can take a full magazine at once.
+//
+// Requests larger than max_cached_block, or aligned beyond their size class,
+// are forwarded to upstream. Upstream is only ever called with the resource's
+// lock held, so it need not be thread-safe.
+class ThreadCachingResource : public MemoryResource
+{
+  struct Block
+  {
+    Block* next;
+    Block* nextBatch; // Links magazines together in the depot
+  };
+
+  struct ThreadCache;
+
+  struct alignas( 64 ) Slab
+  {
+    ThreadCache* owner;
+    Slab*        next;
+    std::size_t  sizeClass;
+  };
+
+  struct Bin
+  {
+    Block*      blocks = nullptr;
+    std::size_t count  = 0;
+    byte_t*     carve  = nullptr; // Not yet carved part of the newest slab
+    byte_t*     end    = nullptr;
+  };
+
+  struct Depot
+  {
+    std::mutex mutex;
+    Block*     batches = nullptr;
+  };
+
+public:
+
+  static constexpr std::size_t slab_size        = 64 * 1024;
+  static constexpr std::size_t smallest_block   = sizeof( Block );
+  static constexpr std::size_t max_cached_block = 2048;
+  static constexpr std::size_t magazine_size    = 32;
+
+private:
+
+  static constexpr std::size_t class_count =
+    std::size_t( std::countr_zero( max_cached_block ) - std::countr_zero( smallest_block ) ) + 1;
+
+  struct alignas( 64 ) ThreadCache
+  {
+    Bin bins[ class_count ];
+
+    // Blocks from this cache's slabs, freed by other threads
+    alignas( 64 ) std::atomic<Block*> remote = nullptr;
+
+    ThreadCache* next      = nullptr;
+    bool         abandoned = false;
+  };
+
+  // The calling thread's cache, which outlives the thread if its slabs are
+  // still in use; it is then adopted by the next thread to arrive.
+  struct LocalCache
+  {
+    ThreadCachingResource* resource = nullptr;
+    ThreadCache*           cache    = nullptr;
+
+    void on_thread_exit()
+    {
+      if ( cache != nullptr )
+        resource->abandon( cache );
+    }
+  };
+
+public:
+
+  ThreadCachingResource()
+  : ThreadCachingResource( get_default_resource() )
+  {
+  }
+
+  explicit ThreadCachingResource( MemoryResource* upstream )
+  : m_upstream( upstream )
+  {
+  }
+
+  ThreadCachingResource( const ThreadCachingResource& ) = delete;
+  ThreadCachingResource& operator=( const ThreadCachingResource& ) = delete;
+
+  // Every block handed out by the resource is freed along with it.
+  ~ThreadCachingResource() override
+  {
+    m_local.clear();
+
+    Slab* slab = m_slabs;
+    while ( slab != nullptr )
+    {
+      Slab* next = slab->next;
+      m_upstream->deallocate( slab, slab_size, slab_size );
+      slab = next;
+    }
+
+    ThreadCache* cache = m_caches;
+    while ( cache != nullptr )
+    {
+      ThreadCache* next = cache->next;
+      delete cache;
+      cache = next;
+    }
+  }
+
+  MemoryResource* upstream_resource() const { return m_upstream; }
+
+  // The bytes actually available to an allocation of bytes and alignment
+  static constexpr std::size_t usable_size( std::size_t bytes, std::size_t alignment )
+  {
+    const std::size_t sizeClass = size_class( bytes, alignment );
+    return sizeClass < class_count ? block_size( sizeClass ) : bytes;
+  }
+
+  // The number of slabs requested from upstream so far
+  std::size_t slab_count() const
+  {
+    std::lock_guard lock( m_mutex );
+    return m_slabCount;
+  }
+
+private:
+
+  static constexpr std::size_t size_class( std::size_t bytes, std::size_t alignment )
+  {
+    const std::size_t size = bytes > alignment ? bytes : alignment;
+    if ( size <= smallest_block )
+      return 0;
+
+    return std::size_t( std::bit_width( ( size - 1 ) / smallest_block ) );
+  }
+
+  static constexpr std::size_t block_size( std::size_t sizeClass )
+  {
+    return smallest_block << sizeClass;
+  }
+
+  static Slab* slab_of( void* block )
+  {
+    return reinterpret_cast<Slab*>( reinterpret_cast<std::uintptr_t>( block ) & ~( slab_size - 1 ) );
+  }
+
+  ThreadCache& local_cache()
+  {
+    LocalCache& local = m_local.get();
+    if ( local.cache == nullptr ) [[unlikely]]
+    {
+      local.resource = this;
+      local.cache    = adopt();
+    }
+
+    return *local.cache;
+  }
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    const std::size_t sizeClass = size_class( bytes, alignment );
+    if ( sizeClass >= class_count )
+    {
+      std::lock_guard lock( m_mutex );
+      return m_upstream->allocate( bytes, alignment );
+    }
+
+    ThreadCache& cache = local_cache();
+    Bin&         bin   = cache.bins[ sizeClass ];
+
+    if ( bin.blocks == nullptr ) [[unlikely]]
+      refill( cache, sizeClass );
+
+    if ( bin.blocks != nullptr )
+    {
+      Block* block = bin.blocks;
+      bin.blocks   = block->next;
+      bin.count--;
+      return block;
+    }
+
+    // Carve a fresh block, starting a new slab if need be
+    if ( bin.carve == bin.end )
+      new_slab( cache, sizeClass );
+
+    void* block = bin.carve;
+    bin.carve += block_size( sizeClass );
+    return block;
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    const std::size_t sizeClass = size_class( bytes, alignment );
+    if ( sizeClass >= class_count )
+    {
+      std::lock_guard lock( m_mutex );
+      m_upstream->deallocate( memory, bytes, alignment );
+      return;
+    }
+
+    Block*       block = static_cast<Block*>( memory );
+    ThreadCache& cache = local_cache();
+    ThreadCache* owner = slab_of( memory )->owner;
+
+    if ( owner != &cache )
+    {
+      // Hand the block back to its owner
+      Block* head = owner->remote.load( std::memory_order_relaxed );
+      do
+      {
+        block->next = head;
+      } while ( !owner->remote.compare_exchange_weak( head, block, std::memory_order_release,
+                                                      std::memory_order_relaxed ) );
+      return;
+    }
+
+    Bin& bin    = cache.bins[ sizeClass ];
+    block->next = bin.blocks;
+    bin.blocks  = block;
+    bin.count++;
+
+    if ( bin.count >= magazine_size * 2 ) [[unlikely]]
+      flush( bin, sizeClass, magazine_size );
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  // Fills an empty bin from the remote free list, then from the depot
+  void refill( ThreadCache& cache, std::size_t sizeClass )
+  {
+    drain_remote( cache );
+
+    Bin& bin = cache.bins[ sizeClass ];
+    if ( bin.blocks != nullptr )
+      return;
+
+    Depot& depot = m_depots[ sizeClass ];
+    std::lock_guard lock( depot.mutex );
+
+    if ( depot.batches != nullptr )
+    {
+      bin.blocks     = depot.batches;
+      bin.count      = magazine_size;
+      depot.batches  = depot.batches->nextBatch;
+    }
+  }
+
+  // Moves remotely freed blocks into their bins
+  void drain_remote( ThreadCache& cache )
+  {
+    Block* block = cache.remote.exchange( nullptr, std::memory_order_acquire );
+    while ( block != nullptr )
+    {
+      Block*      next      = block->next;
+      std::size_t sizeClass = slab_of( block )->sizeClass;
+      Bin&        bin       = cache.bins[ sizeClass ];
+
+      block->next = bin.blocks;
+      bin.blocks  = block;
+      bin.count++;
+
+      block = next;
+    }
+
+    for ( std::size_t i = 0; i < class_count; i++ )
+    {
+      while ( cache.bins[ i ].count >= magazine_size * 2 )
+        flush( cache.bins[ i ], i, magazine_size );
+    }
+  }
+
+  // Moves count blocks from bin into the depot as a single batch
+  void flush( Bin& bin, std::size_t sizeClass, std::size_t count )
+  {
+    Block* batch = bin.blocks;
+    Block* last  = batch;
+    for ( std::size_t i = 1; i < count; i++ )
+      last = last->next;
+
+    bin.blocks = last->next;
+    bin.count -= count;
+    last->next = nullptr;
+
+    Depot& depot = m_depots[ sizeClass ];
+    std::lock_guard lock( depot.mutex );
+
+    batch->nextBatch = depot.batches;
+    depot.batches    = batch;
+  }
+
+  void new_slab( ThreadCache& cache, std::size_t sizeClass )
+  {
+    Slab* slab;
+    {
+      std::lock_guard lock( m_mutex );
+
+      slab = static_cast<Slab*>( m_upstream->allocate( slab_size, slab_size ) );
+      slab->next = m_slabs;
+      m_slabs    = slab;
+      m_slabCount++;
+    }
+
+    slab->owner     = &cache;
+    slab->sizeClass = sizeClass;
+
+    const std::size_t size   = block_size( sizeClass );
+    const std::size_t offset = size > sizeof( Slab ) ? size : sizeof( Slab );
+
+    Bin& bin  = cache.bins[ sizeClass ];
+    bin.carve = reinterpret_cast<byte_t*>( slab ) + offset;
+    bin.end   = bin.carve + ( slab_size - offset ) / size * size;
+  }
+
+  // Gives the calling thread a cache, preferring one left behind by a thread
+  // that has exited.
+  ThreadCache* adopt()
+  {
+    std::lock_guard lock( m_mutex );
+
+    for ( ThreadCache* cache = m_caches; cache != nullptr; cache = cache->next )
+    {
+      if ( cache->abandoned )
+      {
+        cache->abandoned = false;
+        return cache;
+      }
+    }
+
+    ThreadCache* cache = new ThreadCache;
+    cache->next = m_caches;
+    m_caches    = cache;
+    return cache;
+  }
+
+  // Returns an exiting thread's blocks to the depot. The cache itself stays
+  // behind to receive remote frees for its slabs.
+  void abandon( ThreadCache* cache )
+  {
+    drain_remote( *cache );
+
+    for ( std::size_t i = 0; i < class_count; i++ )
+    {
+      Bin& bin = cache->bins[ i ];
+      while ( bin.count >= magazine_size )
+        flush( bin, i, magazine_size );
+    }
+
+    std::lock_guard lock( m_mutex );
+    cache->abandoned = true;
+  }
+
+  MemoryResource* m_upstream = nullptr;
+
+  Depot m_depots[ class_count ];
+
+  mutable std::mutex m_mutex;
+  Slab*              m_slabs     = nullptr;
+  std::size_t        m_slabCount = 0;
+  ThreadCache*       m_caches    = nullptr;
+
+  ThreadLocal<LocalCache> m_local;
+};
+
+// The process-wide ThreadCachingResource used by ThreadCachingAllocator
+inline ThreadCachingResource& thread_caching_resource()
+{
+  static ThreadCachingResource resource;
+  return resource;
+}
+
+// Adapts a ThreadCachingResource to the allocator interface of ql::Vector.
+// allocate_at_least() reports the whole block of the chosen size class, so
+// growing containers make use of the rounding.
+template<typename T>
+class ThreadCachingAllocator
+{
+public:
+
+  using value_type = T;
+
+  ThreadCachingAllocator() = default;
+
+  ThreadCachingAllocator( ThreadCachingResource* resource )
+  : m_resource( resource )
+  {
+  }
+
+  template<typename U>
+  ThreadCachingAllocator( const ThreadCachingAllocator<U>& other )
+  : m_resource( other.resource() )
+  {
+  }
+
+  [[nodiscard]] T* allocate( std::size_t size )
+  {
+    return static_cast<T*>( m_resource->allocate( size * sizeof( T ), alignof( T ) ) );
+  }
+
+  AllocationResult<T*> allocate_at_least( std::size_t size )
+  {
+    const std::size_t bytes = ThreadCachingResource::usable_size( size * sizeof( T ), alignof( T ) );
+    return AllocationResult<T*> { allocate( bytes / sizeof( T ) ), bytes / sizeof( T ) };
+  }
+
+  void deallocate( T* memory, std::size_t size )
+  {
+    m_resource->deallocate( memory, size * sizeof( T ), alignof( T ) );
+  }
+
+  ThreadCachingResource* resource() const { return m_resource; }
+
+  template<typename U>
+  bool operator==( const ThreadCachingAllocator<U>& other ) const
+  {
+    return m_resource == other.resource();
+  }
+
+private:
+
+  ThreadCachingResource* m_resource = &thread_caching_resource();
+};
+
+} // namespace ql
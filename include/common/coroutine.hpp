@@ -0,0 +1,699 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include "common/caching_resource.hpp"
+#include "common/ref_ptr.hpp"
+#include "common/thread_pool.hpp"
+#include "common/vector.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <type_traits>
+
+namespace ql
+{
+
+namespace detail
+{
+
+// Never destroyed, as frames may be freed during static destruction
+inline MemoryResource* pooled_coroutine_resource()
+{
+  static ThreadCachingResource* pooled = new ThreadCachingResource( new_delete_resource() );
+  return pooled;
+}
+
+inline std::atomic<MemoryResource*>& coroutine_resource()
+{
+  static std::atomic<MemoryResource*> resource = pooled_coroutine_resource();
+  return resource;
+}
+
+} // namespace detail
+
+// The resource coroutine frames are allocated from: by default a
+// ThreadCachingResource, so a frame is usually a pop from the calling
+// thread's free list rather than a trip through global new.
+inline MemoryResource* get_coroutine_resource() noexcept
+{
+  return detail::coroutine_resource().load( std::memory_order_acquire );
+}
+
+// Replaces the resource for coroutine frames, returning the previous one.
+// Passing nullptr restores the pooled default. Frames are freed to the
+// resource they came from, which must outlive them.
+inline MemoryResource* set_coroutine_resource( MemoryResource* resource ) noexcept
+{
+  if ( resource == nullptr )
+    resource = detail::pooled_coroutine_resource();
+
+  return detail::coroutine_resource().exchange( resource, std::memory_order_acq_rel );
+}
+
+template<typename T = void>
+class Task;
+
+namespace detail
+{
+
+// Allocates frames of the coroutines whose promises derive from it from the
+// coroutine resource. The resource is stored after the frame.
+struct PooledFrame
+{
+  static void* operator new( std::size_t size )
+  {
+    MemoryResource* resource = get_coroutine_resource();
+
+    void* frame = resource->allocate( size + sizeof( resource ), alignof( std::max_align_t ) );
+    std::memcpy( static_cast<byte_t*>( frame ) + size, &resource, sizeof( resource ) );
+    return frame;
+  }
+
+  static void operator delete( void* frame, std::size_t size )
+  {
+    MemoryResource* resource;
+    std::memcpy( &resource, static_cast<byte_t*>( frame ) + size, sizeof( resource ) );
+    resource->deallocate( frame, size + sizeof( resource ), alignof( std::max_align_t ) );
+  }
+};
+
+class TaskPromiseBase : public PooledFrame
+{
+  template<typename T>
+  friend class ql::Task;
+
+  struct FinalAwaiter
+  {
+    bool await_ready() noexcept { return false; }
+
+    // Transfers straight to the awaiting coroutine, without growing the stack
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<Promise> coroutine ) noexcept
+    {
+      return coroutine.promise().m_continuation;
+    }
+
+    void await_resume() noexcept {}
+  };
+
+public:
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter        final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { m_exception = std::current_exception(); }
+
+protected:
+
+  void rethrow()
+  {
+    if ( m_exception )
+      std::rethrow_exception( m_exception );
+  }
+
+private:
+
+  std::coroutine_handle<> m_continuation = std::noop_coroutine();
+  std::exception_ptr      m_exception;
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase
+{
+public:
+
+  TaskPromise() {}
+
+  ~TaskPromise()
+  {
+    if ( m_hasValue )
+      ql::destroy_at( &m_value );
+  }
+
+  Task<T> get_return_object() noexcept;
+
+  template<typename U>
+    requires std::is_constructible_v<T, U&&>
+  void return_value( U&& value )
+  {
+    ql::construct_at( &m_value, ql::forward<U>( value ) );
+    m_hasValue = true;
+  }
+
+  T result()
+  {
+    rethrow();
+    return ql::move( m_value );
+  }
+
+private:
+
+  union
+  {
+    T m_value;
+  };
+
+  bool m_hasValue = false;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase
+{
+public:
+
+  Task<void> get_return_object() noexcept;
+
+  void return_void() {}
+
+  void result() { rethrow(); }
+};
+
+} // namespace detail
+
+// A coroutine producing a T, for asynchronous code written sequentially.
+//
+// Tasks are lazy: nothing runs until the task is awaited, and awaiting
+// transfers control straight into it. When it finishes, control transfers
+// straight back to the awaiting coroutine, so long chains of tasks run in
+// constant stack space. Exceptions escaping the task are rethrown to the
+// awaiting coroutine.
+//
+// A Task owns its coroutine, which is destroyed along with it. Frames come
+// from the coroutine resource; see set_coroutine_resource().
+template<typename T>
+class [[nodiscard]] Task
+{
+  static_assert( !std::is_reference_v<T>, "Task: references aren't supported" );
+
+  struct Awaiter
+  {
+    bool await_ready() noexcept { return coroutine.done(); }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> awaiting ) noexcept
+    {
+      coroutine.promise().m_continuation = awaiting;
+      return coroutine;
+    }
+
+    std::coroutine_handle<detail::TaskPromise<T>> coroutine;
+  };
+
+public:
+
+  using promise_type = detail::TaskPromise<T>;
+  using value_type   = T;
+
+  Task() = default;
+
+  Task( Task&& other ) : m_coroutine( ql::exchange( other.m_coroutine, nullptr ) ) {}
+
+  Task& operator=( Task&& other )
+  {
+    if ( this != &other )
+    {
+      if ( m_coroutine )
+        m_coroutine.destroy();
+
+      m_coroutine = ql::exchange( other.m_coroutine, nullptr );
+    }
+
+    return *this;
+  }
+
+  ~Task()
+  {
+    if ( m_coroutine )
+      m_coroutine.destroy();
+  }
+
+  // Runs the task to completion, resuming the awaiting coroutine with its
+  // result
+  auto operator co_await() && noexcept
+  {
+    struct ResultAwaiter : Awaiter
+    {
+      T await_resume() { return this->coroutine.promise().result(); }
+    };
+
+    ql::assert( valid(), "Task: awaited an empty task" );
+    return ResultAwaiter { { m_coroutine } };
+  }
+
+  // Runs the task to completion, leaving the result for result()
+  auto when_ready() noexcept
+  {
+    struct ReadyAwaiter : Awaiter
+    {
+      void await_resume() noexcept {}
+    };
+
+    ql::assert( valid(), "Task: awaited an empty task" );
+    return ReadyAwaiter { { m_coroutine } };
+  }
+
+  // The result of a finished task, or the exception it threw
+  T result() &&
+  {
+    ql::assert( done(), "Task: result of an unfinished task" );
+    return m_coroutine.promise().result();
+  }
+
+  bool valid() const { return bool( m_coroutine ); }
+  bool done() const { return m_coroutine && m_coroutine.done(); }
+
+private:
+
+  friend promise_type;
+
+  explicit Task( std::coroutine_handle<promise_type> coroutine ) : m_coroutine( coroutine ) {}
+
+  std::coroutine_handle<promise_type> m_coroutine = nullptr;
+};
+
+namespace detail
+{
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+  return Task<T>( std::coroutine_handle<TaskPromise>::from_promise( *this ) );
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+  return Task<void>( std::coroutine_handle<TaskPromise>::from_promise( *this ) );
+}
+
+// A coroutine that, once started, runs to completion on its own and then
+// destroys itself, calling notify on the way out. notify returns the
+// coroutine to continue with, if any.
+class Notifier
+{
+public:
+
+  using notify_function = std::coroutine_handle<> ( * )( void* context );
+
+  struct promise_type : PooledFrame
+  {
+    struct FinalAwaiter
+    {
+      bool await_ready() noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> coroutine ) noexcept
+      {
+        const notify_function notify  = coroutine.promise().notify;
+        void* const           context = coroutine.promise().context;
+
+        coroutine.destroy();
+        return notify != nullptr ? notify( context ) : std::noop_coroutine();
+      }
+
+      void await_resume() noexcept {}
+    };
+
+    Notifier get_return_object() noexcept
+    {
+      return Notifier( std::coroutine_handle<promise_type>::from_promise( *this ) );
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter        final_suspend() noexcept { return {}; }
+
+    void return_void() {}
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    notify_function notify  = nullptr;
+    void*           context = nullptr;
+  };
+
+  Notifier( Notifier&& other ) : m_coroutine( ql::exchange( other.m_coroutine, nullptr ) ) {}
+
+  Notifier& operator=( Notifier&& ) = delete;
+
+  ~Notifier()
+  {
+    if ( m_coroutine )
+      m_coroutine.destroy();
+  }
+
+  void start( notify_function notify = nullptr, void* context = nullptr )
+  {
+    m_coroutine.promise().notify  = notify;
+    m_coroutine.promise().context = context;
+    ql::exchange( m_coroutine, nullptr ).resume();
+  }
+
+private:
+
+  explicit Notifier( std::coroutine_handle<promise_type> coroutine ) : m_coroutine( coroutine ) {}
+
+  std::coroutine_handle<promise_type> m_coroutine;
+};
+
+template<typename T>
+Notifier notify_when_ready( Task<T>& task )
+{
+  co_await task.when_ready();
+}
+
+inline Notifier run_detached( Task<void> task )
+{
+  co_await ql::move( task );
+}
+
+// Counts down arrivals, resuming the coroutine awaiting it at the last
+class Latch
+{
+public:
+
+  explicit Latch( std::size_t count ) : m_count( count + 1 ) {}
+
+  static std::coroutine_handle<> arrive( void* context )
+  {
+    Latch& latch = *static_cast<Latch*>( context );
+    return latch.m_count.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ? latch.m_awaiting : std::noop_coroutine();
+  }
+
+  bool await_ready() noexcept { return false; }
+
+  // Counts as the awaiter's own arrival, so arrivals can't resume it before
+  // it has suspended
+  bool await_suspend( std::coroutine_handle<> awaiting ) noexcept
+  {
+    m_awaiting = awaiting;
+    return m_count.fetch_sub( 1, std::memory_order_acq_rel ) != 1;
+  }
+
+  void await_resume() noexcept {}
+
+private:
+
+  std::atomic<std::size_t> m_count;
+  std::coroutine_handle<>  m_awaiting;
+};
+
+// Shared by a when_any() and the tasks it started, which may outlive it
+template<typename T>
+struct WhenAnyState : RefCounted<WhenAnyState<T>>
+{
+  struct Child
+  {
+    WhenAnyState* state;
+    std::size_t   index;
+  };
+
+  static std::coroutine_handle<> arrive( void* context )
+  {
+    const Child& child = *static_cast<Child*>( context );
+    WhenAnyState* state = child.state;
+
+    std::coroutine_handle<> next = std::noop_coroutine();
+    if ( !state->won.exchange( true, std::memory_order_acq_rel ) )
+    {
+      state->winner = child.index;
+      next          = Latch::arrive( &state->latch );
+    }
+
+    state->release();
+    return next;
+  }
+
+  Vector<Task<T>>   tasks;
+  Vector<Child>     children;
+  std::atomic<bool> won    = false;
+  std::size_t       winner = 0;
+  Latch             latch { 1 };
+};
+
+// Starts every task, the first to finish releasing the state's latch
+template<typename T>
+void start_any( WhenAnyState<T>& state, Vector<Task<T>> tasks )
+{
+  ql::assert( !tasks.empty(), "when_any: no tasks" );
+
+  state.tasks = ql::move( tasks );
+  state.children.reserve( state.tasks.size() );
+
+  for ( std::size_t i = 0; i < state.tasks.size(); i++ )
+    state.children.push_back( typename WhenAnyState<T>::Child { &state, i } );
+
+  for ( std::size_t i = 0; i < state.tasks.size(); i++ )
+  {
+    state.retain();
+    notify_when_ready( state.tasks[ i ] ).start( &WhenAnyState<T>::arrive, &state.children[ i ] );
+  }
+}
+
+} // namespace detail
+
+// Runs task on the calling thread, blocking until it finishes, and returns
+// its result. For entering asynchronous code from synchronous code.
+template<typename T>
+T sync_wait( Task<T> task )
+{
+  struct State
+  {
+    std::mutex              mutex;
+    std::condition_variable finished;
+    bool                    done = false;
+  };
+
+  State state;
+
+  detail::notify_when_ready( task ).start( []( void* context ) -> std::coroutine_handle<>
+  {
+    State&          state = *static_cast<State*>( context );
+    std::lock_guard lock( state.mutex );
+
+    // Notified under the lock, so the waiter can't return and destroy the
+    // state meanwhile
+    state.done = true;
+    state.finished.notify_one();
+    return std::noop_coroutine();
+  }, &state );
+
+  std::unique_lock lock( state.mutex );
+  state.finished.wait( lock, [&] { return state.done; } );
+
+  return ql::move( task ).result();
+}
+
+// Runs tasks concurrently, finishing once all have. Returns their results in
+// order, or rethrows the first task's exception. Tasks that don't suspend
+// run one after another on the awaiting thread.
+template<typename T>
+  requires ( !std::is_void_v<T> )
+Task<Vector<T>> when_all( Vector<Task<T>> tasks )
+{
+  detail::Latch latch( tasks.size() );
+  for ( Task<T>& task : tasks )
+    detail::notify_when_ready( task ).start( &detail::Latch::arrive, &latch );
+
+  co_await latch;
+
+  Vector<T> results;
+  results.reserve( tasks.size() );
+  for ( Task<T>& task : tasks )
+    results.push_back( ql::move( task ).result() );
+
+  co_return results;
+}
+
+inline Task<void> when_all( Vector<Task<void>> tasks )
+{
+  detail::Latch latch( tasks.size() );
+  for ( Task<void>& task : tasks )
+    detail::notify_when_ready( task ).start( &detail::Latch::arrive, &latch );
+
+  co_await latch;
+
+  for ( Task<void>& task : tasks )
+    ql::move( task ).result();
+}
+
+template<typename T>
+struct WhenAny
+{
+  std::size_t index;
+  T           value;
+};
+
+// Runs tasks concurrently, finishing once the first has. Returns its index
+// and result, or rethrows its exception. The other tasks run to completion
+// in the background, so must not refer to anything that may be gone by
+// then.
+template<typename T>
+  requires ( !std::is_void_v<T> )
+Task<WhenAny<T>> when_any( Vector<Task<T>> tasks )
+{
+  RefPtr<detail::WhenAnyState<T>> state = make_ref<detail::WhenAnyState<T>>();
+  detail::start_any( *state, ql::move( tasks ) );
+  co_await state->latch;
+
+  co_return WhenAny<T> { state->winner, ql::move( state->tasks[ state->winner ] ).result() };
+}
+
+// As above, returning the index of the first task to finish
+inline Task<std::size_t> when_any( Vector<Task<void>> tasks )
+{
+  RefPtr<detail::WhenAnyState<void>> state = make_ref<detail::WhenAnyState<void>>();
+  detail::start_any( *state, ql::move( tasks ) );
+  co_await state->latch;
+
+  ql::move( state->tasks[ state->winner ] ).result();
+  co_return state->winner;
+}
+
+// Resumes coroutines on a ThreadPool's workers
+class Scheduler
+{
+public:
+
+  explicit Scheduler( ThreadPool& pool ) : m_pool( pool ) {}
+
+  // Awaiting moves the coroutine onto a worker
+  auto schedule() noexcept
+  {
+    struct Awaiter
+    {
+      bool await_ready() noexcept { return false; }
+      void await_suspend( std::coroutine_handle<> coroutine ) { pool.spawn( [coroutine] { coroutine.resume(); } ); }
+      void await_resume() noexcept {}
+
+      ThreadPool& pool;
+    };
+
+    return Awaiter { m_pool };
+  }
+
+  // Starts task on a worker without waiting for it. Exceptions escaping it
+  // terminate the program.
+  void spawn( Task<void> task )
+  {
+    m_pool.spawn( [notifier = detail::run_detached( ql::move( task ) )]() mutable { notifier.start(); } );
+  }
+
+  ThreadPool& pool() const { return m_pool; }
+
+private:
+
+  ThreadPool& m_pool;
+};
+
+// A coroutine producing a sequence of values on demand with co_yield, for
+// iterating over lazily computed or unbounded sequences. Values are
+// computed as the Generator is iterated, on the iterating thread.
+template<typename T>
+class [[nodiscard]] Generator
+{
+public:
+
+  struct promise_type : detail::PooledFrame
+  {
+    Generator get_return_object() noexcept
+    {
+      return Generator( std::coroutine_handle<promise_type>::from_promise( *this ) );
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+
+    // The value lives in the generator's frame until it is resumed
+    std::suspend_always yield_value( const T& value ) noexcept
+    {
+      m_value = &value;
+      return {};
+    }
+
+    void return_void() {}
+    void unhandled_exception() noexcept { m_exception = std::current_exception(); }
+
+    void rethrow()
+    {
+      if ( m_exception )
+        std::rethrow_exception( m_exception );
+    }
+
+    const T*           m_value = nullptr;
+    std::exception_ptr m_exception;
+  };
+
+  class Iterator
+  {
+  public:
+
+    using value_type      = T;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() = default;
+
+    const T& operator*() const { return *m_coroutine.promise().m_value; }
+    const T* operator->() const { return m_coroutine.promise().m_value; }
+
+    Iterator& operator++()
+    {
+      m_coroutine.resume();
+      if ( m_coroutine.done() )
+        m_coroutine.promise().rethrow();
+
+      return *this;
+    }
+
+    void operator++( int ) { ++*this; }
+
+    bool operator==( std::default_sentinel_t ) const { return m_coroutine.done(); }
+
+  private:
+
+    friend Generator;
+
+    explicit Iterator( std::coroutine_handle<promise_type> coroutine ) : m_coroutine( coroutine ) {}
+
+    std::coroutine_handle<promise_type> m_coroutine = nullptr;
+  };
+
+  Generator( Generator&& other ) : m_coroutine( ql::exchange( other.m_coroutine, nullptr ) ) {}
+
+  Generator& operator=( Generator&& other )
+  {
+    if ( this != &other )
+    {
+      if ( m_coroutine )
+        m_coroutine.destroy();
+
+      m_coroutine = ql::exchange( other.m_coroutine, nullptr );
+    }
+
+    return *this;
+  }
+
+  ~Generator()
+  {
+    if ( m_coroutine )
+      m_coroutine.destroy();
+  }
+
+  // Runs the generator to its first value. May only be called once.
+  Iterator begin()
+  {
+    Iterator it( m_coroutine );
+    ++it;
+    return it;
+  }
+
+  std::default_sentinel_t end() const { return std::default_sentinel; }
+
+private:
+
+  explicit Generator( std::coroutine_handle<promise_type> coroutine ) : m_coroutine( coroutine ) {}
+
+  std::coroutine_handle<promise_type> m_coroutine;
+};
+
+} // namespace ql
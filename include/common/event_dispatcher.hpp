@@ -0,0 +1,309 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include "common/vector.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+namespace ql
+{
+
+template<typename Signature>
+class EventDispatcher;
+
+// Calls every listener subscribed to an event. Listeners are stored back to
+// back in a single arena, each callable directly after its invoker, so
+// firing is a linear walk through contiguous memory rather than a chase
+// through separately allocated Functions. Listeners are called in the
+// order they subscribed, and their results are discarded.
+//
+// subscribe() returns a Handle, which unsubscribes in O(1) by marking the
+// listener dead; stale handles are ignored. Dead listeners are dropped when
+// the arena next grows, which relocates the live ones, so callables need a
+// move constructor that doesn't throw. Listeners may unsubscribe, themselves
+// included, but not subscribe while the event fires; those unsubscribed
+// mid-fire are destroyed once it finishes.
+template<typename R, typename... Args>
+class EventDispatcher<R( Args... )>
+{
+  struct Operations
+  {
+    void ( *move )( void* to, void* from ); // Leaves from destroyed
+    void ( *destroy )( void* callable );
+  };
+
+  // Precedes each callable in the arena
+  struct Entry
+  {
+    void ( *invoke )( void* callable, std::add_lvalue_reference_t<Args>... args );
+    const Operations* operations;
+    std::uint32_t     size;
+    std::uint32_t     slot;
+  };
+
+  // Callables start on this boundary, which entries are rounded to
+  static constexpr std::size_t entry_alignment = alignof( std::max_align_t );
+  static constexpr std::size_t header_size     = ( sizeof( Entry ) + entry_alignment - 1 ) & ~( entry_alignment - 1 );
+
+  static constexpr std::uint32_t no_slot = ~std::uint32_t( 0 );
+
+  // Maps handles to entries. A free slot holds the next free slot's index
+  // in place of an offset.
+  struct Slot
+  {
+    std::uint32_t offset;
+    std::uint32_t generation;
+  };
+
+public:
+
+  struct Handle
+  {
+    std::uint32_t slot       = no_slot;
+    std::uint32_t generation = 0;
+  };
+
+  explicit EventDispatcher( MemoryResource* resource = get_default_resource() )
+  : m_resource( resource )
+  {
+  }
+
+  EventDispatcher( const EventDispatcher& ) = delete;
+  EventDispatcher& operator=( const EventDispatcher& ) = delete;
+
+  ~EventDispatcher()
+  {
+    clear();
+
+    if ( m_arena != nullptr )
+      m_resource->deallocate( m_arena, m_capacity, entry_alignment );
+  }
+
+  template<typename F>
+    requires std::is_invocable_v<std::decay_t<F>&, std::add_lvalue_reference_t<Args>...>
+  Handle subscribe( F&& listener )
+  {
+    using type = std::decay_t<F>;
+
+    static_assert( alignof( type ) <= entry_alignment, "EventDispatcher: the listener is over-aligned" );
+    static_assert( std::is_nothrow_move_constructible_v<type>,
+                   "EventDispatcher: listeners are relocated, and need a move constructor that doesn't throw" );
+    ql::assert( m_firing == 0, "EventDispatcher: subscribed while firing" );
+
+    const std::size_t size = ( header_size + sizeof( type ) + entry_alignment - 1 ) & ~( entry_alignment - 1 );
+    if ( m_used + size > m_capacity )
+      grow( size );
+
+    Entry* entry = reinterpret_cast<Entry*>( m_arena + m_used );
+    ql::construct_at( static_cast<type*>( callable( entry ) ), ql::forward<F>( listener ) );
+
+    entry->invoke     = &invoke_listener<type>;
+    entry->operations = &operations<type>;
+    entry->size       = std::uint32_t( size );
+    entry->slot       = allocate_slot( std::uint32_t( m_used ) );
+
+    m_used += size;
+    m_count++;
+
+    return Handle { entry->slot, m_slots[ entry->slot ].generation };
+  }
+
+  // Removes a listener, unless it was already removed
+  void unsubscribe( Handle handle )
+  {
+    if ( handle.slot >= m_slots.size() || m_slots[ handle.slot ].generation != handle.generation )
+      return;
+
+    Entry* entry = reinterpret_cast<Entry*>( m_arena + m_slots[ handle.slot ].offset );
+
+    // Dead entries keep their size so firing can step over them
+    entry->invoke = &invoke_dead;
+    entry->slot   = no_slot;
+
+    // The listener may be running, so leave it until firing is done
+    if ( m_firing == 0 )
+      destroy( entry );
+    else
+      m_deferred = true;
+
+    free_slot( handle.slot );
+    m_count--;
+  }
+
+  // Calls each listener with args
+  void fire( Args... args )
+  {
+    // Ends the fire even if a listener throws
+    struct Firing
+    {
+      explicit Firing( EventDispatcher& dispatcher ) : dispatcher( dispatcher ) { dispatcher.m_firing++; }
+      ~Firing() { dispatcher.finish_firing(); }
+
+      EventDispatcher& dispatcher;
+    } firing( *this );
+
+    // Listeners can't subscribe, so the arena stays put while firing
+    byte_t* const end = m_arena + m_used;
+
+    for ( byte_t* at = m_arena; at != end; )
+    {
+      Entry* entry = reinterpret_cast<Entry*>( at );
+      at += entry->size;
+      entry->invoke( callable( entry ), args... );
+    }
+  }
+
+  void operator()( Args... args ) { fire( args... ); }
+
+  // Removes every listener
+  void clear()
+  {
+    ql::assert( m_firing == 0, "EventDispatcher: cleared while firing" );
+
+    // Outstanding handles go stale along with the slots
+    for_each_live( [&]( Entry* entry )
+    {
+      destroy( entry );
+      free_slot( entry->slot );
+    } );
+
+    m_used  = 0;
+    m_count = 0;
+  }
+
+  std::size_t size() const { return m_count; }
+  bool        empty() const { return m_count == 0; }
+
+  // Bytes of the arena in use, including listeners not yet dropped
+  std::size_t arena_bytes() const { return m_used; }
+
+private:
+
+  static void* callable( Entry* entry ) { return reinterpret_cast<byte_t*>( entry ) + header_size; }
+
+  template<typename F>
+  static void invoke_listener( void* callable, std::add_lvalue_reference_t<Args>... args )
+  {
+    std::invoke( *static_cast<F*>( callable ), args... );
+  }
+
+  static void invoke_dead( void*, std::add_lvalue_reference_t<Args>... ) {}
+
+  static void destroy( Entry* entry )
+  {
+    entry->operations->destroy( callable( entry ) );
+    entry->operations = nullptr;
+  }
+
+  template<typename F>
+  static constexpr Operations operations = {
+    []( void* to, void* from )
+    {
+      ql::construct_at( static_cast<F*>( to ), ql::move( *static_cast<F*>( from ) ) );
+      ql::destroy_at( static_cast<F*>( from ) );
+    },
+    []( void* callable ) { ql::destroy_at( static_cast<F*>( callable ) ); }
+  };
+
+  // Destroys listeners unsubscribed during the outermost fire
+  void finish_firing()
+  {
+    if ( --m_firing != 0 || !m_deferred )
+      return;
+
+    m_deferred = false;
+
+    for ( std::size_t offset = 0; offset < m_used; )
+    {
+      Entry* entry = reinterpret_cast<Entry*>( m_arena + offset );
+      offset += entry->size;
+
+      if ( entry->slot == no_slot && entry->operations != nullptr )
+        destroy( entry );
+    }
+  }
+
+  template<typename F>
+  void for_each_live( F&& f )
+  {
+    for ( std::size_t offset = 0; offset < m_used; )
+    {
+      Entry* entry = reinterpret_cast<Entry*>( m_arena + offset );
+      offset += entry->size;
+
+      if ( entry->slot != no_slot )
+        f( entry );
+    }
+  }
+
+  std::uint32_t allocate_slot( std::uint32_t offset )
+  {
+    if ( m_freeSlot == no_slot )
+    {
+      m_slots.push_back( Slot { offset, 0 } );
+      return std::uint32_t( m_slots.size() - 1 );
+    }
+
+    const std::uint32_t slot = m_freeSlot;
+    m_freeSlot = m_slots[ slot ].offset;
+    m_slots[ slot ].offset = offset;
+    return slot;
+  }
+
+  void free_slot( std::uint32_t slot )
+  {
+    m_slots[ slot ].generation++;
+    m_slots[ slot ].offset = m_freeSlot;
+    m_freeSlot = slot;
+  }
+
+  // Moves the live listeners to a new arena with room for another bytes,
+  // dropping dead ones on the way
+  void grow( std::size_t bytes )
+  {
+    std::size_t live = 0;
+    for_each_live( [&]( Entry* entry ) { live += entry->size; } );
+
+    std::size_t capacity = m_capacity != 0 ? m_capacity : 1024;
+    while ( capacity < 2 * ( live + bytes ) )
+      capacity *= 2;
+
+    byte_t*     arena = static_cast<byte_t*>( m_resource->allocate( capacity, entry_alignment ) );
+    std::size_t used  = 0;
+
+    for_each_live( [&]( Entry* entry )
+    {
+      Entry* moved = reinterpret_cast<Entry*>( arena + used );
+      std::memcpy( moved, entry, sizeof( Entry ) );
+      entry->operations->move( callable( moved ), callable( entry ) );
+
+      m_slots[ entry->slot ].offset = std::uint32_t( used );
+      used += entry->size;
+    } );
+
+    if ( m_arena != nullptr )
+      m_resource->deallocate( m_arena, m_capacity, entry_alignment );
+
+    m_arena    = arena;
+    m_used     = used;
+    m_capacity = capacity;
+  }
+
+  MemoryResource* m_resource;
+
+  byte_t*     m_arena    = nullptr;
+  std::size_t m_used     = 0;
+  std::size_t m_capacity = 0;
+  std::size_t m_count    = 0;
+  int         m_firing   = 0;
+  bool        m_deferred = false;
+
+  Vector<Slot>  m_slots;
+  std::uint32_t m_freeSlot = no_slot;
+};
+
+} // namespace ql
@@ -1,181 +1,509 @@
 #pragma once
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <utility>
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
 #include "common/memory.hpp"
 #include "common/types.hpp"
 
 namespace ql
 {
 
-template<typename F>
-class Function;
+namespace detail
+{
 
-template<typename R, typename... Args>
-class Function<R( Args... )>
+template<typename Signature, bool Copyable, std::size_t Size, std::size_t Alignment>
+class ErasedCallable;
+
+// The type erasure shared by Function, MoveOnlyFunction and InplaceFunction:
+// Size bytes of storage aligned to Alignment, and the invoker for the stored
+// callable kept inline, so a call is one indirect call with the storage's
+// address. Copying, moving and destroying go through a static table of
+// operations per type, which trivially copyable callables stored inline
+// don't need at all; allocated callables leave a pointer to themselves in
+// the storage.
+template<typename R, typename... Args, bool Copyable, std::size_t Size, std::size_t Alignment>
+class ErasedCallable<R( Args... ), Copyable, Size, Alignment>
 {
-public:
+  struct CopyableOperations
+  {
+    void ( *copy )( void* to, const void* from );
+    void ( *move )( void* to, void* from ); // Leaves from destroyed
+    void ( *destroy )( void* storage );
+  };
 
-  using return_type = R;
-  using argument_types = parameter_pack<Args...>;
-  using pointer = R (*)( Args... );
+  struct MoveOnlyOperations
+  {
+    void ( *move )( void* to, void* from ); // Leaves from destroyed
+    void ( *destroy )( void* storage );
+  };
 
-  constexpr Function() = default;
+  using Operations = std::conditional_t<Copyable, CopyableOperations, MoveOnlyOperations>;
+  using invoker    = R ( * )( void* storage, Args&&... args );
 
-  constexpr Function( auto&& f )
+public:
+
+  R operator()( Args... args ) const
   {
-    assign( f );
+    return m_invoke( m_storage, ql::forward<Args>( args )... );
   }
 
-  constexpr Function( std::nullptr_t )
+  explicit operator bool() const { return m_invoke != &invoke_empty; }
+
+protected:
+
+  template<typename F>
+  static constexpr bool fits_inline = sizeof( F ) <= Size && Alignment % alignof( F ) == 0;
+
+  // Moving never allocates or throws, so only callables with a noexcept
+  // move are kept inline
+  template<typename F>
+  static constexpr bool stored_inline = fits_inline<F> && std::is_nothrow_move_constructible_v<F>;
+
+  template<typename F>
+  static constexpr bool trivially_relocatable = std::is_trivially_copyable_v<F> && std::is_trivially_destructible_v<F>;
+
+  ErasedCallable() = default;
+
+  ErasedCallable( const ErasedCallable& other )
+    requires Copyable
   {
-    assign( std::nullptr_t() );
+    assign( other );
   }
 
-  constexpr ~Function()
+  ErasedCallable( ErasedCallable&& other ) noexcept { assign( ql::move( other ) ); }
+
+  ~ErasedCallable()
   {
     destruct();
   }
 
-  constexpr Function& operator=( auto&& f )
+  ErasedCallable& operator=( const ErasedCallable& other )
+    requires Copyable
   {
-    destruct();
-    assign( f );
+    if ( this != &other )
+    {
+      ErasedCallable copy( other );
+      destruct();
+      assign( ql::move( copy ) );
+    }
+
     return *this;
   }
 
-  constexpr Function operator=( std::nullptr_t )
+  ErasedCallable& operator=( ErasedCallable&& other ) noexcept
   {
-    destruct();
-    assign( std::nullptr_t() );
+    if ( this != &other )
+    {
+      destruct();
+      assign( ql::move( other ) );
+    }
+
     return *this;
   }
 
-  constexpr R operator()( Args&&... args ) const
+  // Stores the callable inline if it can, allocating it otherwise
+  template<typename F, typename... Ts>
+  void emplace( Ts&&... args )
   {
-    if ( m_isFunctionPtr )
+    if constexpr ( std::is_pointer_v<F> || std::is_member_pointer_v<F> )
+    {
+      // Stays empty when given a null pointer
+      if ( ( ( args == nullptr ) || ... ) )
+        return;
+    }
+
+    if constexpr ( stored_inline<F> )
     {
-      return m_ptr( forward<Args>( args )... );
+      ql::construct_at( reinterpret_cast<F*>( m_storage ), ql::forward<Ts>( args )... );
+      m_invoke = &invoke_inline<F>;
+
+      if constexpr ( !trivially_relocatable<F> )
+        m_operations = &inline_operations<F>;
     }
     else
     {
-      return m_callable->operator()( forward<Args>( args )... );
+      *reinterpret_cast<F**>( m_storage ) = new F( ql::forward<Ts>( args )... );
+      m_invoke = &invoke_allocated<F>;
+      m_operations = &allocated_operations<F>;
     }
   }
 
-  constexpr pointer target() const { return m_callable->target(); }
+  // The stored callable, if it is an F
+  template<typename F>
+  F* target() const
+  {
+    if ( m_invoke == &invoke_inline<F> )
+      return reinterpret_cast<F*>( m_storage );
+
+    if ( m_invoke == &invoke_allocated<F> )
+      return *reinterpret_cast<F* const*>( m_storage );
 
-private:
+    return nullptr;
+  }
 
-  constexpr void assign( auto&& f )
+  void assign( const ErasedCallable& other )
+    requires Copyable
   {
-    using type = std::remove_cvref_t<decltype( f )>;
+    if ( other.m_operations != nullptr )
+      other.m_operations->copy( m_storage, other.m_storage );
+    else
+      std::memcpy( m_storage, other.m_storage, Size );
 
-    if constexpr ( std::is_pointer_v<type> || std::is_convertible_v<type, pointer> )
-    {
-      m_isFunctionPtr = true;
-      m_ptr = f;
-    }
+    m_invoke     = other.m_invoke;
+    m_operations = other.m_operations;
+  }
+
+  void assign( ErasedCallable&& other )
+  {
+    if ( other.m_operations != nullptr )
+      other.m_operations->move( m_storage, other.m_storage );
     else
-    {
-      m_isFunctionPtr = false;
+      std::memcpy( m_storage, other.m_storage, Size );
 
-      if constexpr ( sizeof( type ) > sizeof( m_stackBuffer ) )
-      {
-        m_callable = new Callable<type>( f );
-      }
-      else
-      {
-        m_callable = new ( m_stackBuffer ) Callable<type>( f );
-      }
-    }
+    m_invoke     = other.m_invoke;
+    m_operations = other.m_operations;
+
+    other.m_invoke     = &invoke_empty;
+    other.m_operations = nullptr;
   }
 
-  constexpr void assign( std::nullptr_t )
+  void destruct()
   {
-    m_callable = nullptr;
+    if ( m_operations != nullptr )
+      m_operations->destroy( m_storage );
+
+    m_invoke     = &invoke_empty;
+    m_operations = nullptr;
   }
 
-  constexpr void destruct()
+private:
+
+  template<typename F>
+  static R invoke( F& callable, Args&&... args )
   {
-    if ( !m_isFunctionPtr )
-    {
-      if ( m_callable and m_callable->size() > sizeof( std::max_align_t ) )
-      {
-        delete m_callable;
-      }
-      else if ( m_callable )
-      {
-        destroy_at( m_callable );
-      }
-    }
+    if constexpr ( std::is_void_v<R> )
+      std::invoke( callable, ql::forward<Args>( args )... );
+    else
+      return std::invoke( callable, ql::forward<Args>( args )... );
   }
 
-  class ICallable
+  template<typename F>
+  static R invoke_inline( void* storage, Args&&... args )
   {
-  public:
+    return invoke( *static_cast<F*>( storage ), ql::forward<Args>( args )... );
+  }
 
-    constexpr virtual ~ICallable() = default;
-    constexpr virtual R operator()( Args&&... args ) = 0;
-    constexpr virtual std::size_t size() const = 0;
-    constexpr virtual pointer target() const = 0;
+  template<typename F>
+  static R invoke_allocated( void* storage, Args&&... args )
+  {
+    return invoke( **static_cast<F**>( storage ), ql::forward<Args>( args )... );
+  }
 
-  };
+  static R invoke_empty( void*, Args&&... )
+  {
+    ql::assert( false, "Function: called an empty function" );
+    std::abort();
+  }
 
   template<typename F>
-  class Callable : public ICallable
+  static constexpr Operations make_inline_operations()
   {
-  public:
-
-    constexpr Callable( F&& callable )
-    : m_callable( callable )
+    constexpr auto move = []( void* to, void* from )
     {
-    }
+      ql::construct_at( static_cast<F*>( to ), ql::move( *static_cast<F*>( from ) ) );
+      ql::destroy_at( static_cast<F*>( from ) );
+    };
 
-    constexpr virtual R operator()( Args&&... args )
+    constexpr auto destroy = []( void* storage ) { ql::destroy_at( static_cast<F*>( storage ) ); };
+
+    if constexpr ( Copyable )
     {
-      return m_callable( forward<Args>( args )... );
-    }
+      constexpr auto copy = []( void* to, const void* from )
+      {
+        ql::construct_at( static_cast<F*>( to ), *static_cast<const F*>( from ) );
+      };
 
-    constexpr virtual std::size_t size() const
+      return Operations { copy, move, destroy };
+    }
+    else
     {
-      return sizeof( F );
+      return Operations { move, destroy };
     }
+  }
+
+  // The storage holds a pointer to the callable, so moves just copy it
+  template<typename F>
+  static constexpr Operations make_allocated_operations()
+  {
+    constexpr auto move    = []( void* to, void* from ) { *static_cast<F**>( to ) = *static_cast<F**>( from ); };
+    constexpr auto destroy = []( void* storage ) { delete *static_cast<F**>( storage ); };
 
-    constexpr virtual pointer target() const
+    if constexpr ( Copyable )
     {
-      if constexpr ( std::is_convertible_v<F, pointer> )
+      constexpr auto copy = []( void* to, const void* from )
       {
-        return &m_callable;
-      }
-      else
-      {
-        return nullptr;
-      }
+        *static_cast<F**>( to ) = new F( **static_cast<F* const*>( from ) );
+      };
+
+      return Operations { copy, move, destroy };
+    }
+    else
+    {
+      return Operations { move, destroy };
     }
+  }
 
-  private:
+  template<typename F>
+  static constexpr Operations inline_operations = make_inline_operations<F>();
 
-    F m_callable;
-  };
+  template<typename F>
+  static constexpr Operations allocated_operations = make_allocated_operations<F>();
+
+  invoker           m_invoke     = &invoke_empty;
+  const Operations* m_operations = nullptr;
+
+  alignas( Alignment ) mutable byte_t m_storage[ Size ];
+};
+
+} // namespace detail
+
+template<typename F>
+class Function;
+
+// Wraps any copyable callable: function pointers, function objects and
+// lambdas, with or without captures. Callables of up to three pointers are
+// stored inline; larger or over-aligned ones are allocated.
+//
+// The type is erased by hand rather than with virtual functions, see
+// detail::ErasedCallable.
+template<typename R, typename... Args>
+class Function<R( Args... )> : public detail::ErasedCallable<R( Args... ), true, 3 * sizeof( void* ), alignof( void* )>
+{
+  using base = detail::ErasedCallable<R( Args... ), true, 3 * sizeof( void* ), alignof( void* )>;
+
+public:
+
+  using return_type = R;
+  using argument_types = parameter_pack<Args...>;
+  using pointer = R (*)( Args... );
 
-  byte_t m_stackBuffer[alignof( std::max_align_t )] = {};
+  Function() = default;
+  Function( std::nullptr_t ) {}
 
-  union
+  template<typename F>
+    requires ( !std::is_same_v<std::remove_cvref_t<F>, Function> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...> )
+  Function( F&& f )
   {
-    R ( *m_ptr )( Args... ) = nullptr;
-    ICallable* m_callable;
-  };
+    static_assert( std::is_copy_constructible_v<std::decay_t<F>>, "Function: the callable must be copyable" );
+    this->template emplace<std::decay_t<F>>( ql::forward<F>( f ) );
+  }
 
-  bool m_isFunctionPtr = false;
+  template<typename F>
+    requires ( !std::is_same_v<std::remove_cvref_t<F>, Function> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...> )
+  Function& operator=( F&& f )
+  {
+    static_assert( std::is_copy_constructible_v<std::decay_t<F>>, "Function: the callable must be copyable" );
+    this->destruct();
+    this->template emplace<std::decay_t<F>>( ql::forward<F>( f ) );
+    return *this;
+  }
+
+  Function& operator=( std::nullptr_t )
+  {
+    this->destruct();
+    return *this;
+  }
+
+  // The stored callable, if it is an F
+  template<typename F>
+  F* target()
+  {
+    return base::template target<F>();
+  }
 
+  template<typename F>
+  const F* target() const
+  {
+    return base::template target<F>();
+  }
 };
 
 template<typename R, typename... Args>
 Function( R (*)( Args... ) ) -> Function<R( Args... )>;
 
 
+template<typename F>
+class MoveOnlyFunction;
+
+// A Function for callables that can't be copied, such as lambdas owning a
+// UniquePtr or a buffer, so work can be queued without reference counting.
+// Callables are moved in rather than copied.
+//
+// Callables of up to three pointers with a noexcept move are stored inline,
+// others are allocated. Moving a MoveOnlyFunction never allocates or throws:
+// inline callables are relocated, with memcpy if trivially copyable, and
+// allocated ones hand over their pointer.
+template<typename R, typename... Args>
+class MoveOnlyFunction<R( Args... )>
+: public detail::ErasedCallable<R( Args... ), false, 3 * sizeof( void* ), alignof( void* )>
+{
+public:
+
+  MoveOnlyFunction() = default;
+  MoveOnlyFunction( std::nullptr_t ) {}
+
+  template<typename F>
+    requires ( !std::is_same_v<std::remove_cvref_t<F>, MoveOnlyFunction> &&
+               std::is_invocable_r_v<R, std::decay_t<F>&, Args...> )
+  MoveOnlyFunction( F&& f )
+  {
+    this->template emplace<std::decay_t<F>>( ql::forward<F>( f ) );
+  }
+
+  // Constructs the callable in place from args
+  template<typename F, typename... Ts>
+  explicit MoveOnlyFunction( std::in_place_type_t<F>, Ts&&... args )
+  {
+    this->template emplace<F>( ql::forward<Ts>( args )... );
+  }
+
+  template<typename F>
+    requires ( !std::is_same_v<std::remove_cvref_t<F>, MoveOnlyFunction> &&
+               std::is_invocable_r_v<R, std::decay_t<F>&, Args...> )
+  MoveOnlyFunction& operator=( F&& f )
+  {
+    this->destruct();
+    this->template emplace<std::decay_t<F>>( ql::forward<F>( f ) );
+    return *this;
+  }
+
+  MoveOnlyFunction& operator=( std::nullptr_t )
+  {
+    this->destruct();
+    return *this;
+  }
+};
+
+template<typename F>
+class FunctionRef;
+
+// A non-owning reference to a callable, for callback parameters that are
+// only called before the function taking them returns. Two pointers wide,
+// trivially copyable and never allocates, unlike passing a Function.
+//
+// It refers to the callable rather than copying it, so must not outlive it:
+// bind it to a temporary only as a function argument.
+template<typename R, typename... Args>
+class FunctionRef<R( Args... )>
+{
+  union Target
+  {
+    void* object;
+    void ( *function )();
+  };
+
+  using thunk = R ( * )( Target target, Args&&... args );
+
+public:
+
+  template<typename F>
+    requires ( !std::is_same_v<std::remove_cvref_t<F>, FunctionRef> && std::is_invocable_r_v<R, F&, Args...> )
+  FunctionRef( F&& f ) noexcept
+  {
+    using type = std::remove_reference_t<F>;
+
+    if constexpr ( std::is_function_v<type> || std::is_function_v<std::remove_pointer_t<type>> )
+    {
+      // Refer to the function itself, not a pointer that may be temporary
+      m_target.function = reinterpret_cast<void ( * )()>( +f );
+      m_thunk = []( Target target, Args&&... args ) -> R
+      {
+        return invoke( *reinterpret_cast<std::remove_pointer_t<std::decay_t<type>>*>( target.function ),
+                       ql::forward<Args>( args )... );
+      };
+    }
+    else
+    {
+      m_target.object = const_cast<void*>( static_cast<const void*>( addressof( f ) ) );
+      m_thunk = []( Target target, Args&&... args ) -> R
+      {
+        return invoke( *static_cast<type*>( target.object ), ql::forward<Args>( args )... );
+      };
+    }
+  }
+
+  R operator()( Args... args ) const
+  {
+    return m_thunk( m_target, ql::forward<Args>( args )... );
+  }
+
+private:
+
+  template<typename F>
+  static R invoke( F& callable, Args&&... args )
+  {
+    if constexpr ( std::is_void_v<R> )
+      std::invoke( callable, ql::forward<Args>( args )... );
+    else
+      return std::invoke( callable, ql::forward<Args>( args )... );
+  }
+
+  Target m_target;
+  thunk  m_thunk;
+};
+
+template<typename Signature, std::size_t Capacity = 4 * sizeof( void* ), std::size_t Alignment = alignof( std::max_align_t )>
+class InplaceFunction;
+
+// A Function that stores its callable in a buffer of Capacity bytes inside
+// itself and never allocates, for task queues and real-time code. Callables
+// that don't fit, or need stricter alignment than Alignment, are rejected
+// at compile time.
+//
+// Calling is a single indirect call. Callables that are trivially copyable
+// are copied and moved with memcpy, and need no destruction; others go
+// through a table of operations shared by every InplaceFunction holding
+// the same type.
+template<typename R, typename... Args, std::size_t Capacity, std::size_t Alignment>
+class InplaceFunction<R( Args... ), Capacity, Alignment>
+: public detail::ErasedCallable<R( Args... ), true, Capacity, Alignment>
+{
+  using base = detail::ErasedCallable<R( Args... ), true, Capacity, Alignment>;
+
+public:
+
+  static constexpr std::size_t capacity  = Capacity;
+  static constexpr std::size_t alignment = Alignment;
+
+  InplaceFunction() = default;
+  InplaceFunction( std::nullptr_t ) {}
+
+  template<typename F>
+    requires ( !std::is_same_v<std::remove_cvref_t<F>, InplaceFunction> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...> )
+  InplaceFunction( F&& f )
+  {
+    using type = std::decay_t<F>;
+
+    static_assert( sizeof( type ) <= Capacity, "InplaceFunction: the callable is larger than the capacity" );
+    static_assert( Alignment % alignof( type ) == 0, "InplaceFunction: the callable needs stricter alignment" );
+    static_assert( std::is_copy_constructible_v<type>, "InplaceFunction: the callable must be copyable" );
+    static_assert( std::is_nothrow_move_constructible_v<type>, "InplaceFunction: the callable's move may not throw" );
+
+    // Always stored inline given the above, and left empty by a null pointer
+    this->template emplace<type>( ql::forward<F>( f ) );
+  }
+
+  InplaceFunction& operator=( std::nullptr_t )
+  {
+    this->destruct();
+    return *this;
+  }
+};
+
 template<typename T>
 struct callable_type;
 
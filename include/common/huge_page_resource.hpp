@@ -0,0 +1,6 @@
+#pragma once
+#if __unix__
+#  include "common/unix/huge_page_resource.hpp"
+#elif _WIN32
+#  include "common/win32/huge_page_resource.hpp"
+#endif
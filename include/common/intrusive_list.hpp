@@ -0,0 +1,447 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/utility.hpp"
+#include <cstddef>
+#include <type_traits>
+
+namespace ql
+{
+
+// Determines how a ListHook behaves when it is destroyed or reused.
+//  - normal:      no checks, unlinking leaves the hook's pointers dangling.
+//  - safe:        unlinking resets the hook, inserting a linked hook or
+//                 destroying one still in a list asserts.
+//  - auto_unlink: the hook removes itself from its list when destroyed.
+enum class LinkMode
+{
+  normal,
+  safe,
+  auto_unlink
+};
+
+namespace detail
+{
+
+struct ListNode
+{
+  ListNode* previous = nullptr;
+  ListNode* next     = nullptr;
+};
+
+// Maps between an element and its hook when the hook is a data member
+template<typename T, auto Hook>
+struct list_hook_traits
+{
+  using type = std::remove_cvref_t<decltype( std::declval<T&>().*Hook )>;
+
+  static type& to_hook( T& object ) { return object.*Hook; }
+
+  static T& from_hook( type& hook )
+  {
+    return *reinterpret_cast<T*>( reinterpret_cast<byte_t*>( &hook ) - offset() );
+  }
+
+private:
+
+  // The member's offset, measured against aligned storage on the stack
+  // rather than a null pointer. Only the storage's address is used, so this
+  // folds to a constant, with no static storage or initialisation guard.
+  static std::ptrdiff_t offset()
+  {
+    alignas( T ) byte_t storage[ sizeof( T ) ];
+    return reinterpret_cast<byte_t*>( &( reinterpret_cast<T*>( storage )->*Hook ) ) - storage;
+  }
+};
+
+// Maps between an element and its hook when the element derives from it
+template<typename T>
+struct list_hook_traits<T, nullptr>
+{
+  using type = typename T::list_hook_type;
+
+  static type& to_hook( T& object ) { return static_cast<type&>( object ); }
+  static T&    from_hook( type& hook ) { return static_cast<T&>( hook ); }
+};
+
+} // namespace detail
+
+// Embedded in (or inherited by) any object that should be placed in an
+// IntrusiveList. The list never allocates; it links the hooks directly.
+template<LinkMode Mode = LinkMode::safe>
+class ListHook : private detail::ListNode
+{
+  template<typename, auto>
+  friend class IntrusiveList;
+
+public:
+
+  using list_hook_type = ListHook;
+
+  static constexpr LinkMode mode = Mode;
+
+  constexpr ListHook() = default;
+
+  // Copying an object never copies its membership in a list.
+  constexpr ListHook( const ListHook& ) {}
+  constexpr ListHook& operator=( const ListHook& ) { return *this; }
+
+  ~ListHook()
+  {
+    if constexpr ( Mode == LinkMode::auto_unlink )
+    {
+      unlink();
+    }
+    else if constexpr ( Mode == LinkMode::safe )
+    {
+      ql::assert( !is_linked(), "ListHook destroyed while still linked" );
+    }
+  }
+
+  // Only meaningful for safe and auto_unlink hooks.
+  bool is_linked() const { return next != nullptr; }
+
+  // Removes the hook from whichever list it is in, in O(1). Only auto_unlink
+  // hooks may leave a list behind its back, as only their lists don't keep
+  // a count; others are removed through the list.
+  void unlink()
+    requires ( Mode == LinkMode::auto_unlink )
+  {
+    if ( !is_linked() )
+      return;
+
+    previous->next = next;
+    next->previous = previous;
+    previous       = nullptr;
+    next           = nullptr;
+  }
+};
+
+// A doubly linked list of objects that embed a ListHook. Inserting and
+// removing elements performs no allocations and never copies the element;
+// the list only stores pointers into hooks owned by the elements themselves.
+//
+// Hook selects the hook to use: either a pointer to a ListHook data member
+// of T, or nullptr (the default) when T derives from a ListHook.
+//
+// Lists of auto_unlink hooks do not track their size, as elements may leave
+// the list without it knowing; size() is linear for them.
+template<typename T, auto Hook = nullptr>
+class IntrusiveList
+{
+  using node_type = detail::ListNode;
+
+  using traits    = detail::list_hook_traits<T, Hook>;
+  using hook_type = typename traits::type;
+
+  static constexpr bool safe_mode     = hook_type::mode != LinkMode::normal;
+  static constexpr bool constant_size  = hook_type::mode != LinkMode::auto_unlink;
+
+  static node_type* to_node( T& object )
+  {
+    return static_cast<node_type*>( &traits::to_hook( object ) );
+  }
+
+  static T& from_node( node_type* node )
+  {
+    return traits::from_hook( static_cast<hook_type&>( *node ) );
+  }
+
+  template<typename Value>
+  class NodeIterator
+  {
+    friend class IntrusiveList;
+
+  public:
+
+    NodeIterator( node_type* node ) : m_node( node ) {}
+    NodeIterator() = delete;
+
+    // Allows an iterator to be converted to a const_iterator
+    operator NodeIterator<const Value>() const
+      requires ( !std::is_const_v<Value> )
+    {
+      return m_node;
+    }
+
+    bool operator==( const NodeIterator& rhs ) const { return m_node == rhs.m_node; }
+    bool operator!=( const NodeIterator& rhs ) const { return m_node != rhs.m_node; }
+
+    Value& operator*() const { return from_node( m_node ); }
+    Value* operator->() const { return &from_node( m_node ); }
+
+    NodeIterator& operator--()
+    {
+      m_node = m_node->previous;
+      return *this;
+    }
+
+    NodeIterator& operator++()
+    {
+      m_node = m_node->next;
+      return *this;
+    }
+
+    NodeIterator operator--( int )
+    {
+      NodeIterator tmp = *this;
+      m_node = m_node->previous;
+      return tmp;
+    }
+
+    NodeIterator operator++( int )
+    {
+      NodeIterator tmp = *this;
+      m_node = m_node->next;
+      return tmp;
+    }
+
+  private:
+
+    node_type* m_node = nullptr;
+  };
+
+public:
+
+  using type           = T;
+  using iterator       = NodeIterator<T>;
+  using const_iterator = NodeIterator<const T>;
+
+  IntrusiveList() { reset_root(); }
+
+  IntrusiveList( const IntrusiveList& ) = delete;
+  IntrusiveList& operator=( const IntrusiveList& ) = delete;
+
+  IntrusiveList( IntrusiveList&& src )
+  {
+    reset_root();
+    splice( end(), src );
+  }
+
+  IntrusiveList& operator=( IntrusiveList&& src )
+  {
+    if ( this != &src )
+    {
+      clear();
+      splice( end(), src );
+    }
+
+    return *this;
+  }
+
+  // Elements are unlinked, never destroyed; they are owned elsewhere.
+  ~IntrusiveList() { clear(); }
+
+  void push_front( T& value ) { link_before( m_root.next, to_node( value ) ); }
+  void push_back( T& value ) { link_before( &m_root, to_node( value ) ); }
+
+  void pop_front() { unlink( m_root.next ); }
+  void pop_back() { unlink( m_root.previous ); }
+
+  T&       front() { return from_node( m_root.next ); }
+  const T& front() const { return from_node( m_root.next ); }
+
+  T&       back() { return from_node( m_root.previous ); }
+  const T& back() const { return from_node( m_root.previous ); }
+
+  // Inserts value before pos.
+  iterator insert( const_iterator pos, T& value )
+  {
+    node_type* node = to_node( value );
+    link_before( pos.m_node, node );
+    return iterator( node );
+  }
+
+  // Unlinks the element at pos, returning the element after it.
+  iterator erase( const_iterator pos )
+  {
+    node_type* next = pos.m_node->next;
+    unlink( pos.m_node );
+    return iterator( next );
+  }
+
+  iterator erase( const_iterator first, const_iterator last )
+  {
+    while ( first != last )
+      first = erase( first );
+
+    return iterator( last.m_node );
+  }
+
+  // Unlinks value from this list in O(1).
+  void remove( T& value ) { unlink( to_node( value ) ); }
+
+  // Returns an iterator to an element known to be in this list.
+  iterator       iterator_to( T& value ) { return iterator( to_node( value ) ); }
+  const_iterator iterator_to( const T& value ) const
+  {
+    return const_iterator( to_node( const_cast<T&>( value ) ) );
+  }
+
+  // Unlinks every element, leaving them intact.
+  void clear()
+  {
+    node_type* node = m_root.next;
+    while ( node != &m_root )
+    {
+      node_type* next = node->next;
+      reset_node( node );
+      node = next;
+    }
+
+    reset_root();
+    m_size = 0;
+  }
+
+  // Moves every element of other before pos in O(1).
+  void splice( const_iterator pos, IntrusiveList& other )
+  {
+    if ( other.empty() )
+      return;
+
+    const std::size_t count = other.m_size;
+    transfer( pos.m_node, other.m_root.next, &other.m_root );
+    other.reset_root();
+    other.m_size = 0;
+
+    if constexpr ( constant_size )
+      m_size += count;
+  }
+
+  // Moves the element at it from other before pos in O(1).
+  void splice( const_iterator pos, IntrusiveList& other, const_iterator it )
+  {
+    if ( pos.m_node == it.m_node || pos.m_node == it.m_node->next )
+      return;
+
+    transfer( pos.m_node, it.m_node, it.m_node->next );
+
+    if constexpr ( constant_size )
+    {
+      other.m_size--;
+      m_size++;
+    }
+  }
+
+  // Moves [first, last) from other before pos. Constant time when splicing
+  // within the same list, otherwise linear in the length of the range so that
+  // both lists keep an accurate size.
+  void splice( const_iterator pos, IntrusiveList& other, const_iterator first,
+               const_iterator last )
+  {
+    if ( first == last )
+      return;
+
+    if constexpr ( constant_size )
+    {
+      if ( &other != this )
+      {
+        std::size_t count = 0;
+        for ( node_type* node = first.m_node; node != last.m_node; node = node->next )
+          count++;
+
+        other.m_size -= count;
+        m_size += count;
+      }
+    }
+
+    transfer( pos.m_node, first.m_node, last.m_node );
+  }
+
+  void swap( IntrusiveList& other )
+  {
+    IntrusiveList tmp = ql::move( other );
+    other = ql::move( *this );
+    *this = ql::move( tmp );
+  }
+
+  iterator       begin() { return iterator( m_root.next ); }
+  const_iterator begin() const { return const_iterator( m_root.next ); }
+  const_iterator cbegin() const { return begin(); }
+
+  iterator       end() { return iterator( &m_root ); }
+  const_iterator end() const { return const_iterator( const_cast<node_type*>( &m_root ) ); }
+  const_iterator cend() const { return end(); }
+
+  bool empty() const { return m_root.next == &m_root; }
+
+  std::size_t size() const
+  {
+    if constexpr ( constant_size )
+    {
+      return m_size;
+    }
+    else
+    {
+      std::size_t count = 0;
+      for ( const node_type* node = m_root.next; node != &m_root; node = node->next )
+        count++;
+
+      return count;
+    }
+  }
+
+private:
+
+  void reset_root()
+  {
+    m_root.previous = &m_root;
+    m_root.next     = &m_root;
+  }
+
+  static void reset_node( node_type* node )
+  {
+    if constexpr ( safe_mode )
+    {
+      node->previous = nullptr;
+      node->next     = nullptr;
+    }
+  }
+
+  void link_before( node_type* pos, node_type* node )
+  {
+    if constexpr ( safe_mode )
+      ql::assert( node->next == nullptr, "IntrusiveList: element is already linked" );
+
+    node->previous      = pos->previous;
+    node->next          = pos;
+    pos->previous->next = node;
+    pos->previous       = node;
+
+    if constexpr ( constant_size )
+      m_size++;
+  }
+
+  void unlink( node_type* node )
+  {
+    node->previous->next = node->next;
+    node->next->previous = node->previous;
+    reset_node( node );
+
+    if constexpr ( constant_size )
+      m_size--;
+  }
+
+  // Relinks [first, last) before pos.
+  static void transfer( node_type* pos, node_type* first, node_type* last )
+  {
+    if ( pos == last )
+      return;
+
+    node_type* tail = last->previous;
+
+    // Detach the range from its current neighbours
+    first->previous->next = last;
+    last->previous        = first->previous;
+
+    // Attach it in front of pos
+    first->previous     = pos->previous;
+    tail->next          = pos;
+    pos->previous->next = first;
+    pos->previous       = tail;
+  }
+
+  node_type   m_root;
+  std::size_t m_size = 0;
+};
+
+} // namespace ql
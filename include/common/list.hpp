@@ -1,23 +1,42 @@
 #pragma once
 #include "common/utility.hpp"
 #include "common/algorithm.hpp"
+#include "common/allocator.hpp"
 #include <concepts>
 #include <cstddef>
 #include <initializer_list>
+#include <memory>
 
 namespace ql
 {
 
-template<typename Type>
+// A doubly linked list. Nodes are allocated through a rebound copy of the
+// allocator, and items are constructed with the allocator itself so that
+// allocator-aware items share it.
+//
+// Splicing and merging relink nodes between lists, so both lists must use
+// equal allocators.
+template<typename Type, typename Allocator = ql::Allocator<Type>>
 class List
 {
   struct Node
   {
     Node* previous = nullptr;
     Node* next     = nullptr;
-    Type  value;
+
+    // Constructed and destroyed separately, through the allocator
+    union
+    {
+      Type value;
+    };
+
+    Node() {}
+    ~Node() {}
   };
 
+  using allocator_traits = std::allocator_traits<Allocator>;
+  using node_allocator   = typename allocator_traits::template rebind_alloc<Node>;
+
   class NodeIterator
   {
     friend class List;
@@ -67,86 +86,132 @@ class List
 
 public:
 
-  using type     = Type;
-  using iterator = NodeIterator;
+  using type           = Type;
+  using allocator_type = Allocator;
+  using iterator       = NodeIterator;
   using const_iterator = const NodeIterator;
 
   List() = default;
 
+  explicit List( const Allocator& allocator )
+  : m_allocator( allocator )
+  {
+  }
+
   template<std::size_t Size>
-  List( const type ( &items )[ Size ] )
+  List( const type ( &items )[ Size ], const Allocator& allocator = Allocator() )
+  : m_allocator( allocator )
   {
-    for ( type& item : items )
+    for ( const type& item : items )
       push_back( item );
   }
 
-  List( std::initializer_list<type> items )
+  List( std::initializer_list<type> items, const Allocator& allocator = Allocator() )
+  : m_allocator( allocator )
   {
-    for ( type& item : items )
+    for ( const type& item : items )
       push_back( item );
   }
 
   List( const List& src )
+  : m_allocator( allocator_traits::select_on_container_copy_construction( src.m_allocator ) )
+  {
+    for ( const type& item : src )
+      push_back( item );
+  }
+
+  List( const List& src, const Allocator& allocator )
+  : m_allocator( allocator )
   {
-    for ( type& item : src )
+    for ( const type& item : src )
       push_back( item );
   }
 
   List( List&& src )
+  : m_allocator( src.m_allocator )
   {
-    ql::swap( m_begin, src.m_begin );
-    ql::swap( m_end, src.m_end );
-    ql::swap( m_size, src.m_size );
+    take( src );
   }
 
-  ~List()
+  List( List&& src, const Allocator& allocator )
+  : m_allocator( allocator )
   {
-    for ( Node* node = m_begin; node != nullptr; node = node->next )
-    {
-      delete node->previous;
-    }
+    take( src );
   }
 
-  void push_back( Type&& value )
+  ~List()
   {
-    Node* node  = new Node { .value = ql::move( value ) };
+    clear();
+  }
 
-    if ( !m_begin )
+  List& operator=( const List& rhs )
+  {
+    if ( this != &rhs )
     {
-      m_begin = node;
-      m_end   = m_begin;
+      clear();
+
+      if constexpr ( allocator_traits::propagate_on_container_copy_assignment::value )
+        m_allocator = rhs.m_allocator;
+
+      for ( const type& item : rhs )
+        push_back( item );
     }
-    else
+
+    return *this;
+  }
+
+  List& operator=( List&& rhs )
+  {
+    if ( this != &rhs )
     {
-      m_end->next = node;
-      m_end       = node;
+      clear();
+
+      if constexpr ( allocator_traits::propagate_on_container_move_assignment::value )
+        m_allocator = rhs.m_allocator;
+
+      take( rhs );
     }
 
-    m_size++;
+    return *this;
   }
 
-  void push_back( const Type& value )
+  allocator_type get_allocator() const { return m_allocator; }
+
+  template<typename... Args>
+  Type& emplace_back( Args&&... args )
   {
-    Node* node  = new Node { .value = value };
+    Node* node = create_node( ql::forward<Args>( args )... );
+    link_before( nullptr, node );
+    return node->value;
+  }
 
-    if ( !m_begin )
-    {
-      m_begin = node;
-      m_end   = m_begin;
-    }
-    else
-    {
-      m_end->next = node;
-      m_end       = node;
-    }
+  template<typename... Args>
+  Type& emplace_front( Args&&... args )
+  {
+    Node* node = create_node( ql::forward<Args>( args )... );
+    link_before( m_begin, node );
+    return node->value;
+  }
 
-    m_size++;
+  // Constructs an item from args before pos.
+  template<typename... Args>
+  iterator emplace( const_iterator pos, Args&&... args )
+  {
+    Node* node = create_node( ql::forward<Args>( args )... );
+    link_before( pos.m_node, node );
+    return iterator( node );
   }
 
+  void push_back( Type&& value ) { emplace_back( ql::move( value ) ); }
+  void push_back( const Type& value ) { emplace_back( value ); }
+
+  void push_front( Type&& value ) { emplace_front( ql::move( value ) ); }
+  void push_front( const Type& value ) { emplace_front( value ); }
+
   iterator find( const Type& value )
     requires std::equality_comparable<Type>
   {
-    for ( Node* node = m_begin; node != m_end; node = node->next )
+    for ( Node* node = m_begin; node != nullptr; node = node->next )
     {
       if ( node->value == value )
         return iterator( node );
@@ -159,51 +224,235 @@ public:
   {
     Node* node = item.m_node;
 
-    if ( node == m_begin )
+    unlink( node );
+    destroy_node( node );
+  }
+
+  void clear()
+  {
+    Node* node = m_begin;
+    while ( node != nullptr )
     {
-      m_begin = node->next;
+      Node* next = node->next;
+      destroy_node( node );
+      node = next;
     }
-    else if ( node == m_end )
+
+    m_begin = nullptr;
+    m_end   = nullptr;
+    m_size  = 0;
+  }
+
+  void resize( std::size_t size )
+  {
+    while ( size > m_size )
+      emplace_back();
+
+    while ( size < m_size )
+      remove( iterator( m_end ) );
+  }
+
+  // Inserts value before pos.
+  iterator insert( const_iterator pos, const type& value ) { return emplace( pos, value ); }
+  iterator insert( const_iterator pos, type&& value ) { return emplace( pos, ql::move( value ) ); }
+
+  // Moves every item of other before pos. Only pointers are relinked,
+  // nothing is allocated or copied.
+  void splice( const_iterator pos, List& other )
+  {
+    if ( &other == this || other.empty() )
+      return;
+
+    transfer( pos.m_node, other, other.m_begin, other.m_end );
+    m_size += other.m_size;
+    other.m_size = 0;
+  }
+
+  // Moves the item at it from other before pos.
+  void splice( const_iterator pos, List& other, const_iterator it )
+  {
+    Node* node = it.m_node;
+    if ( &other == this && ( pos.m_node == node || pos.m_node == node->next ) )
+      return;
+
+    other.unlink( node );
+    link_before( pos.m_node, node );
+  }
+
+  // Moves [first, last) from other before pos. Constant time within the
+  // same list, otherwise linear in the length of the range to keep both
+  // sizes accurate.
+  void splice( const_iterator pos, List& other, const_iterator first, const_iterator last )
+  {
+    if ( first == last )
+      return;
+
+    Node* tail = last.m_node != nullptr ? last.m_node->previous : other.m_end;
+
+    if ( &other != this )
     {
-      m_end = node->previous;
+      std::size_t count = 1;
+      for ( Node* node = first.m_node; node != tail; node = node->next )
+        count++;
+
+      other.m_size -= count;
+      m_size += count;
     }
-    else
+
+    transfer( pos.m_node, other, first.m_node, tail );
+  }
+
+  // Merges the sorted items of other into this sorted list in linear time.
+  // The merge is stable; equivalent items from this list come first.
+  template<typename Compare>
+  void merge( List& other, Compare compare )
+  {
+    if ( &other == this )
+      return;
+
+    Node* lhs = m_begin;
+    Node* rhs = other.m_begin;
+
+    while ( lhs != nullptr && rhs != nullptr )
     {
-      Node* previous = node->previous;
-      Node* next     = node->next;
+      if ( compare( rhs->value, lhs->value ) )
+      {
+        Node* next = rhs->next;
+
+        rhs->previous = lhs->previous;
+        rhs->next     = lhs;
+
+        if ( lhs->previous != nullptr )
+          lhs->previous->next = rhs;
+        else
+          m_begin = rhs;
+
+        lhs->previous = rhs;
+        rhs           = next;
+      }
+      else
+      {
+        lhs = lhs->next;
+      }
+    }
+
+    // Anything left in other sorts after every item of this list
+    if ( rhs != nullptr )
+    {
+      rhs->previous = m_end;
 
-      previous->next = next;
-      next->previous = previous;
+      if ( m_end != nullptr )
+        m_end->next = rhs;
+      else
+        m_begin = rhs;
+
+      m_end = other.m_end;
     }
 
-    delete node;
+    m_size += other.m_size;
+
+    other.m_begin = nullptr;
+    other.m_end   = nullptr;
+    other.m_size  = 0;
   }
 
-  void resize( std::size_t size )
+  void merge( List& other )
   {
-    Node* node = m_end;
-    while ( size > m_size )
+    merge( other, []( const Type& lhs, const Type& rhs ) { return lhs < rhs; } );
+  }
+
+  // A stable, bottom-up merge sort. Items are never moved or copied; only
+  // the links between nodes change, so no allocation takes place.
+  template<typename Compare>
+  void sort( Compare compare )
+  {
+    if ( m_size < 2 )
+      return;
+
+    // runs[ i ] holds a sorted run of 2^i nodes, or nothing. Runs at higher
+    // indices always hold items that came earlier in the list.
+    Node* runs[ 64 ] = {};
+    std::size_t runCount = 0;
+
+    Node* node = m_begin;
+    while ( node != nullptr )
     {
-      node->next = new Node();
+      Node* run  = node;
       node       = node->next;
+      run->next  = nullptr;
+
+      std::size_t i = 0;
+      for ( ; runs[ i ] != nullptr; i++ )
+      {
+        run       = merge_runs( runs[ i ], run, compare );
+        runs[ i ] = nullptr;
+      }
 
-      m_size++;
+      runs[ i ] = run;
+      runCount  = ql::max( runCount, i + 1 );
     }
 
-    while ( size < m_size )
+    Node* sorted = nullptr;
+    for ( std::size_t i = 0; i < runCount; i++ )
     {
-      node = node->previous;
-      delete node->next;
+      if ( runs[ i ] != nullptr )
+        sorted = sorted != nullptr ? merge_runs( runs[ i ], sorted, compare ) : runs[ i ];
+    }
+
+    // Runs are only linked forwards, restore the backward links
+    m_begin = sorted;
 
-      m_size--;
+    Node* previous = nullptr;
+    for ( Node* n = sorted; n != nullptr; n = n->next )
+    {
+      n->previous = previous;
+      previous    = n;
     }
+
+    m_end = previous;
+  }
+
+  void sort()
+  {
+    sort( []( const Type& lhs, const Type& rhs ) { return lhs < rhs; } );
   }
 
-  iterator insert( const_iterator pos, const type& value )
+  // Removes all but the first of each group of consecutive equivalent
+  // items, returning the number of items removed.
+  template<typename BinaryPredicate>
+  std::size_t unique( BinaryPredicate predicate )
   {
-    Node* node = new Node { .value = value };
-    node->previous = pos.m_node->previous;
-    pos.m_node->previous = node;
+    std::size_t removed = 0;
+
+    Node* node = m_begin;
+    while ( node != nullptr && node->next != nullptr )
+    {
+      if ( predicate( node->value, node->next->value ) )
+      {
+        remove( iterator( node->next ) );
+        removed++;
+      }
+      else
+      {
+        node = node->next;
+      }
+    }
+
+    return removed;
+  }
+
+  std::size_t unique()
+    requires std::equality_comparable<Type>
+  {
+    return unique( []( const Type& lhs, const Type& rhs ) { return lhs == rhs; } );
+  }
+
+  void reverse()
+  {
+    for ( Node* node = m_begin; node != nullptr; node = node->previous )
+      ql::swap( node->previous, node->next );
+
+    ql::swap( m_begin, m_end );
   }
 
   iterator       begin() { return iterator( m_begin ); }
@@ -217,9 +466,168 @@ public:
 
 private:
 
+  template<typename... Args>
+  Node* create_node( Args&&... args )
+  {
+    node_allocator allocator( m_allocator );
+    Node*          node = ql::construct_at( allocator.allocate( 1 ) );
+
+    try
+    {
+      allocator_traits::construct( m_allocator, &node->value, ql::forward<Args>( args )... );
+    }
+    catch ( ... )
+    {
+      ql::destroy_at( node );
+      allocator.deallocate( node, 1 );
+      throw;
+    }
+
+    return node;
+  }
+
+  void destroy_node( Node* node )
+  {
+    allocator_traits::destroy( m_allocator, &node->value );
+    ql::destroy_at( node );
+
+    node_allocator allocator( m_allocator );
+    allocator.deallocate( node, 1 );
+  }
+
+  // Takes the nodes of src when its allocator allows, otherwise moves the
+  // items into new nodes.
+  void take( List& src )
+  {
+    if ( allocator_traits::is_always_equal::value || m_allocator == src.m_allocator )
+    {
+      ql::swap( m_begin, src.m_begin );
+      ql::swap( m_end, src.m_end );
+      ql::swap( m_size, src.m_size );
+    }
+    else
+    {
+      for ( Type& item : src )
+        push_back( ql::move( item ) );
+
+      src.clear();
+    }
+  }
+
+  // Links node before pos, or at the end when pos is null.
+  void link_before( Node* pos, Node* node )
+  {
+    Node* previous = pos != nullptr ? pos->previous : m_end;
+
+    node->previous = previous;
+    node->next     = pos;
+
+    if ( previous != nullptr )
+      previous->next = node;
+    else
+      m_begin = node;
+
+    if ( pos != nullptr )
+      pos->previous = node;
+    else
+      m_end = node;
+
+    m_size++;
+  }
+
+  void unlink( Node* node )
+  {
+    if ( node->previous != nullptr )
+      node->previous->next = node->next;
+    else
+      m_begin = node->next;
+
+    if ( node->next != nullptr )
+      node->next->previous = node->previous;
+    else
+      m_end = node->previous;
+
+    node->previous = nullptr;
+    node->next     = nullptr;
+    m_size--;
+  }
+
+  // Relinks the nodes [first, tail] of other before pos. Sizes are left
+  // for the caller to adjust.
+  void transfer( Node* pos, List& other, Node* first, Node* tail )
+  {
+    if ( &other == this && ( pos == first || pos == tail->next ) )
+      return;
+
+    // Detach the range from other
+    if ( first->previous != nullptr )
+      first->previous->next = tail->next;
+    else
+      other.m_begin = tail->next;
+
+    if ( tail->next != nullptr )
+      tail->next->previous = first->previous;
+    else
+      other.m_end = first->previous;
+
+    // Attach it before pos
+    Node* previous = pos != nullptr ? pos->previous : m_end;
+
+    first->previous = previous;
+    tail->next      = pos;
+
+    if ( previous != nullptr )
+      previous->next = first;
+    else
+      m_begin = first;
+
+    if ( pos != nullptr )
+      pos->previous = tail;
+    else
+      m_end = tail;
+  }
+
+  // Merges two null-terminated runs linked through next only. Ties are
+  // taken from lhs, which must hold the earlier items.
+  template<typename Compare>
+  static Node* merge_runs( Node* lhs, Node* rhs, Compare& compare )
+  {
+    Node*  head = nullptr;
+    Node** tail = &head;
+
+    while ( lhs != nullptr && rhs != nullptr )
+    {
+      if ( compare( rhs->value, lhs->value ) )
+      {
+        *tail = rhs;
+        rhs   = rhs->next;
+      }
+      else
+      {
+        *tail = lhs;
+        lhs   = lhs->next;
+      }
+
+      tail = &( *tail )->next;
+    }
+
+    *tail = lhs != nullptr ? lhs : rhs;
+    return head;
+  }
+
+  Allocator m_allocator;
+
   std::size_t m_size  = 0;
   Node*       m_begin = nullptr;
   Node*       m_end   = nullptr;
 };
 
+namespace pmr
+{
+
+template<typename T>
+using List = ql::List<T, PolymorphicAllocator<T>>;
+
+} // namespace pmr
+
 } // namespace ql
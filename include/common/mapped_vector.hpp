@@ -0,0 +1,6 @@
+#pragma once
+#if __unix__
+#  include "common/unix/mapped_vector.hpp"
+#elif _WIN32
+#  include "common/win32/mapped_vector.hpp"
+#endif
@@ -1,6 +1,8 @@
 #pragma once
 #include "common/common.hpp"
 #include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include <atomic>
 #include <memory>
 #include <cstdint>
 #include <cstring>
@@ -79,67 +81,90 @@ protected:
   element_type* m_object = nullptr;
 };
 
+// Owns an object, destroying it with Deleter upon leaving scope. The
+// deleter is stored in the pointer, so it may carry state such as the pool
+// an object returns to; an empty deleter takes no space.
 template<typename T, typename Deleter = default_delete<T>>
 class UniquePtr : public Ptr<std::remove_extent_t<T>>
 {
 public:
 
   using element_type = std::remove_extent_t<T>;
+  using deleter_type = Deleter;
+
+  UniquePtr() = default;
+  UniquePtr( std::nullptr_t ) {}
 
   UniquePtr( element_type&& object )
   {
-    m_object = new element_type( move( object ) );
+    m_object = new element_type( ql::move( object ) );
+  }
+
+  // Takes ownership of object, to be destroyed with deleter
+  explicit UniquePtr( element_type* object, Deleter deleter = Deleter() )
+  : m_deleter( ql::move( deleter ) )
+  {
+    m_object = object;
   }
 
-  UniquePtr( const UniquePtr& other ) { assign( other ); }
-  UniquePtr( UniquePtr&& other ) { assign( move( other ) ); }
+  UniquePtr( const UniquePtr& ) = delete;
+  UniquePtr& operator=( const UniquePtr& ) = delete;
+
+  UniquePtr( UniquePtr&& other ) : m_deleter( ql::move( other.m_deleter ) ) { m_object = other.release(); }
 
   ~UniquePtr()
   {
     destruct();
   }
 
-  UniquePtr& operator=( const UniquePtr& other )
+  UniquePtr& operator=( UniquePtr&& other )
   {
-    destruct();
+    if ( this != &other )
+    {
+      destruct();
+      assign( ql::move( other ) );
+    }
 
-    assign( other );
     return *this;
   }
 
-  UniquePtr& operator=( UniquePtr&& other )
+  UniquePtr& operator=( std::nullptr_t )
   {
     destruct();
-
-    assign( move( other ) );
     return *this;
   }
 
-  UniquePtr& operator=( element_type* ptr )
+  // Destroys the owned object, if any, and takes ownership of object
+  void reset( element_type* object = nullptr )
   {
     destruct();
-
-    assign( ptr );
-    return *this;
+    m_object = object;
   }
 
-  void assign( const UniquePtr& other )
+  // Gives up ownership without destroying the object
+  [[nodiscard]] element_type* release()
   {
-    m_object = new element_type( *other.m_object );
+    element_type* object = m_object;
+    m_object = nullptr;
+    return object;
   }
 
+  Deleter&       get_deleter() { return m_deleter; }
+  const Deleter& get_deleter() const { return m_deleter; }
+
+protected:
+
   void assign( UniquePtr&& other )
   {
-    swap( m_object, other.m_object );
+    m_object  = other.release();
+    m_deleter = ql::move( other.m_deleter );
   }
 
-protected:
-
   void destruct()
   {
     if ( m_object != nullptr )
     {
-      deleter( m_object );
+      m_deleter( m_object );
       m_object = nullptr;
     }
   }
@@ -147,125 +172,310 @@ protected:
   using base = Ptr<element_type>;
   using base::m_object;
 
-  inline static Deleter deleter;
+  [[no_unique_address]] Deleter m_deleter;
 };
 
-class RefCount
+// Reference counts that may be shared between threads. Incrementing is
+// relaxed, as a new reference can only be made from an existing one; the
+// decrement that reaches zero acquires every other thread's writes to the
+// object before it is destroyed.
+class AtomicRefCount
 {
 public:
 
-  RefCount() = default;
+  AtomicRefCount( std::size_t n = 0 ) : m_count( n ) {}
+
+  void increment( std::size_t n = 1 ) { m_count.fetch_add( n, std::memory_order_relaxed ); }
 
-  RefCount( std::size_t n )
+  // Returns true if this released the last reference
+  bool decrement( std::size_t n = 1 ) { return m_count.fetch_sub( n, std::memory_order_acq_rel ) == n; }
+
+  // Increments unless the count has already reached zero
+  bool increment_if_not_zero()
   {
-    m_refCount = n;
+    std::size_t count = m_count.load( std::memory_order_relaxed );
+    while ( count != 0 )
+    {
+      if ( m_count.compare_exchange_weak( count, count + 1, std::memory_order_relaxed ) )
+        return true;
+    }
+
+    return false;
   }
 
-  RefCount& operator=( std::size_t n )
+  std::size_t load() const { return m_count.load( std::memory_order_relaxed ); }
+
+private:
+
+  std::atomic<std::size_t> m_count;
+};
+
+// Reference counts for pointers that never leave the thread that made them;
+// plain arithmetic, without the cost of atomic read-modify-writes.
+class LocalRefCount
+{
+public:
+
+  LocalRefCount( std::size_t n = 0 ) : m_count( n ) {}
+
+  void increment( std::size_t n = 1 ) { m_count += n; }
+  bool decrement( std::size_t n = 1 ) { return ( m_count -= n ) == 0; }
+
+  bool increment_if_not_zero()
   {
-    m_refCount = n;
-    return *this;
+    if ( m_count == 0 )
+      return false;
+
+    m_count++;
+    return true;
   }
 
-  operator std::size_t() const { return m_refCount; }
+  std::size_t load() const { return m_count; }
+
+private:
+
+  std::size_t m_count;
+};
+
+namespace detail
+{
+
+// The counts shared by every SharedPtr and WeakPtr to one object. The strong
+// references collectively hold one weak reference, so whichever of the last
+// SharedPtr or WeakPtr goes second frees the block.
+//
+// How the object is destroyed and the block freed depends on how they were
+// allocated, which is recorded in two function pointers rather than virtual
+// functions, keeping the block free of a vtable and RTTI.
+template<typename RefCount>
+struct ControlBlock
+{
+  using function = void ( * )( ControlBlock* );
 
-  bool operator==( std::size_t n ) const
+  ControlBlock( void* object, function dispose, function destroy )
+  : object( object ), dispose( dispose ), destroy( destroy )
   {
-    return m_refCount == n;
   }
 
-  RefCount& operator--(int)
+  RefCount strong = 1;
+  RefCount weak   = 1;
+
+  void* object; // For AtomicSharedPtr, which only holds the block
+
+  function dispose; // Destroys the object
+  function destroy; // Frees the block
+};
+
+// Owns an object allocated separately, destroyed with Deleter
+template<typename T, typename Deleter, typename RefCount>
+struct PointerControlBlock : ControlBlock<RefCount>
+{
+  using base = ControlBlock<RefCount>;
+
+  explicit PointerControlBlock( T* object )
+  : base( const_cast<std::remove_cv_t<T>*>( object ), &dispose_object, &destroy_block ), pointer( object )
   {
-    m_refCount--;
-    return *this;
   }
 
-  RefCount& operator++(int)
+  static void dispose_object( base* block )
   {
-    m_refCount++;
-    return *this;
+    PointerControlBlock* self = static_cast<PointerControlBlock*>( block );
+    self->deleter( self->pointer );
   }
 
-private:
-
-  std::size_t m_refCount = 0;
+  static void destroy_block( base* block )
+  {
+    delete static_cast<PointerControlBlock*>( block );
+  }
 
+  [[no_unique_address]] Deleter deleter;
+  T* pointer;
 };
 
-struct WeakStrongRefCount
+// Holds the object itself after the counts, so that make_shared and
+// allocate_shared make a single allocation and the counts share a cache line
+// with the start of the object.
+template<typename T, typename Allocator, typename RefCount>
+struct InplaceControlBlock : ControlBlock<RefCount>
 {
-  RefCount weak = 0;
-  RefCount strong = 0;
+  using base           = ControlBlock<RefCount>;
+  using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<InplaceControlBlock>;
+  using object_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+  explicit InplaceControlBlock( const Allocator& allocator )
+  : base( const_cast<std::remove_cv_t<T>*>( addressof( object ) ), &dispose_object, &destroy_block ), allocator( allocator )
+  {
+  }
+
+  // The union leaves the object to dispose_object
+  ~InplaceControlBlock() {}
+
+  static void dispose_object( base* block )
+  {
+    InplaceControlBlock*  self = static_cast<InplaceControlBlock*>( block );
+    object_allocator_type allocator( self->allocator );
+
+    std::allocator_traits<object_allocator_type>::destroy( allocator, addressof( self->object ) );
+  }
+
+  static void destroy_block( base* block )
+  {
+    InplaceControlBlock* self      = static_cast<InplaceControlBlock*>( block );
+    allocator_type       allocator = self->allocator;
+
+    ql::destroy_at( self );
+    std::allocator_traits<allocator_type>::deallocate( allocator, self, 1 );
+  }
+
+  [[no_unique_address]] allocator_type allocator;
+  union { T object; };
 };
 
-template<typename T, typename Deleter>
+} // namespace detail
+
+template<typename T, typename Deleter, typename RefCount>
 class WeakPtr;
 
-template<typename T, typename Deleter = default_delete<T>>
+// Shares ownership of an object, destroying it when the last SharedPtr to it
+// is released. RefCount selects AtomicRefCount (the default), for pointers
+// shared between threads, or LocalRefCount for single-threaded use.
+template<typename T, typename Deleter = default_delete<T>, typename RefCount = AtomicRefCount>
 class SharedPtr : public Ptr<std::remove_extent_t<T>>
 {
 public:
 
   using element_type = std::remove_extent_t<T>;
-  using weak_type = WeakPtr<element_type, Deleter>;
+  using weak_type = WeakPtr<element_type, Deleter, RefCount>;
 
   SharedPtr() = default;
 
+  // Moves object into the same allocation as its counts, where it is
+  // destroyed in place rather than by Deleter
   SharedPtr( element_type&& object )
   {
-    m_object = new element_type( move( object ) );
-    m_refCount = new WeakStrongRefCount { .weak = 0, .strong = 1 };
+    emplace( Allocator<element_type>(), ql::move( object ) );
   }
-  SharedPtr( const weak_type& other ) { assign( other ); }
+
+  // Takes ownership of an object allocated with new, to be destroyed with
+  // Deleter. Prefer make_shared, which allocates the object and its counts
+  // together.
+  explicit SharedPtr( element_type* object )
+  {
+    if ( object != nullptr )
+    {
+      try
+      {
+        m_refCount = new detail::PointerControlBlock<element_type, Deleter, RefCount>( object );
+      }
+      catch ( ... )
+      {
+        // The object is ours even if its counts couldn't be allocated
+        Deleter()( object );
+        throw;
+      }
+
+      m_object = object;
+    }
+  }
+
   SharedPtr( const SharedPtr& other ) { assign( other ); }
-  SharedPtr( SharedPtr&& other ) { assign( move( other ) ); }
+  SharedPtr( SharedPtr&& other ) noexcept { assign( ql::move( other ) ); }
+
+  // Locks a WeakPtr, leaving this empty if its object has been destroyed
+  SharedPtr( const weak_type& other ) { assign( other ); }
 
   ~SharedPtr()
   {
     destruct();
   }
 
+  // Locks a WeakPtr, before releasing the current object in case it is the
+  // same one
   SharedPtr& operator=( const weak_type& other )
   {
+    SharedPtr locked( other );
     destruct();
-
-    assign( other );
+    assign( ql::move( locked ) );
     return *this;
   }
 
   SharedPtr& operator=( const SharedPtr& other )
   {
-    destruct();
+    if ( this != &other )
+    {
+      destruct();
+      assign( other );
+    }
 
-    assign( other );
     return *this;
   }
 
   SharedPtr& operator=( SharedPtr&& other )
   {
-    destruct();
+    if ( this != &other )
+    {
+      destruct();
+      assign( ql::move( other ) );
+    }
 
-    assign( move( other ) );
     return *this;
   }
 
-  std::size_t use_count() const { return strong_ref_count(); }
+  std::size_t use_count() const { return m_refCount != nullptr ? m_refCount->strong.load() : 0; }
 
   bool unique() const { return use_count() == 1; }
 
+  void reset() { destruct(); }
+
+  // Constructs an object from args in the same allocation as its counts,
+  // made with allocator
+  template<typename Alloc, typename... Args>
+  static SharedPtr allocate( const Alloc& allocator, Args&&... args )
+  {
+    SharedPtr shared;
+    shared.emplace( allocator, ql::forward<Args>( args )... );
+    return shared;
+  }
+
 protected:
 
-  std::size_t strong_ref_count() const { return m_refCount != nullptr ? std::size_t( m_refCount->strong ) : 0; }
-  std::size_t weak_ref_count() const { return m_refCount != nullptr ? std::size_t( m_refCount->weak ) : 0; }
+  template<typename Alloc, typename... Args>
+  void emplace( const Alloc& allocator, Args&&... args )
+  {
+    static_assert( std::is_same_v<Deleter, default_delete<T>>,
+                   "SharedPtr: objects allocated with their counts can't have a custom Deleter" );
+
+    using block_type  = detail::InplaceControlBlock<element_type, Alloc, RefCount>;
+    using block_alloc = typename block_type::allocator_type;
+    using object_alloc = typename block_type::object_allocator_type;
+
+    block_alloc blockAllocator( allocator );
+    block_type* block = std::allocator_traits<block_alloc>::allocate( blockAllocator, 1 );
+    ql::construct_at( block, allocator );
+
+    try
+    {
+      object_alloc objectAllocator( allocator );
+      std::allocator_traits<object_alloc>::construct( objectAllocator, addressof( block->object ),
+                                                      ql::forward<Args>( args )... );
+    }
+    catch ( ... )
+    {
+      ql::destroy_at( block );
+      std::allocator_traits<block_alloc>::deallocate( blockAllocator, block, 1 );
+      throw;
+    }
+
+    m_object = addressof( block->object );
+    m_refCount = block;
+  }
 
   void assign( const weak_type& other )
   {
-    m_object = other.m_object;
-    m_refCount = other.m_refCount;
-
-    if ( m_refCount != nullptr )
+    if ( other.m_refCount != nullptr && other.m_refCount->strong.increment_if_not_zero() )
     {
-      m_refCount->strong++;
+      m_object = other.m_object;
+      m_refCount = other.m_refCount;
     }
   }
 
@@ -275,36 +485,26 @@ protected:
     m_refCount = other.m_refCount;
 
     if ( m_refCount != nullptr )
-    {
-      m_refCount->strong++;
-    }
+      m_refCount->strong.increment();
   }
 
   void assign( SharedPtr&& other )
   {
-    swap( m_object, other.m_object );
-    swap( m_refCount, other.m_refCount );
+    ql::swap( m_object, other.m_object );
+    ql::swap( m_refCount, other.m_refCount );
   }
 
   void destruct()
   {
-    if ( strong_ref_count() > 0 )
-    {
-      m_refCount->strong--;
-    }
-
-    if ( weak_ref_count() == 0 && strong_ref_count() == 0 )
+    if ( m_refCount != nullptr )
     {
-      if ( m_refCount != nullptr )
+      if ( m_refCount->strong.decrement() )
       {
-        delete m_refCount;
-      }
-    }
+        m_refCount->dispose( m_refCount );
 
-    // Delete the object
-    if ( use_count() == 0 && m_object != nullptr )
-    {
-      deleter( m_object );
+        if ( m_refCount->weak.decrement() )
+          m_refCount->destroy( m_refCount );
+      }
     }
 
     m_refCount = nullptr;
@@ -313,116 +513,100 @@ protected:
 
   friend weak_type;
 
+  template<typename>
+  friend class AtomicSharedPtr;
+
   using base = Ptr<element_type>;
   using base::m_object;
 
-  WeakStrongRefCount* m_refCount = nullptr;
-  inline static Deleter deleter;
+  detail::ControlBlock<RefCount>* m_refCount = nullptr;
 };
 
-// SharedPtr with no ownership, doesn't affect ref count
-template<typename T, typename Deleter = default_delete<T>>
+// Observes an object owned by SharedPtrs without keeping it alive. lock()
+// yields a SharedPtr to it, if it still exists.
+template<typename T, typename Deleter = default_delete<T>, typename RefCount = AtomicRefCount>
 class WeakPtr : public Ptr<std::remove_extent_t<T>>
 {
 public:
 
   using element_type = std::remove_extent_t<T>;
-  using shared_type = SharedPtr<element_type, Deleter>;
+  using shared_type = SharedPtr<element_type, Deleter, RefCount>;
 
   WeakPtr() = default;
 
-  WeakPtr( const shared_type& other ) { assign( other ); }
-  WeakPtr( const WeakPtr& other ) { assign( other ); }
-  WeakPtr( WeakPtr&& other ) { assign( move( other ) ); }
+  WeakPtr( const shared_type& other ) { assign( other.m_object, other.m_refCount ); }
+  WeakPtr( const WeakPtr& other ) { assign( other.m_object, other.m_refCount ); }
+  WeakPtr( WeakPtr&& other ) noexcept { assign( ql::move( other ) ); }
 
   ~WeakPtr()
   {
-    if ( m_refCount != nullptr )
-      destruct();
+    destruct();
   }
 
   WeakPtr& operator=( const shared_type& other )
   {
     destruct();
 
-    assign( other );
+    assign( other.m_object, other.m_refCount );
     return *this;
   }
 
   WeakPtr& operator=( const WeakPtr& other )
   {
-    destruct();
+    if ( this != &other )
+    {
+      destruct();
+      assign( other.m_object, other.m_refCount );
+    }
 
-    assign( other );
     return *this;
   }
 
   WeakPtr& operator=( WeakPtr&& other )
   {
-    destruct();
+    if ( this != &other )
+    {
+      destruct();
+      assign( ql::move( other ) );
+    }
 
-    assign( move( other ) );
     return *this;
   }
 
-  std::size_t use_count() const { return strong_ref_count(); }
+  std::size_t use_count() const { return m_refCount != nullptr ? m_refCount->strong.load() : 0; }
 
   bool expired() const { return use_count() == 0; }
 
+  void reset() { destruct(); }
+
   // Acquires the resource and guarantees an
   // extended lifetime for its usage
   shared_type lock() const
   {
-    return expired() ? shared_type() : shared_type( *this );
+    return shared_type( *this );
   }
 
 protected:
 
-  std::size_t strong_ref_count() const { return m_refCount != nullptr ? std::size_t( m_refCount->strong ) : 0; }
-  std::size_t weak_ref_count() const { return m_refCount != nullptr ? std::size_t( m_refCount->weak ) : 0; }
-
-  void assign( const shared_type& other )
+  void assign( element_type* object, detail::ControlBlock<RefCount>* refCount )
   {
-    m_object = other.m_object;
-    m_refCount = other.m_refCount;
+    m_object = object;
+    m_refCount = refCount;
 
     if ( m_refCount != nullptr )
-    {
-      m_refCount->weak++;
-    }
-  }
-
-  void assign( const WeakPtr& other )
-  {
-    m_object = other.m_object;
-    m_refCount = other.m_refCount;
-
-    if ( m_refCount != nullptr )
-    {
-      m_refCount->weak++;
-    }
+      m_refCount->weak.increment();
   }
 
   void assign( WeakPtr&& other )
   {
-    swap( m_object, other.m_object );
-    swap( m_refCount, other.m_refCount );
+    ql::swap( m_object, other.m_object );
+    ql::swap( m_refCount, other.m_refCount );
   }
 
   void destruct()
   {
-    if ( weak_ref_count() > 0 )
-    {
-      m_refCount->weak--;
-    }
-
-    if ( weak_ref_count() == 0 && strong_ref_count() == 0 )
-    {
-      if ( m_refCount != nullptr )
-      {
-        delete m_refCount;
-      }
-    }
+    if ( m_refCount != nullptr && m_refCount->weak.decrement() )
+      m_refCount->destroy( m_refCount );
 
     m_object = nullptr;
     m_refCount = nullptr;
@@ -433,19 +617,43 @@ protected:
   using base = Ptr<element_type>;
   using base::m_object;
 
-  WeakStrongRefCount* m_refCount = nullptr;
+  detail::ControlBlock<RefCount>* m_refCount = nullptr;
 };
 
+// Pointers for use within a single thread, counted without atomics
+template<typename T, typename Deleter = default_delete<T>>
+using LocalSharedPtr = SharedPtr<T, Deleter, LocalRefCount>;
+
+template<typename T, typename Deleter = default_delete<T>>
+using LocalWeakPtr = WeakPtr<T, Deleter, LocalRefCount>;
+
 template<typename T, typename Deleter = default_delete<T>, typename... Args>
 UniquePtr<T, Deleter> make_unique( Args&&... args )
 {
-  return UniquePtr<T, Deleter>( move( T( args... ) ) );
+  return UniquePtr<T, Deleter>( new T( ql::forward<Args>( args )... ) );
 }
 
-template<typename T, typename Deleter = default_delete<T>, typename... Args>
-SharedPtr<T, Deleter> make_shared( Args&&... args )
+// Constructs an object and its reference counts in a single allocation
+template<typename T, typename... Args>
+SharedPtr<T> make_shared( Args&&... args )
+{
+  return SharedPtr<T>::allocate( Allocator<T>(), ql::forward<Args>( args )... );
+}
+
+// As make_shared, allocating with allocator. The object is constructed
+// through the allocator, so a PolymorphicAllocator passes its resource on to
+// an allocator-aware object.
+template<typename T, typename Alloc, typename... Args>
+  requires ( !std::is_convertible_v<Alloc, MemoryResource*> )
+SharedPtr<T> allocate_shared( const Alloc& allocator, Args&&... args )
+{
+  return SharedPtr<T>::allocate( allocator, ql::forward<Args>( args )... );
+}
+
+template<typename T, typename... Args>
+SharedPtr<T> allocate_shared( MemoryResource* resource, Args&&... args )
 {
-  return SharedPtr<T, Deleter>( move( T( args... ) ) );
+  return SharedPtr<T>::allocate( PolymorphicAllocator<T>( resource ), ql::forward<Args>( args )... );
 }
 
 } // namespace ql
@@ -0,0 +1,588 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <bit>
+#include <mutex>
+
+namespace ql
+{
+
+namespace detail
+{
+
+inline byte_t* align_up( byte_t* ptr, std::size_t alignment )
+{
+  const std::uintptr_t address = reinterpret_cast<std::uintptr_t>( ptr );
+  return reinterpret_cast<byte_t*>( ( address + alignment - 1 ) & ~( alignment - 1 ) );
+}
+
+} // namespace detail
+
+// Tunes the pools of UnsynchronizedPoolResource and SynchronizedPoolResource.
+// Zero selects the default for either option.
+struct PoolOptions
+{
+  // The most blocks a pool requests from upstream at once. Pools start with
+  // small chunks and double them up to this limit.
+  std::size_t max_blocks_per_chunk = 0;
+
+  // Requests larger than this bypass the pools and go straight to upstream.
+  std::size_t largest_required_pool_block = 0;
+};
+
+struct PoolStatistics
+{
+  std::size_t bytes_in_use        = 0; // Block bytes handed out, plus bytes passed upstream
+  std::size_t peak_bytes_in_use   = 0;
+  std::size_t bytes_requested     = 0; // Bytes actually asked for by live allocations
+  std::size_t bytes_reserved      = 0; // Bytes currently held from upstream
+  std::size_t peak_bytes_reserved = 0;
+  std::size_t upstream_bytes      = 0; // Bytes of live requests too large for a pool
+  std::size_t allocations         = 0;
+  std::size_t deallocations       = 0;
+
+  // The fraction of handed out bytes lost to rounding up to a block size
+  double internal_fragmentation() const
+  {
+    return bytes_in_use != 0 ? 1.0 - double( bytes_requested ) / double( bytes_in_use ) : 0.0;
+  }
+
+  // The fraction of reserved bytes sitting idle in free blocks
+  double external_fragmentation() const
+  {
+    return bytes_reserved != 0 ? 1.0 - double( bytes_in_use ) / double( bytes_reserved ) : 0.0;
+  }
+};
+
+// A bump allocator. Allocations are carved sequentially out of an optional
+// initial buffer and then out of chunks requested from the upstream resource,
+// each one larger than the last. Deallocating does nothing; the memory is
+// reclaimed all at once by release(), or back to a marker by rewind().
+class MonotonicBufferResource : public MemoryResource
+{
+  struct Chunk
+  {
+    Chunk*      previous;
+    std::size_t size;
+  };
+
+public:
+
+  // A position in the resource that it can later be rewound to
+  struct Marker
+  {
+    Chunk*  chunk;
+    byte_t* current;
+    byte_t* end;
+  };
+
+  static constexpr std::size_t default_chunk_size = 4096;
+  static constexpr std::size_t growth_factor      = 2;
+
+  MonotonicBufferResource()
+  : MonotonicBufferResource( get_default_resource() )
+  {
+  }
+
+  explicit MonotonicBufferResource( MemoryResource* upstream )
+  : m_upstream( upstream )
+  {
+  }
+
+  MonotonicBufferResource( std::size_t initialSize, MemoryResource* upstream = get_default_resource() )
+  : m_upstream( upstream ),
+    m_initialChunkSize( initialSize > sizeof( Chunk ) ? initialSize : default_chunk_size ),
+    m_nextChunkSize( m_initialChunkSize )
+  {
+  }
+
+  MonotonicBufferResource( void* buffer, std::size_t size, MemoryResource* upstream = get_default_resource() )
+  : m_upstream( upstream ),
+    m_buffer( static_cast<byte_t*>( buffer ) ),
+    m_bufferSize( size ),
+    m_current( m_buffer ),
+    m_end( m_buffer + size )
+  {
+  }
+
+  MonotonicBufferResource( const MonotonicBufferResource& ) = delete;
+  MonotonicBufferResource& operator=( const MonotonicBufferResource& ) = delete;
+
+  ~MonotonicBufferResource() override
+  {
+    release();
+  }
+
+  // Returns every chunk to upstream and starts over from the initial buffer
+  void release()
+  {
+    free_chunks( m_chunks );
+    free_chunks( m_spare );
+
+    m_chunks        = nullptr;
+    m_spare         = nullptr;
+    m_current       = m_buffer;
+    m_end           = m_buffer + m_bufferSize;
+    m_nextChunkSize = m_initialChunkSize;
+  }
+
+  Marker mark() const
+  {
+    return Marker { m_chunks, m_current, m_end };
+  }
+
+  // Frees everything allocated since marker was taken in O(1) per chunk.
+  // Chunks acquired since then are kept aside and reused as the resource
+  // grows again, so a rewound frame does not go back to upstream.
+  void rewind( const Marker& marker )
+  {
+    while ( m_chunks != marker.chunk )
+    {
+      Chunk* chunk    = m_chunks;
+      m_chunks        = chunk->previous;
+      chunk->previous = m_spare;
+      m_spare         = chunk;
+    }
+
+    m_current = marker.current;
+    m_end     = marker.end;
+  }
+
+  MemoryResource* upstream_resource() const { return m_upstream; }
+
+  // The bytes remaining in the current chunk or buffer
+  std::size_t remaining() const { return std::size_t( m_end - m_current ); }
+
+private:
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    byte_t* ptr = detail::align_up( m_current, alignment );
+
+    if ( m_current == nullptr || bytes > std::size_t( m_end - m_current ) ||
+         std::size_t( ptr - m_current ) > std::size_t( m_end - m_current ) - bytes )
+    {
+      grow( bytes, alignment );
+      ptr = detail::align_up( m_current, alignment );
+    }
+
+    m_current = ptr + bytes;
+    return ptr;
+  }
+
+  void do_deallocate( void*, std::size_t, std::size_t ) override
+  {
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  void grow( std::size_t bytes, std::size_t alignment )
+  {
+    const std::size_t required = sizeof( Chunk ) + bytes + alignment;
+
+    // Prefer a chunk set aside by rewind()
+    Chunk* chunk = nullptr;
+    for ( Chunk** spare = &m_spare; *spare != nullptr; spare = &( *spare )->previous )
+    {
+      if ( ( *spare )->size >= required )
+      {
+        chunk  = *spare;
+        *spare = chunk->previous;
+        break;
+      }
+    }
+
+    if ( chunk == nullptr )
+    {
+      const std::size_t size = m_nextChunkSize > required ? m_nextChunkSize : required;
+
+      chunk       = static_cast<Chunk*>( m_upstream->allocate( size, alignof( std::max_align_t ) ) );
+      chunk->size = size;
+
+      m_nextChunkSize = size * growth_factor;
+    }
+
+    chunk->previous = m_chunks;
+    m_chunks        = chunk;
+    m_current       = reinterpret_cast<byte_t*>( chunk + 1 );
+    m_end           = reinterpret_cast<byte_t*>( chunk ) + chunk->size;
+  }
+
+  void free_chunks( Chunk* chunk )
+  {
+    while ( chunk != nullptr )
+    {
+      Chunk* previous = chunk->previous;
+      m_upstream->deallocate( chunk, chunk->size, alignof( std::max_align_t ) );
+      chunk = previous;
+    }
+  }
+
+  MemoryResource* m_upstream = nullptr;
+
+  byte_t*     m_buffer     = nullptr;
+  std::size_t m_bufferSize = 0;
+
+  Chunk*  m_chunks  = nullptr;
+  Chunk*  m_spare   = nullptr;
+  byte_t* m_current = nullptr;
+  byte_t* m_end     = nullptr;
+
+  std::size_t m_initialChunkSize = default_chunk_size;
+  std::size_t m_nextChunkSize    = default_chunk_size;
+};
+
+// A frame or request scoped view of a MonotonicBufferResource. Allocations
+// are forwarded to the arena, and everything allocated from the arena since
+// the scope began - through this view or otherwise - is freed when the scope
+// ends or rewind() is called.
+class ScopedArena : public MemoryResource
+{
+public:
+
+  explicit ScopedArena( MonotonicBufferResource& arena )
+  : m_arena( arena ),
+    m_marker( arena.mark() )
+  {
+  }
+
+  ScopedArena( const ScopedArena& ) = delete;
+  ScopedArena& operator=( const ScopedArena& ) = delete;
+
+  ~ScopedArena() override
+  {
+    rewind();
+  }
+
+  void rewind() { m_arena.rewind( m_marker ); }
+
+  MonotonicBufferResource& arena() const { return m_arena; }
+
+private:
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    return m_arena.allocate( bytes, alignment );
+  }
+
+  void do_deallocate( void*, std::size_t, std::size_t ) override
+  {
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  MonotonicBufferResource&        m_arena;
+  MonotonicBufferResource::Marker m_marker;
+};
+
+// Serves small allocations from pools of fixed-size blocks, one pool per
+// power-of-two size class. Freed blocks go onto their pool's free list and
+// are handed straight back out; only chunks of blocks are requested from
+// upstream, and requests too large for any pool are forwarded to it.
+//
+// Not thread-safe; see SynchronizedPoolResource.
+class UnsynchronizedPoolResource : public MemoryResource
+{
+  struct Block
+  {
+    Block* next;
+  };
+
+  // Stored after the blocks of each chunk, so that blocks keep the chunk's
+  // alignment.
+  struct Chunk
+  {
+    Chunk*      previous;
+    std::size_t size;
+  };
+
+  struct Pool
+  {
+    Block*      free          = nullptr;
+    byte_t*     current       = nullptr; // Not yet carved part of the newest chunk
+    byte_t*     end           = nullptr;
+    Chunk*      chunks        = nullptr;
+    std::size_t blockSize     = 0;
+    std::size_t blocksPerNext = 0;
+  };
+
+  static constexpr std::size_t smallest_block      = sizeof( void* ) * 2;
+  static constexpr std::size_t max_pool_alignment  = 4096;
+  static constexpr std::size_t max_pool_count      = 20;
+  static constexpr std::size_t initial_chunk_bytes = 1024;
+
+public:
+
+  static constexpr std::size_t default_max_blocks_per_chunk = 1024;
+  static constexpr std::size_t default_largest_block        = 4096;
+
+  UnsynchronizedPoolResource()
+  : UnsynchronizedPoolResource( PoolOptions(), get_default_resource() )
+  {
+  }
+
+  explicit UnsynchronizedPoolResource( MemoryResource* upstream )
+  : UnsynchronizedPoolResource( PoolOptions(), upstream )
+  {
+  }
+
+  explicit UnsynchronizedPoolResource( const PoolOptions& options, MemoryResource* upstream = get_default_resource() )
+  : m_upstream( upstream ),
+    m_options( normalise( options ) )
+  {
+    m_poolCount = std::size_t( std::countr_zero( m_options.largest_required_pool_block ) ) -
+                  std::size_t( std::countr_zero( smallest_block ) ) + 1;
+
+    for ( std::size_t i = 0; i < m_poolCount; i++ )
+    {
+      Pool& pool         = m_pools[ i ];
+      pool.blockSize     = smallest_block << i;
+      pool.blocksPerNext = initial_chunk_bytes / pool.blockSize;
+
+      if ( pool.blocksPerNext == 0 )
+        pool.blocksPerNext = 1;
+    }
+  }
+
+  UnsynchronizedPoolResource( const UnsynchronizedPoolResource& ) = delete;
+  UnsynchronizedPoolResource& operator=( const UnsynchronizedPoolResource& ) = delete;
+
+  ~UnsynchronizedPoolResource() override
+  {
+    release();
+  }
+
+  // Returns every chunk to upstream. Allocations forwarded to upstream are
+  // left for their owners to deallocate.
+  void release()
+  {
+    for ( std::size_t i = 0; i < m_poolCount; i++ )
+    {
+      Pool& pool = m_pools[ i ];
+
+      Chunk* chunk = pool.chunks;
+      while ( chunk != nullptr )
+      {
+        Chunk*  previous = chunk->previous;
+        byte_t* memory   = reinterpret_cast<byte_t*>( chunk ) + sizeof( Chunk ) - chunk->size;
+        m_upstream->deallocate( memory, chunk->size, chunk_alignment( pool ) );
+        chunk = previous;
+      }
+
+      pool.free    = nullptr;
+      pool.current = nullptr;
+      pool.end     = nullptr;
+      pool.chunks  = nullptr;
+    }
+
+    m_statistics.bytes_reserved  = m_statistics.upstream_bytes;
+    m_statistics.bytes_in_use    = m_statistics.upstream_bytes;
+    m_statistics.bytes_requested = m_statistics.upstream_bytes;
+  }
+
+  MemoryResource*    upstream_resource() const { return m_upstream; }
+  const PoolOptions& options() const { return m_options; }
+  PoolStatistics     statistics() const { return m_statistics; }
+
+private:
+
+  static PoolOptions normalise( PoolOptions options )
+  {
+    if ( options.max_blocks_per_chunk == 0 )
+      options.max_blocks_per_chunk = default_max_blocks_per_chunk;
+
+    if ( options.largest_required_pool_block == 0 )
+      options.largest_required_pool_block = default_largest_block;
+
+    const std::size_t largest = smallest_block << ( max_pool_count - 1 );
+    if ( options.largest_required_pool_block > largest )
+      options.largest_required_pool_block = largest;
+
+    options.largest_required_pool_block =
+      std::bit_ceil( ql::max( options.largest_required_pool_block, smallest_block ) );
+
+    return options;
+  }
+
+  // The pool serving a request, or nullptr if it must go upstream
+  Pool* find_pool( std::size_t bytes, std::size_t alignment )
+  {
+    std::size_t size = ql::max( ql::max( bytes, alignment ), smallest_block );
+    if ( size > m_options.largest_required_pool_block || alignment > max_pool_alignment )
+      return nullptr;
+
+    const std::size_t index = std::size_t( std::bit_width( ( size - 1 ) / smallest_block ) );
+    return &m_pools[ index ];
+  }
+
+  static std::size_t chunk_alignment( const Pool& pool )
+  {
+    return ql::max( alignof( Chunk ), ql::min( pool.blockSize, max_pool_alignment ) );
+  }
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    Pool* pool = find_pool( bytes, alignment );
+    if ( pool == nullptr )
+    {
+      void* memory = m_upstream->allocate( bytes, alignment );
+      m_statistics.upstream_bytes += bytes;
+      m_statistics.bytes_reserved += bytes;
+      record_allocation( bytes, bytes );
+      return memory;
+    }
+
+    void* block;
+    if ( pool->free != nullptr )
+    {
+      block      = pool->free;
+      pool->free = pool->free->next;
+    }
+    else
+    {
+      if ( pool->current == pool->end )
+        grow( *pool );
+
+      block = pool->current;
+      pool->current += pool->blockSize;
+    }
+
+    record_allocation( bytes, pool->blockSize );
+    return block;
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    Pool* pool = find_pool( bytes, alignment );
+    if ( pool == nullptr )
+    {
+      m_upstream->deallocate( memory, bytes, alignment );
+      m_statistics.upstream_bytes -= bytes;
+      m_statistics.bytes_reserved -= bytes;
+      record_deallocation( bytes, bytes );
+      return;
+    }
+
+    Block* block = static_cast<Block*>( memory );
+    block->next  = pool->free;
+    pool->free   = block;
+
+    record_deallocation( bytes, pool->blockSize );
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  void grow( Pool& pool )
+  {
+    const std::size_t blockBytes = pool.blocksPerNext * pool.blockSize;
+    const std::size_t size       = blockBytes + sizeof( Chunk );
+
+    byte_t* memory = static_cast<byte_t*>( m_upstream->allocate( size, chunk_alignment( pool ) ) );
+
+    Chunk* chunk    = reinterpret_cast<Chunk*>( memory + blockBytes );
+    chunk->previous = pool.chunks;
+    chunk->size     = size;
+
+    pool.chunks  = chunk;
+    pool.current = memory;
+    pool.end     = memory + blockBytes;
+
+    if ( pool.blocksPerNext * 2 <= m_options.max_blocks_per_chunk )
+      pool.blocksPerNext *= 2;
+
+    m_statistics.bytes_reserved += size;
+    m_statistics.peak_bytes_reserved = ql::max( m_statistics.peak_bytes_reserved, m_statistics.bytes_reserved );
+  }
+
+  void record_allocation( std::size_t requested, std::size_t used )
+  {
+    m_statistics.allocations++;
+    m_statistics.bytes_requested += requested;
+    m_statistics.bytes_in_use += used;
+    m_statistics.peak_bytes_in_use   = ql::max( m_statistics.peak_bytes_in_use, m_statistics.bytes_in_use );
+    m_statistics.peak_bytes_reserved = ql::max( m_statistics.peak_bytes_reserved, m_statistics.bytes_reserved );
+  }
+
+  void record_deallocation( std::size_t requested, std::size_t used )
+  {
+    m_statistics.deallocations++;
+    m_statistics.bytes_requested -= requested;
+    m_statistics.bytes_in_use -= used;
+  }
+
+  MemoryResource* m_upstream = nullptr;
+  PoolOptions     m_options;
+  PoolStatistics  m_statistics;
+
+  Pool        m_pools[ max_pool_count ];
+  std::size_t m_poolCount = 0;
+};
+
+// An UnsynchronizedPoolResource that may be shared between threads.
+class SynchronizedPoolResource : public MemoryResource
+{
+public:
+
+  SynchronizedPoolResource() = default;
+
+  explicit SynchronizedPoolResource( MemoryResource* upstream )
+  : m_resource( upstream )
+  {
+  }
+
+  explicit SynchronizedPoolResource( const PoolOptions& options, MemoryResource* upstream = get_default_resource() )
+  : m_resource( options, upstream )
+  {
+  }
+
+  void release()
+  {
+    std::lock_guard lock( m_mutex );
+    m_resource.release();
+  }
+
+  MemoryResource*    upstream_resource() const { return m_resource.upstream_resource(); }
+  const PoolOptions& options() const { return m_resource.options(); }
+
+  PoolStatistics statistics() const
+  {
+    std::lock_guard lock( m_mutex );
+    return m_resource.statistics();
+  }
+
+private:
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    std::lock_guard lock( m_mutex );
+    return m_resource.allocate( bytes, alignment );
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    std::lock_guard lock( m_mutex );
+    m_resource.deallocate( memory, bytes, alignment );
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  mutable std::mutex         m_mutex;
+  UnsynchronizedPoolResource m_resource;
+};
+
+} // namespace ql
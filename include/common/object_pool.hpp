@@ -0,0 +1,297 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include "common/memory.hpp"
+#include "common/thread_local.hpp"
+#include "common/vector.hpp"
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+namespace ql
+{
+
+// How an ObjectPool treats objects between uses.
+//  - construct: constructed from acquire()'s arguments, destroyed on return.
+//  - reset:     default constructed a slab at a time and kept alive between
+//               uses, so they keep their buffers; a reset hook is called on
+//               return, and acquire() takes no arguments.
+enum class PoolMode
+{
+  construct,
+  reset
+};
+
+// Recycles objects of one type, for messages, buffers and the like that are
+// created and destroyed at a high rate. Objects live in slabs allocated
+// from a MemoryResource and are handed out as Handles, UniquePtrs whose
+// deleter returns the object to the pool.
+//
+// Each thread keeps a free list of its own, so acquiring and returning are a
+// few pointer moves without locking. Threads exchange batches of free
+// objects through a shared list, so objects returned on one thread are
+// reused by others.
+//
+// The pool must outlive its handles.
+template<typename T, PoolMode Mode = PoolMode::construct>
+class ObjectPool
+{
+  static_assert( Mode == PoolMode::construct || std::is_default_constructible_v<T>,
+                 "ObjectPool: objects of a resetting pool must be default constructible" );
+
+  struct Slot
+  {
+    Slot* next;
+    alignas( T ) byte_t storage[ sizeof( T ) ];
+
+    T* object() { return std::launder( reinterpret_cast<T*>( storage ) ); }
+
+    static Slot* from( T* object )
+    {
+      return reinterpret_cast<Slot*>( reinterpret_cast<byte_t*>( object ) - offsetof( Slot, storage ) );
+    }
+  };
+
+  // A list of free slots
+  struct FreeList
+  {
+    Slot*       head  = nullptr;
+    std::size_t count = 0;
+
+    void push( Slot* slot )
+    {
+      slot->next = head;
+      head       = slot;
+      count++;
+    }
+
+    Slot* pop()
+    {
+      Slot* slot = head;
+      head = slot->next;
+      count--;
+      return slot;
+    }
+
+    // Moves up to n slots to other
+    void move( FreeList& other, std::size_t n )
+    {
+      while ( n-- != 0 && head != nullptr )
+        other.push( pop() );
+    }
+  };
+
+  struct Cache
+  {
+    void on_thread_exit()
+    {
+      if ( pool != nullptr )
+      {
+        std::lock_guard lock( pool->m_mutex );
+        free.move( pool->m_overflow, free.count );
+      }
+    }
+
+    FreeList    free;
+    ObjectPool* pool = nullptr;
+  };
+
+  struct Slab
+  {
+    Slot*       slots;
+    std::size_t count;
+  };
+
+public:
+
+  using reset_function = void ( * )( T& object );
+
+  // Returns objects to their pool
+  class Recycler
+  {
+  public:
+
+    Recycler() = default;
+    explicit Recycler( ObjectPool* pool ) : m_pool( pool ) {}
+
+    void operator()( T* object ) const { m_pool->recycle( object ); }
+
+  private:
+
+    ObjectPool* m_pool = nullptr;
+  };
+
+  using Handle = UniquePtr<T, Recycler>;
+
+  // Objects moved between a thread and the shared list at once
+  static constexpr std::size_t batch_size = 32;
+
+  explicit ObjectPool( std::size_t slabSize = 256, MemoryResource* resource = get_default_resource() )
+    requires ( Mode == PoolMode::construct )
+  : m_slabSize( slabSize ), m_resource( resource )
+  {
+  }
+
+  explicit ObjectPool( reset_function reset, std::size_t slabSize = 256,
+                       MemoryResource* resource = get_default_resource() )
+    requires ( Mode == PoolMode::reset )
+  : m_slabSize( slabSize ), m_resource( resource ), m_reset( reset )
+  {
+  }
+
+  ObjectPool( const ObjectPool& ) = delete;
+  ObjectPool& operator=( const ObjectPool& ) = delete;
+
+  ~ObjectPool()
+  {
+    m_caches.clear();
+
+    for ( const Slab& slab : m_slabs )
+    {
+      if constexpr ( Mode == PoolMode::reset )
+      {
+        for ( std::size_t i = 0; i < slab.count; i++ )
+          ql::destroy_at( slab.slots[ i ].object() );
+      }
+
+      m_resource->deallocate( slab.slots, slab.count * sizeof( Slot ), alignof( Slot ) );
+    }
+  }
+
+  // Constructs an object from args
+  template<typename... Args>
+    requires ( Mode == PoolMode::construct )
+  [[nodiscard]] Handle acquire( Args&&... args )
+  {
+    Cache& cache = this->cache();
+    Slot*  slot  = take( cache );
+
+    try
+    {
+      ql::construct_at( reinterpret_cast<T*>( slot->storage ), ql::forward<Args>( args )... );
+    }
+    catch ( ... )
+    {
+      cache.free.push( slot );
+      throw;
+    }
+
+    return Handle( slot->object(), Recycler( this ) );
+  }
+
+  // Hands out a recycled object, as the reset hook left it
+  [[nodiscard]] Handle acquire()
+    requires ( Mode == PoolMode::reset )
+  {
+    return Handle( take( cache() )->object(), Recycler( this ) );
+  }
+
+  // Slots allocated, in use or free
+  std::size_t capacity() const
+  {
+    std::lock_guard lock( m_mutex );
+
+    std::size_t slots = 0;
+    for ( const Slab& slab : m_slabs )
+      slots += slab.count;
+
+    return slots;
+  }
+
+  std::size_t slab_count() const
+  {
+    std::lock_guard lock( m_mutex );
+    return m_slabs.size();
+  }
+
+private:
+
+  Cache& cache()
+  {
+    Cache& cache = m_caches.get();
+    cache.pool = this;
+    return cache;
+  }
+
+  Slot* take( Cache& cache )
+  {
+    if ( cache.free.head == nullptr ) [[unlikely]]
+      refill( cache );
+
+    return cache.free.pop();
+  }
+
+  void recycle( T* object )
+  {
+    if constexpr ( Mode == PoolMode::reset )
+      m_reset( *object );
+    else
+      ql::destroy_at( object );
+
+    Cache& cache = this->cache();
+    cache.free.push( Slot::from( object ) );
+
+    // Hand surplus back, so a thread that only returns objects doesn't
+    // hoard them
+    if ( cache.free.count > 2 * batch_size ) [[unlikely]]
+    {
+      std::lock_guard lock( m_mutex );
+      cache.free.move( m_overflow, batch_size );
+    }
+  }
+
+  // Takes a batch from the shared list, or allocates a slab
+  void refill( Cache& cache )
+  {
+    std::lock_guard lock( m_mutex );
+
+    if ( m_overflow.head == nullptr )
+      allocate_slab();
+
+    m_overflow.move( cache.free, batch_size );
+  }
+
+  // Must be called with m_mutex held
+  void allocate_slab()
+  {
+    Slot* slots = static_cast<Slot*>( m_resource->allocate( m_slabSize * sizeof( Slot ), alignof( Slot ) ) );
+
+    std::size_t built = 0;
+    try
+    {
+      if constexpr ( Mode == PoolMode::reset )
+      {
+        for ( ; built < m_slabSize; built++ )
+          ql::construct_at( reinterpret_cast<T*>( slots[ built ].storage ) );
+      }
+
+      m_slabs.push_back( Slab { slots, m_slabSize } );
+    }
+    catch ( ... )
+    {
+      for ( std::size_t i = 0; i < built; i++ )
+        ql::destroy_at( slots[ i ].object() );
+
+      m_resource->deallocate( slots, m_slabSize * sizeof( Slot ), alignof( Slot ) );
+      throw;
+    }
+
+    // In reverse, so slots are handed out in address order
+    for ( std::size_t i = m_slabSize; i-- != 0; )
+      m_overflow.push( &slots[ i ] );
+  }
+
+  const std::size_t    m_slabSize;
+  MemoryResource*      m_resource;
+  const reset_function m_reset = nullptr;
+
+  mutable std::mutex m_mutex;
+  FreeList           m_overflow;
+  Vector<Slab>       m_slabs;
+
+  ThreadLocal<Cache> m_caches;
+};
+
+} // namespace ql
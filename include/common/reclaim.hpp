@@ -0,0 +1,508 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include "common/thread_local.hpp"
+#include "common/vector.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace ql
+{
+
+// Deferred freeing for lock-free structures. A node unlinked from such a
+// structure may still be read by threads that found it beforehand, so it is
+// retired rather than freed, and freed once no thread can hold it.
+//
+//  - EpochDomain: threads pin the current epoch while reading. Cheap to
+//    enter, but one stalled reader holds back every retired node.
+//  - HazardDomain: readers publish each pointer they hold. Dearer per read,
+//    but the number of unfreed nodes stays bounded.
+//
+// Threads register with a domain on first use, ql::Thread or otherwise, and
+// hand their unfreed nodes to the domain when they exit. Nodes are freed
+// with delete, or through the MemoryResource they were allocated from.
+namespace reclaim
+{
+
+// A node awaiting reclamation
+struct Retired
+{
+  using function = void ( * )( void* object, MemoryResource* resource );
+
+  void*           object   = nullptr;
+  function        free     = nullptr;
+  MemoryResource* resource = nullptr;
+
+  template<typename T>
+  static Retired make( T* object, MemoryResource* resource )
+  {
+    if ( resource == nullptr )
+      return Retired { object, []( void* object, MemoryResource* ) { delete static_cast<T*>( object ); }, nullptr };
+
+    return Retired { object, []( void* object, MemoryResource* resource )
+    {
+      ql::destroy_at( static_cast<T*>( object ) );
+      resource->deallocate( object, sizeof( T ), alignof( T ) );
+    }, resource };
+  }
+
+  void reclaim() { free( object, resource ); }
+};
+
+// Retired nodes left behind by exited threads, freed by whichever thread
+// next collects
+template<typename Node>
+class Orphans
+{
+public:
+
+  ~Orphans()
+  {
+    for ( Node& node : m_nodes )
+      node.reclaim();
+  }
+
+  void adopt( Vector<Node>& nodes )
+  {
+    std::lock_guard lock( m_mutex );
+
+    for ( Node& node : nodes )
+      m_nodes.push_back( node );
+
+    m_count.store( m_nodes.size(), std::memory_order_relaxed );
+  }
+
+  void take( Vector<Node>& nodes )
+  {
+    if ( m_count.load( std::memory_order_relaxed ) == 0 )
+      return;
+
+    std::lock_guard lock( m_mutex );
+
+    for ( Node& node : m_nodes )
+      nodes.push_back( node );
+
+    m_nodes.clear();
+    m_count.store( 0, std::memory_order_relaxed );
+  }
+
+private:
+
+  std::mutex               m_mutex;
+  Vector<Node>             m_nodes;
+  std::atomic<std::size_t> m_count = 0;
+};
+
+// Epoch based reclamation. Readers hold a Guard while they may touch
+// shared nodes:
+//
+//   {
+//     auto guard = domain.pin();
+//     Node* node = head.load( std::memory_order_acquire );
+//     ...
+//   }
+//
+// A node retired in epoch e is freed once the global epoch reaches e + 2,
+// which it can only do after every thread pinned at the time has unpinned.
+// Retired nodes are batched per thread, and each batch tries to advance the
+// epoch before freeing what it can.
+class EpochDomain
+{
+  struct Node
+  {
+    Retired       retired;
+    std::uint64_t epoch;
+
+    void reclaim() { retired.reclaim(); }
+  };
+
+  // A thread's registration. The low bit of state is set while pinned,
+  // the rest is the epoch it pinned.
+  struct Record
+  {
+    ~Record()
+    {
+      // Only reached when the domain is destroyed
+      for ( Node& node : retired )
+        node.reclaim();
+    }
+
+    void on_thread_exit()
+    {
+      if ( domain != nullptr )
+        domain->m_orphans.adopt( retired );
+
+      retired.clear();
+    }
+
+    std::atomic<std::uint64_t> state = 0;
+    std::size_t                depth = 0;
+    Vector<Node>               retired;
+    EpochDomain*               domain = nullptr;
+  };
+
+public:
+
+  static constexpr std::size_t batch_size = 64;
+
+  // Keeps the calling thread pinned while alive. Guards nest.
+  class Guard
+  {
+  public:
+
+    explicit Guard( EpochDomain& domain ) : m_domain( &domain ) { domain.enter(); }
+
+    Guard( const Guard& ) = delete;
+    Guard& operator=( const Guard& ) = delete;
+
+    ~Guard()
+    {
+      m_domain->leave();
+    }
+
+  private:
+
+    EpochDomain* m_domain;
+  };
+
+  EpochDomain() = default;
+
+  EpochDomain( const EpochDomain& ) = delete;
+  EpochDomain& operator=( const EpochDomain& ) = delete;
+
+  // No thread may be pinned, and retired nodes are freed immediately
+  ~EpochDomain()
+  {
+    m_records.clear();
+  }
+
+  [[nodiscard]] Guard pin() { return Guard( *this ); }
+
+  // Frees object with delete, or deallocates it from resource, once no
+  // pinned thread can hold it. Must already be unreachable for new readers.
+  template<typename T>
+  void retire( T* object, MemoryResource* resource = nullptr )
+  {
+    Record& record = this->record();
+    record.retired.push_back( Node { Retired::make( object, resource ), m_epoch.load( std::memory_order_seq_cst ) } );
+    m_pending.fetch_add( 1, std::memory_order_relaxed );
+
+    if ( record.retired.size() >= batch_size )
+      collect();
+  }
+
+  // Tries to advance the epoch, then frees the calling thread's nodes (and
+  // any left by exited threads) that are now safe
+  void collect()
+  {
+    Record& record = this->record();
+    m_orphans.take( record.retired );
+
+    try_advance();
+
+    const std::uint64_t epoch = m_epoch.load( std::memory_order_acquire );
+
+    std::size_t kept = 0;
+    for ( Node& node : record.retired )
+    {
+      if ( node.epoch + 2 <= epoch )
+        node.reclaim();
+      else
+        record.retired[ kept++ ] = node;
+    }
+
+    m_pending.fetch_sub( record.retired.size() - kept, std::memory_order_relaxed );
+    record.retired.resize( kept );
+  }
+
+  // Nodes retired but not yet freed, across all threads
+  std::size_t pending() const { return m_pending.load( std::memory_order_relaxed ); }
+
+  std::uint64_t epoch() const { return m_epoch.load( std::memory_order_relaxed ); }
+
+private:
+
+  Record& record()
+  {
+    Record& record = m_records.get();
+    record.domain = this;
+    return record;
+  }
+
+  void enter()
+  {
+    Record& record = this->record();
+    if ( record.depth++ != 0 )
+      return;
+
+    // The pin must be visible before any shared node is read. A store alone
+    // doesn't order the reader's later loads after it, so fence, pairing
+    // with the sequentially consistent loads in try_advance. If the epoch
+    // moved before the pin was seen, pin the newer one.
+    std::uint64_t epoch = m_epoch.load( std::memory_order_relaxed );
+    for ( ;; )
+    {
+      record.state.store( epoch << 1 | 1, std::memory_order_seq_cst );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+
+      const std::uint64_t current = m_epoch.load( std::memory_order_relaxed );
+      if ( current == epoch )
+        return;
+
+      epoch = current;
+    }
+  }
+
+  void leave()
+  {
+    Record& record = m_records.get();
+    if ( --record.depth == 0 )
+      record.state.store( 0, std::memory_order_release );
+  }
+
+  // Advances the epoch if every pinned thread has seen the current one
+  void try_advance()
+  {
+    std::uint64_t epoch   = m_epoch.load( std::memory_order_seq_cst );
+    bool          current = true;
+
+    m_records.for_each( [&]( Record& record )
+    {
+      const std::uint64_t state = record.state.load( std::memory_order_seq_cst );
+      if ( ( state & 1 ) != 0 && ( state >> 1 ) != epoch )
+        current = false;
+    } );
+
+    if ( current )
+      m_epoch.compare_exchange_strong( epoch, epoch + 1, std::memory_order_seq_cst );
+  }
+
+  std::atomic<std::uint64_t> m_epoch   = 0;
+  std::atomic<std::size_t>   m_pending = 0;
+  Orphans<Node>              m_orphans;
+  ThreadLocal<Record>        m_records;
+};
+
+// Hazard pointer reclamation. A reader protects each node before using it:
+//
+//   auto hazard = domain.hazard();
+//   Node* node  = hazard.protect( head );
+//
+// protect() publishes the pointer and re-reads the source until the two
+// agree, after which the node can't be freed until the hazard is reset or
+// destroyed. Retired nodes are freed in scans once a thread has retired
+// more than twice as many as there are hazards, so at most that many per
+// thread are ever pending.
+class HazardDomain
+{
+  struct Slot
+  {
+    std::atomic<const void*> pointer = nullptr;
+    std::atomic<bool>        active  = false;
+    Slot*                    next    = nullptr;
+  };
+
+  struct Record
+  {
+    ~Record()
+    {
+      for ( Retired& node : retired )
+        node.reclaim();
+    }
+
+    void on_thread_exit()
+    {
+      if ( domain != nullptr )
+        domain->m_orphans.adopt( retired );
+
+      retired.clear();
+    }
+
+    Vector<Retired> retired;
+    HazardDomain*   domain = nullptr;
+  };
+
+public:
+
+  static constexpr std::size_t min_scan = 64;
+
+  // Protects one pointer at a time. Holds a slot of the domain until
+  // destroyed.
+  class Hazard
+  {
+  public:
+
+    Hazard() = default;
+    explicit Hazard( HazardDomain& domain ) : m_slot( domain.acquire() ) {}
+
+    Hazard( const Hazard& ) = delete;
+    Hazard& operator=( const Hazard& ) = delete;
+
+    Hazard( Hazard&& other ) { ql::swap( m_slot, other.m_slot ); }
+
+    Hazard& operator=( Hazard&& other )
+    {
+      ql::swap( m_slot, other.m_slot );
+      return *this;
+    }
+
+    ~Hazard()
+    {
+      if ( m_slot != nullptr )
+      {
+        reset();
+        m_slot->active.store( false, std::memory_order_release );
+      }
+    }
+
+    // Loads source and protects the result
+    template<typename T>
+    T* protect( const std::atomic<T*>& source )
+    {
+      T* pointer = source.load( std::memory_order_relaxed );
+      for ( ;; )
+      {
+        set( pointer );
+
+        T* reloaded = source.load( std::memory_order_acquire );
+        if ( reloaded == pointer )
+          return pointer;
+
+        pointer = reloaded;
+      }
+    }
+
+    // Protects pointer, which the caller must then check is still reachable
+    void set( const void* pointer ) { m_slot->pointer.store( pointer, std::memory_order_seq_cst ); }
+
+    void reset() { m_slot->pointer.store( nullptr, std::memory_order_release ); }
+
+  private:
+
+    Slot* m_slot = nullptr;
+  };
+
+  HazardDomain() = default;
+
+  HazardDomain( const HazardDomain& ) = delete;
+  HazardDomain& operator=( const HazardDomain& ) = delete;
+
+  // No hazards may remain, and retired nodes are freed immediately
+  ~HazardDomain()
+  {
+    m_records.clear();
+
+    Slot* slot = m_slots.load( std::memory_order_relaxed );
+    while ( slot != nullptr )
+    {
+      Slot* next = slot->next;
+      delete slot;
+      slot = next;
+    }
+  }
+
+  [[nodiscard]] Hazard hazard() { return Hazard( *this ); }
+
+  // Frees object with delete, or deallocates it from resource, once no
+  // hazard protects it. Must already be unreachable for new readers.
+  template<typename T>
+  void retire( T* object, MemoryResource* resource = nullptr )
+  {
+    Record& record = this->record();
+    record.retired.push_back( Retired::make( object, resource ) );
+    m_pending.fetch_add( 1, std::memory_order_relaxed );
+
+    if ( record.retired.size() >= threshold() )
+      collect();
+  }
+
+  // Frees the calling thread's nodes (and any left by exited threads) that
+  // no hazard protects
+  void collect()
+  {
+    Record& record = this->record();
+    m_orphans.take( record.retired );
+
+    // Pairs with the store in Hazard::set
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    Vector<const void*> hazards;
+    for ( Slot* slot = m_slots.load( std::memory_order_acquire ); slot != nullptr; slot = slot->next )
+    {
+      if ( const void* pointer = slot->pointer.load( std::memory_order_seq_cst ) )
+        hazards.push_back( pointer );
+    }
+
+    std::sort( hazards.begin(), hazards.end() );
+
+    std::size_t kept = 0;
+    for ( Retired& node : record.retired )
+    {
+      if ( std::binary_search( hazards.begin(), hazards.end(), node.object ) )
+        record.retired[ kept++ ] = node;
+      else
+        node.reclaim();
+    }
+
+    m_pending.fetch_sub( record.retired.size() - kept, std::memory_order_relaxed );
+    record.retired.resize( kept );
+  }
+
+  // Nodes retired but not yet freed, across all threads
+  std::size_t pending() const { return m_pending.load( std::memory_order_relaxed ); }
+
+  // Slots ever created, one per hazard that was alive at the same time
+  std::size_t hazard_count() const { return m_slotCount.load( std::memory_order_relaxed ); }
+
+private:
+
+  Record& record()
+  {
+    Record& record = m_records.get();
+    record.domain = this;
+    return record;
+  }
+
+  std::size_t threshold() const
+  {
+    const std::size_t scaled = 2 * hazard_count();
+    return scaled > min_scan ? scaled : min_scan;
+  }
+
+  // Reuses an inactive slot, or pushes a new one. Slots are only freed with
+  // the domain, so the list can be walked without protection.
+  Slot* acquire()
+  {
+    for ( Slot* slot = m_slots.load( std::memory_order_acquire ); slot != nullptr; slot = slot->next )
+    {
+      bool expected = false;
+      if ( !slot->active.load( std::memory_order_relaxed ) &&
+           slot->active.compare_exchange_strong( expected, true, std::memory_order_acquire ) )
+        return slot;
+    }
+
+    Slot* slot = new Slot;
+    slot->active.store( true, std::memory_order_relaxed );
+    slot->next = m_slots.load( std::memory_order_relaxed );
+
+    while ( !m_slots.compare_exchange_weak( slot->next, slot, std::memory_order_release, std::memory_order_relaxed ) )
+      ;
+
+    m_slotCount.fetch_add( 1, std::memory_order_relaxed );
+    return slot;
+  }
+
+  std::atomic<Slot*>       m_slots     = nullptr;
+  std::atomic<std::size_t> m_slotCount = 0;
+  std::atomic<std::size_t> m_pending   = 0;
+  Orphans<Retired>         m_orphans;
+  ThreadLocal<Record>      m_records;
+};
+
+} // namespace reclaim
+
+} // namespace ql
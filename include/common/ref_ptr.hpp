@@ -0,0 +1,157 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/memory.hpp"
+#include <concepts>
+#include <cstddef>
+#include <type_traits>
+
+namespace ql
+{
+
+template<typename T>
+class RefPtr;
+
+// Embeds a reference count in Derived, for objects handled through RefPtr.
+// Unlike SharedPtr there is no separate control block: the handle is a
+// single pointer and the count lives in the object's first cache line.
+//
+// Objects start with one reference, which the first RefPtr adopts. When the
+// last reference is released Derived::destroy( object ) is called, which
+// deletes the object unless Derived declares its own, e.g. to return it to a
+// pool. RefCount selects AtomicRefCount (the default) or LocalRefCount, as
+// for SharedPtr.
+template<typename Derived, typename RefCount = AtomicRefCount>
+class RefCounted
+{
+public:
+
+  void retain() const { m_refCount.increment(); }
+
+  void release() const
+  {
+    if ( m_refCount.decrement() )
+      Derived::destroy( static_cast<Derived*>( const_cast<RefCounted*>( this ) ) );
+  }
+
+  std::size_t ref_count() const { return m_refCount.load(); }
+
+  // A new reference to this object, which must already be referenced
+  RefPtr<Derived>       ref_from_this() { return RefPtr<Derived>::retain( static_cast<Derived*>( this ) ); }
+  RefPtr<const Derived> ref_from_this() const { return RefPtr<const Derived>::retain( static_cast<const Derived*>( this ) ); }
+
+  static void destroy( Derived* object ) { delete object; }
+
+protected:
+
+  RefCounted() = default;
+
+  // A copy is a new object, with references of its own
+  RefCounted( const RefCounted& ) {}
+  RefCounted& operator=( const RefCounted& ) { return *this; }
+
+  ~RefCounted() = default;
+
+private:
+
+  mutable RefCount m_refCount = 1;
+};
+
+// A handle to an object with an embedded reference count, such as one
+// deriving from RefCounted. Copying retains the object and destruction
+// releases it.
+//
+// Raw pointers are turned into handles explicitly: adopt() takes over a
+// reference the caller already owns, such as a new object's, while retain()
+// adds one, as for a raw `this`.
+template<typename T>
+class RefPtr
+{
+public:
+
+  using element_type = T;
+
+  RefPtr() = default;
+  RefPtr( std::nullptr_t ) {}
+
+  RefPtr( const RefPtr& other ) : m_object( other.m_object )
+  {
+    if ( m_object != nullptr )
+      m_object->retain();
+  }
+
+  RefPtr( RefPtr&& other ) : m_object( other.detach() ) {}
+
+  template<typename U>
+    requires std::convertible_to<U*, T*>
+  RefPtr( const RefPtr<U>& other ) : RefPtr( retain( other.get() ) ) {}
+
+  template<typename U>
+    requires std::convertible_to<U*, T*>
+  RefPtr( RefPtr<U>&& other ) : m_object( other.detach() ) {}
+
+  ~RefPtr()
+  {
+    if ( m_object != nullptr )
+      m_object->release();
+  }
+
+  RefPtr& operator=( RefPtr other )
+  {
+    swap( other );
+    return *this;
+  }
+
+  // Takes over a reference already owned by the caller
+  static RefPtr adopt( T* object )
+  {
+    RefPtr ref;
+    ref.m_object = object;
+    return ref;
+  }
+
+  // Adds a reference to object
+  static RefPtr retain( T* object )
+  {
+    if ( object != nullptr )
+      object->retain();
+
+    return adopt( object );
+  }
+
+  // Gives up the reference without releasing it, for the caller to adopt
+  [[nodiscard]] T* detach()
+  {
+    T* object = m_object;
+    m_object = nullptr;
+    return object;
+  }
+
+  void reset() { RefPtr().swap( *this ); }
+
+  void swap( RefPtr& other ) { ql::swap( m_object, other.m_object ); }
+
+  T* get() const { return m_object; }
+  T* operator->() const { return m_object; }
+  T& operator*() const { return *m_object; }
+
+  explicit operator bool() const { return m_object != nullptr; }
+
+  template<typename U>
+  bool operator==( const RefPtr<U>& other ) const { return m_object == other.get(); }
+
+  bool operator==( std::nullptr_t ) const { return m_object == nullptr; }
+
+private:
+
+  T* m_object = nullptr;
+};
+
+// Creates an object with new and adopts its initial reference
+template<typename T, typename... Args>
+RefPtr<T> make_ref( Args&&... args )
+{
+  return RefPtr<T>::adopt( new T( ql::forward<Args>( args )... ) );
+}
+
+} // namespace ql
@@ -1,62 +1,116 @@
 #pragma once
 #include "common/algorithm.hpp"
+#include "common/allocator.hpp"
 #include "common/memory.hpp"
 #include <cstddef>
+#include <memory>
 #include <string>
 
 namespace ql
 {
 
-class String
+// A null terminated string of chars. Strings short enough to fit the
+// built-in buffer are stored inline, longer ones are allocated through
+// Allocator.
+template<typename Allocator = ql::Allocator<char>>
+class BasicString
 {
+  using allocator_traits = std::allocator_traits<Allocator>;
+
 public:
 
+  using allocator_type = Allocator;
   using iterator       = char*;
   using const_iterator = const char*;
 
-  constexpr String() = default;
+  constexpr BasicString() = default;
+
+  constexpr explicit BasicString( const Allocator& allocator )
+  : m_allocator( allocator )
+  {
+  }
 
-  constexpr String( const char* src )
+  constexpr BasicString( const char* src, const Allocator& allocator = Allocator() )
+  : m_allocator( allocator )
   {
-    assign( src, std::char_traits<char>::length( src ) );
+    if ( src != nullptr )
+      assign( src, std::char_traits<char>::length( src ) );
   }
 
-  constexpr String( const char* src, std::size_t size ) { assign( src, size ); }
+  constexpr BasicString( const char* src, std::size_t size, const Allocator& allocator = Allocator() )
+  : m_allocator( allocator )
+  {
+    assign( src, size );
+  }
 
-  constexpr String( const String& src ) { assign( src ); }
+  constexpr BasicString( const BasicString& src )
+  : m_allocator( allocator_traits::select_on_container_copy_construction( src.m_allocator ) )
+  {
+    assign( src.data(), src.m_size );
+  }
 
-  constexpr String( String&& src ) { assign( src ); }
+  constexpr BasicString( const BasicString& src, const Allocator& allocator )
+  : m_allocator( allocator )
+  {
+    assign( src.data(), src.m_size );
+  }
 
-  constexpr ~String()
+  constexpr BasicString( BasicString&& src )
+  : m_allocator( src.m_allocator )
+  {
+    take( src );
+  }
+
+  constexpr BasicString( BasicString&& src, const Allocator& allocator )
+  : m_allocator( allocator )
+  {
+    take( src );
+  }
+
+  constexpr ~BasicString()
   {
     destruct();
   }
 
-  constexpr String& operator=( const char* rhs )
+  constexpr BasicString& operator=( const char* rhs )
   {
     destruct();
 
-    assign( rhs );
+    if ( rhs != nullptr )
+      assign( rhs, std::char_traits<char>::length( rhs ) );
+
     return *this;
   }
 
-  constexpr String& operator=( const String& rhs )
+  constexpr BasicString& operator=( const BasicString& rhs )
   {
+    if ( this == &rhs )
+      return *this;
+
     destruct();
 
-    assign( rhs );
+    if constexpr ( allocator_traits::propagate_on_container_copy_assignment::value )
+      m_allocator = rhs.m_allocator;
+
+    assign( rhs.data(), rhs.m_size );
     return *this;
   }
 
-  constexpr String& operator=( String&& rhs )
+  constexpr BasicString& operator=( BasicString&& rhs )
   {
+    if ( this == &rhs )
+      return *this;
+
     destruct();
 
-    assign( rhs );
+    if constexpr ( allocator_traits::propagate_on_container_move_assignment::value )
+      m_allocator = rhs.m_allocator;
+
+    take( rhs );
     return *this;
   }
 
-  constexpr bool operator==( const String& rhs ) const
+  constexpr bool operator==( const BasicString& rhs ) const
   {
     if ( rhs.m_size != m_size )
       return false;
@@ -66,24 +120,26 @@ public:
 
   constexpr bool operator==( const char* rhs ) const
   {
-    return std::equal( begin(), end(), rhs );
+    return std::char_traits<char>::length( rhs ) == m_size && std::equal( begin(), end(), rhs );
   }
 
-  constexpr operator const char*() const { return m_data; }
+  constexpr operator const char*() const { return data(); }
 
-  constexpr char*       data() { return m_data; }
-  constexpr const char* data() const { return m_data; }
-  constexpr const char* c_str() const { return m_data; }
+  constexpr allocator_type get_allocator() const { return m_allocator; }
+
+  constexpr char*       data() { return m_data != nullptr ? m_data : m_stackBuffer; }
+  constexpr const char* data() const { return m_data != nullptr ? m_data : m_stackBuffer; }
+  constexpr const char* c_str() const { return data(); }
 
   constexpr std::size_t size() const { return m_size; }
-  constexpr bool        empty() const { return m_size > 0; }
+  constexpr bool        empty() const { return m_size == 0; }
 
-  constexpr iterator       begin() { return m_data; }
-  constexpr iterator       end() { return nullptr; }
-  constexpr const_iterator begin() const { return m_data; }
-  constexpr const_iterator cbegin() const { return m_data; }
-  constexpr const_iterator end() const { return nullptr; }
-  constexpr const_iterator cend() const { return nullptr; }
+  constexpr iterator       begin() { return data(); }
+  constexpr iterator       end() { return data() + m_size; }
+  constexpr const_iterator begin() const { return data(); }
+  constexpr const_iterator cbegin() const { return data(); }
+  constexpr const_iterator end() const { return data() + m_size; }
+  constexpr const_iterator cend() const { return data() + m_size; }
 
   constexpr void clear()
   {
@@ -92,10 +148,7 @@ public:
 
 private:
 
-  constexpr bool using_ssbo() const
-  {
-    return m_size + 1 <= alignof( std::max_align_t );
-  }
+  static constexpr std::size_t buffer_size = alignof( std::max_align_t );
 
   constexpr void assign( const char* src, std::size_t size )
   {
@@ -104,63 +157,76 @@ private:
 
     if ( std::is_constant_evaluated() )
     {
+      // Refer to the literal rather than allocating; it is never freed
       m_data = const_cast<char*>( src );
       m_size = size;
+      return;
     }
-    else
+
+    if ( size + 1 > buffer_size )
     {
-      if ( size + 1 > alignof( std::max_align_t ) )
-        m_data = new char[ size + 1 ];
-      else
-        m_data = m_stackBuffer;
-
-      uninitialized_copy_n( src, size, m_data );
-      m_data[ size ] = '\0';
-      m_size         = size;
+      m_data     = m_allocator.allocate( size + 1 );
+      m_capacity = size + 1;
     }
-  }
 
-  constexpr void assign( const String& src )
-  {
-    assign( src.m_data, src.m_size );
+    char* out = data();
+    uninitialized_copy_n( src, size, out );
+    out[ size ] = '\0';
+    m_size      = size;
   }
 
-  constexpr void assign( String&& src )
+  // Takes src's characters, copying them when they are inline or src's
+  // allocator may not free them for us.
+  constexpr void take( BasicString& src )
   {
-    swap( m_data, src.m_data );
-    swap( m_size, src.m_size );
-  }
-
-  constexpr void destruct()
-  {
-    if ( empty() || std::is_constant_evaluated() )
-      return;
-
-    if ( using_ssbo() )
+    if ( src.m_capacity > 0 && ( allocator_traits::is_always_equal::value || m_allocator == src.m_allocator ) )
     {
-      uninitialized_fill_n( m_data, sizeof( std::max_align_t ), 0 );
+      ql::swap( m_data, src.m_data );
+      ql::swap( m_size, src.m_size );
+      ql::swap( m_capacity, src.m_capacity );
     }
     else
     {
-      delete[] m_data;
+      assign( src.data(), src.m_size );
+      src.destruct();
     }
+  }
+
+  constexpr void destruct()
+  {
+    if ( m_capacity > 0 )
+      m_allocator.deallocate( m_data, m_capacity );
 
-    m_size = 0;
-    m_data = nullptr;
+    m_stackBuffer[ 0 ] = '\0';
+    m_data             = nullptr;
+    m_size             = 0;
+    m_capacity         = 0;
   }
 
-  char m_stackBuffer[alignof( std::max_align_t )] = {};
-  char*       m_data = nullptr;
-  std::size_t m_size = 0;
+  Allocator m_allocator;
+
+  char        m_stackBuffer[ buffer_size ] = {};
+  char*       m_data     = nullptr; // Null while the inline buffer is in use
+  std::size_t m_size     = 0;
+  std::size_t m_capacity = 0; // Non-zero only when m_data was allocated
 };
 
+using String = BasicString<>;
+
+namespace pmr
+{
+
+using String = BasicString<PolymorphicAllocator<char>>;
+
+} // namespace pmr
+
 template<typename Type>
 struct hash;
 
-template<>
-struct hash<String>
+template<typename Allocator>
+struct hash<BasicString<Allocator>>
 {
-  std::size_t operator()( const String& value )
+  std::size_t operator()( const BasicString<Allocator>& value )
   {
     return fnv1a_hash( value.data(), value.size() );
   }
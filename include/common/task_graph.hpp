@@ -0,0 +1,288 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/functional.hpp"
+#include "common/thread_pool.hpp"
+#include "common/vector.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+
+namespace ql
+{
+
+// A set of tasks and the dependencies between them, declared once and run
+// as many times as needed on a ThreadPool, such as the jobs making up a
+// frame.
+//
+// Each run resets a per-task atomic count of unfinished dependencies. A
+// finishing task decrements its successors' counts, continues with one that
+// became ready and spawns the rest, so a chain of tasks runs on one worker
+// without going through the pool. Runs don't allocate, beyond the pool's
+// first use.
+//
+// Every run also times its tasks and works out the critical path, the
+// longest chain of dependent tasks, which bounds how fast the graph can
+// run however many workers there are. A task's slack is how much longer it
+// could have taken without lengthening the run.
+//
+// Tasks may not be added while the graph is running, and names must
+// outlive the graph.
+class TaskGraph
+{
+  using clock = std::chrono::steady_clock;
+
+  struct Node
+  {
+    Node( const char* name, MoveOnlyFunction<void()> function )
+    : name( name ), function( ql::move( function ) )
+    {
+    }
+
+    Node( Node&& other )
+    : name( other.name ),
+      function( ql::move( other.function ) ),
+      successors( ql::move( other.successors ) ),
+      dependencies( other.dependencies ),
+      start( other.start ), finish( other.finish ), before( other.before ), after( other.after )
+    {
+    }
+
+    std::int64_t duration() const { return finish - start; }
+    std::int64_t path() const { return before + after - duration(); }
+
+    const char*              name;
+    MoveOnlyFunction<void()> function;
+    Vector<std::uint32_t>    successors;
+    std::uint32_t            dependencies = 0;
+
+    std::atomic<std::uint32_t> pending = 0;
+
+    // From the start of the last run, in nanoseconds
+    std::int64_t start  = 0;
+    std::int64_t finish = 0;
+
+    // The longest chains of durations ending and starting with this task
+    std::int64_t before = 0;
+    std::int64_t after  = 0;
+  };
+
+public:
+
+  struct Task
+  {
+    std::uint32_t index;
+  };
+
+  // The last run's timing of a task, in nanoseconds
+  struct Timing
+  {
+    const char*  name;
+    std::int64_t start;
+    std::int64_t duration;
+    std::int64_t slack;
+
+    bool critical() const { return slack == 0; }
+  };
+
+  TaskGraph() = default;
+
+  TaskGraph( const TaskGraph& ) = delete;
+  TaskGraph& operator=( const TaskGraph& ) = delete;
+
+  // Adds a task run once its dependencies have finished
+  template<typename F>
+    requires std::invocable<std::decay_t<F>&>
+  Task add( const char* name, F&& function, std::initializer_list<Task> dependencies = {} )
+  {
+    m_nodes.push_back( Node( name, ql::forward<F>( function ) ) );
+    m_sorted = false;
+
+    const Task task { std::uint32_t( m_nodes.size() - 1 ) };
+    for ( Task dependency : dependencies )
+      precede( dependency, task );
+
+    return task;
+  }
+
+  // Makes after wait for before
+  void precede( Task before, Task after )
+  {
+    ql::assert( before.index < m_nodes.size() && after.index < m_nodes.size(), "TaskGraph: unknown task" );
+
+    m_nodes[ before.index ].successors.push_back( after.index );
+    m_nodes[ after.index ].dependencies++;
+    m_sorted = false;
+  }
+
+  // Runs every task, returning once all have finished. The calling thread
+  // runs tasks too while it waits.
+  void run( ThreadPool& pool )
+  {
+    if ( !m_sorted )
+      sort();
+
+    for ( Node& node : m_nodes )
+      node.pending.store( node.dependencies, std::memory_order_relaxed );
+
+    m_remaining.store( m_nodes.size(), std::memory_order_relaxed );
+    m_start = clock::now();
+
+    for ( std::uint32_t index = 0; index < m_nodes.size(); index++ )
+    {
+      if ( m_nodes[ index ].dependencies == 0 )
+        pool.spawn( [this, &pool, index] { execute( pool, index ); } );
+    }
+
+    pool.help_until( [this] { return m_remaining.load( std::memory_order_acquire ) == 0; } );
+    m_elapsed = elapsed();
+
+    find_critical_path();
+  }
+
+  std::size_t size() const { return m_nodes.size(); }
+
+  // The last run's wall time and critical path length, in nanoseconds
+  std::int64_t elapsed_time() const { return m_elapsed; }
+  std::int64_t critical_path_time() const { return m_criticalPath; }
+
+  Timing timing( Task task ) const
+  {
+    const Node& node = m_nodes[ task.index ];
+    return Timing { node.name, node.start, node.duration(), m_criticalPath - node.path() };
+  }
+
+  // Prints the last run's timings, in the order tasks started, marking the
+  // critical path with an asterisk
+  void print_timings( std::FILE* file = stdout ) const
+  {
+    Vector<std::uint32_t> order = m_order;
+    std::sort( order.data(), order.data() + order.size(), [this]( std::uint32_t a, std::uint32_t b )
+    {
+      return m_nodes[ a ].start < m_nodes[ b ].start;
+    } );
+
+    std::fprintf( file, "  %-32s %12s %12s %12s\n", "task", "start us", "duration us", "slack us" );
+
+    for ( std::uint32_t index : order )
+    {
+      const Timing t = timing( Task { index } );
+      std::fprintf( file, "%c %-32s %12.1f %12.1f %12.1f\n", t.critical() ? '*' : ' ', t.name,
+                    double( t.start ) / 1000, double( t.duration ) / 1000, double( t.slack ) / 1000 );
+    }
+
+    std::fprintf( file, "  elapsed %.1f us, critical path %.1f us\n", double( m_elapsed ) / 1000,
+                  double( m_criticalPath ) / 1000 );
+  }
+
+private:
+
+  std::int64_t elapsed() const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( clock::now() - m_start ).count();
+  }
+
+  // Runs a task, then any successor it readies, and so on down the chain
+  void execute( ThreadPool& pool, std::uint32_t index )
+  {
+    while ( index != no_task )
+    {
+      Node& node = m_nodes[ index ];
+
+      node.start = elapsed();
+      node.function();
+      node.finish = elapsed();
+
+      std::uint32_t next = no_task;
+      for ( std::uint32_t successor : node.successors )
+      {
+        if ( m_nodes[ successor ].pending.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+          continue;
+
+        if ( next == no_task )
+          next = successor;
+        else
+          pool.spawn( [this, &pool, successor] { execute( pool, successor ); } );
+      }
+
+      m_remaining.fetch_sub( 1, std::memory_order_release );
+      index = next;
+    }
+  }
+
+  // Orders tasks so each follows its dependencies, rejecting cycles
+  void sort()
+  {
+    Vector<std::uint32_t> pending;
+    pending.reserve( m_nodes.size() );
+    for ( const Node& node : m_nodes )
+      pending.push_back( node.dependencies );
+
+    m_order.clear();
+    for ( std::uint32_t index = 0; index < m_nodes.size(); index++ )
+    {
+      if ( pending[ index ] == 0 )
+        m_order.push_back( index );
+    }
+
+    for ( std::size_t i = 0; i < m_order.size(); i++ )
+    {
+      for ( std::uint32_t successor : m_nodes[ m_order[ i ] ].successors )
+      {
+        if ( --pending[ successor ] == 0 )
+          m_order.push_back( successor );
+      }
+    }
+
+    ql::assert( m_order.size() == m_nodes.size(), "TaskGraph: dependencies form a cycle" );
+    m_sorted = true;
+  }
+
+  // Finds the longest chains ending at each task in dependency order, and
+  // those starting from it in reverse
+  void find_critical_path()
+  {
+    for ( Node& node : m_nodes )
+      node.before = 0;
+
+    for ( std::uint32_t index : m_order )
+    {
+      Node& node = m_nodes[ index ];
+      node.before += node.duration();
+
+      for ( std::uint32_t successor : node.successors )
+        m_nodes[ successor ].before = ql::max( m_nodes[ successor ].before, node.before );
+    }
+
+    m_criticalPath = 0;
+    for ( std::size_t i = m_order.size(); i-- != 0; )
+    {
+      Node& node = m_nodes[ m_order[ i ] ];
+
+      node.after = 0;
+      for ( std::uint32_t successor : node.successors )
+        node.after = ql::max( node.after, m_nodes[ successor ].after );
+
+      node.after    += node.duration();
+      m_criticalPath = ql::max( m_criticalPath, node.path() );
+    }
+  }
+
+  static constexpr std::uint32_t no_task = ~std::uint32_t( 0 );
+
+  Vector<Node>          m_nodes;
+  Vector<std::uint32_t> m_order;
+  bool                  m_sorted = true;
+
+  std::atomic<std::size_t> m_remaining = 0;
+  clock::time_point        m_start;
+  std::int64_t             m_elapsed      = 0;
+  std::int64_t             m_criticalPath = 0;
+};
+
+} // namespace ql
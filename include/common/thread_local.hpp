@@ -0,0 +1,319 @@
+#pragma once
+#include "common/utility.hpp"
+#include "common/functional.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ql
+{
+
+namespace detail
+{
+
+class ThreadLocalBase;
+
+// Ties one thread's value to the ThreadLocal that owns it. Owned by the
+// thread; the owner only borrows it while both are alive.
+struct ThreadLocalSlot
+{
+  ThreadLocalBase*   owner = nullptr;
+  std::uint64_t      id    = 0;
+  std::atomic<void*> value = nullptr;
+
+  ThreadLocalSlot* nextInOwner     = nullptr;
+  ThreadLocalSlot* previousInOwner = nullptr;
+};
+
+// Serialises thread exit against the creation and destruction of
+// ThreadLocals. Only taken on slow paths.
+inline std::mutex& thread_local_mutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+
+class ThreadLocalBase
+{
+  friend class ThreadLocalTable;
+
+protected:
+
+  ThreadLocalBase()
+  : m_id( next_id() ), m_index( acquire_index() )
+  {
+  }
+
+  ThreadLocalBase( const ThreadLocalBase& ) = delete;
+  ThreadLocalBase& operator=( const ThreadLocalBase& ) = delete;
+
+  ~ThreadLocalBase()
+  {
+    release_index( m_index );
+  }
+
+  // Finds the calling thread's value without locking
+  inline void* find() const;
+
+  // Creates and registers the calling thread's value
+  inline void* create();
+
+  // Destroys every thread's value. Derived destructors must call this.
+  inline void clear();
+
+  inline void for_each_value( FunctionRef<void( void* )> f );
+
+  virtual void* create_value() = 0;
+  virtual void  destroy_value( void* value ) = 0;
+
+  // Called when a thread exits while its value is still alive
+  virtual void thread_exit( void* value ) { destroy_value( value ); }
+
+private:
+
+  static std::uint64_t next_id()
+  {
+    static std::atomic<std::uint64_t> id = 1;
+    return id.fetch_add( 1, std::memory_order_relaxed );
+  }
+
+  // Indices of destroyed ThreadLocals, reused so that thread tables stay as
+  // small as the most ThreadLocals alive at once. Guarded by
+  // thread_local_mutex().
+  static std::vector<std::uint32_t>& free_indices()
+  {
+    static std::vector<std::uint32_t> indices;
+    return indices;
+  }
+
+  static std::uint32_t acquire_index()
+  {
+    static std::uint32_t next = 0;
+
+    std::lock_guard lock( thread_local_mutex() );
+
+    std::vector<std::uint32_t>& indices = free_indices();
+    if ( indices.empty() )
+      return next++;
+
+    const std::uint32_t index = indices.back();
+    indices.pop_back();
+    return index;
+  }
+
+  static void release_index( std::uint32_t index )
+  {
+    std::lock_guard lock( thread_local_mutex() );
+    free_indices().push_back( index );
+  }
+
+  void unlink( ThreadLocalSlot* slot )
+  {
+    if ( slot->previousInOwner != nullptr )
+      slot->previousInOwner->nextInOwner = slot->nextInOwner;
+    else
+      m_slots = slot->nextInOwner;
+
+    if ( slot->nextInOwner != nullptr )
+      slot->nextInOwner->previousInOwner = slot->previousInOwner;
+
+    slot->owner = nullptr;
+    slot->value.store( nullptr, std::memory_order_relaxed );
+  }
+
+  // Ids are never reused, so a slot left behind by a destroyed ThreadLocal
+  // is told apart from one of a newer ThreadLocal given the same index
+  const std::uint64_t m_id;
+  const std::uint32_t m_index;
+  ThreadLocalSlot*    m_slots = nullptr;
+};
+
+// The slots of a single thread, indexed by their ThreadLocal's index so
+// that finding a value is an array lookup
+class ThreadLocalTable
+{
+public:
+
+  ~ThreadLocalTable()
+  {
+    std::lock_guard lock( thread_local_mutex() );
+
+    for ( ThreadLocalSlot* slot : m_slots )
+    {
+      if ( slot == nullptr )
+        continue;
+
+      if ( ThreadLocalBase* owner = slot->owner )
+      {
+        void* value = slot->value.load( std::memory_order_relaxed );
+        owner->unlink( slot );
+        owner->thread_exit( value );
+      }
+
+      delete slot;
+    }
+  }
+
+  void* find( std::uint32_t index, std::uint64_t id ) const
+  {
+    if ( index < m_slots.size() )
+    {
+      const ThreadLocalSlot* slot = m_slots[ index ];
+      if ( slot != nullptr && slot->id == id )
+        return slot->value.load( std::memory_order_relaxed );
+    }
+
+    return nullptr;
+  }
+
+  // Must be called with thread_local_mutex() held
+  void insert( std::uint32_t index, ThreadLocalSlot* slot )
+  {
+    if ( index >= m_slots.size() )
+      m_slots.resize( index + 1, nullptr );
+
+    // Forget the slot of an earlier ThreadLocal with this index, or of this
+    // one before it was cleared
+    ThreadLocalSlot* dead = m_slots[ index ];
+    ql::assert( dead == nullptr || dead->owner == nullptr, "ThreadLocal: slot is still owned" );
+
+    delete dead;
+    m_slots[ index ] = slot;
+  }
+
+  static ThreadLocalTable& current()
+  {
+    static thread_local ThreadLocalTable table;
+    return table;
+  }
+
+private:
+
+  // Allocated with operator new rather than a memory resource, which may
+  // itself use ThreadLocals
+  std::vector<ThreadLocalSlot*> m_slots;
+};
+
+inline void* ThreadLocalBase::find() const
+{
+  return ThreadLocalTable::current().find( m_index, m_id );
+}
+
+inline void* ThreadLocalBase::create()
+{
+  ThreadLocalTable& table = ThreadLocalTable::current();
+
+  std::lock_guard lock( thread_local_mutex() );
+
+  ThreadLocalSlot* slot = new ThreadLocalSlot;
+  slot->owner = this;
+  slot->id    = m_id;
+  slot->value.store( create_value(), std::memory_order_relaxed );
+
+  slot->nextInOwner = m_slots;
+  if ( m_slots != nullptr )
+    m_slots->previousInOwner = slot;
+
+  m_slots = slot;
+
+  table.insert( m_index, slot );
+  return slot->value.load( std::memory_order_relaxed );
+}
+
+inline void ThreadLocalBase::for_each_value( FunctionRef<void( void* )> f )
+{
+  std::lock_guard lock( thread_local_mutex() );
+
+  for ( ThreadLocalSlot* slot = m_slots; slot != nullptr; slot = slot->nextInOwner )
+    f( slot->value.load( std::memory_order_relaxed ) );
+}
+
+inline void ThreadLocalBase::clear()
+{
+  std::lock_guard lock( thread_local_mutex() );
+
+  while ( m_slots != nullptr )
+  {
+    ThreadLocalSlot* slot  = m_slots;
+    void*            value = slot->value.load( std::memory_order_relaxed );
+
+    unlink( slot );
+    destroy_value( value );
+  }
+}
+
+} // namespace detail
+
+// A variable with one instance per thread, per ThreadLocal object. Unlike
+// the thread_local keyword this works for non-static members, so every
+// object can keep its own per-thread state.
+//
+// Instances are default constructed the first time a thread calls get().
+// When a thread exits, its instance's on_thread_exit() is called (if T
+// declares one) before it is destroyed. Instances belonging to threads that
+// are still running are destroyed along with the ThreadLocal, or by clear().
+template<typename T>
+class ThreadLocal : private detail::ThreadLocalBase
+{
+public:
+
+  ThreadLocal() = default;
+
+  ~ThreadLocal()
+  {
+    clear();
+  }
+
+  // The calling thread's instance
+  T& get()
+  {
+    void* value = find();
+    if ( value == nullptr ) [[unlikely]]
+      value = create();
+
+    return *static_cast<T*>( value );
+  }
+
+  T* operator->() { return &get(); }
+  T& operator*() { return get(); }
+
+  // Visits every thread's instance. Other threads may be using theirs
+  // concurrently; thread exit and creation are held off until f returns.
+  void for_each( FunctionRef<void( T& )> f )
+  {
+    for_each_value( [&]( void* value ) { f( *static_cast<T*>( value ) ); } );
+  }
+
+  // Destroys every thread's instance. No other thread may be using its
+  // instance while this runs.
+  void clear()
+  {
+    ThreadLocalBase::clear();
+  }
+
+private:
+
+  void* create_value() override
+  {
+    return new T();
+  }
+
+  void destroy_value( void* value ) override
+  {
+    delete static_cast<T*>( value );
+  }
+
+  void thread_exit( void* value ) override
+  {
+    T* object = static_cast<T*>( value );
+
+    if constexpr ( requires { object->on_thread_exit(); } )
+      object->on_thread_exit();
+
+    delete object;
+  }
+};
+
+} // namespace ql
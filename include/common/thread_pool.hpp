@@ -0,0 +1,436 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/functional.hpp"
+#include "common/memory.hpp"
+#include "common/object_pool.hpp"
+#include "common/thread.hpp"
+#include "common/vector.hpp"
+#include <atomic>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace ql
+{
+
+// A Chase-Lev work-stealing deque of pointers. The owning thread pushes and
+// pops at the bottom, like a stack, while any other thread may steal from
+// the top. Only a steal racing the owner for the last item pays for a
+// compare-exchange.
+//
+// The deque grows when full. Arrays it outgrows are kept until it is
+// destroyed, as thieves may still be reading them.
+template<typename T>
+class WorkStealingDeque
+{
+  struct Array
+  {
+    explicit Array( std::int64_t capacity )
+    : mask( capacity - 1 ), items( new std::atomic<T*>[ capacity ] )
+    {
+    }
+
+    ~Array() { delete[] items; }
+
+    std::int64_t capacity() const { return mask + 1; }
+
+    T*   load( std::int64_t i ) const { return items[ i & mask ].load( std::memory_order_relaxed ); }
+    void store( std::int64_t i, T* item ) { items[ i & mask ].store( item, std::memory_order_relaxed ); }
+
+    const std::int64_t mask;
+    std::atomic<T*>*   items;
+  };
+
+public:
+
+  explicit WorkStealingDeque( std::int64_t capacity = 256 )
+  : m_array( new Array( capacity ) )
+  {
+    ql::assert( capacity > 0 && ( capacity & ( capacity - 1 ) ) == 0, "WorkStealingDeque: capacity must be a power of two" );
+  }
+
+  WorkStealingDeque( const WorkStealingDeque& ) = delete;
+  WorkStealingDeque& operator=( const WorkStealingDeque& ) = delete;
+
+  ~WorkStealingDeque()
+  {
+    delete m_array.load( std::memory_order_relaxed );
+
+    for ( Array* array : m_retired )
+      delete array;
+  }
+
+  // Owner only
+  void push( T* item )
+  {
+    const std::int64_t bottom = m_bottom.load( std::memory_order_relaxed );
+    const std::int64_t top    = m_top.load( std::memory_order_acquire );
+    Array*             array  = m_array.load( std::memory_order_relaxed );
+
+    if ( bottom - top >= array->capacity() ) [[unlikely]]
+      array = grow( array, top, bottom );
+
+    array->store( bottom, item );
+    m_bottom.store( bottom + 1, std::memory_order_release );
+  }
+
+  // Owner only. Takes the newest item, or returns nullptr if empty.
+  T* pop()
+  {
+    const std::int64_t bottom = m_bottom.load( std::memory_order_relaxed ) - 1;
+    Array*             array  = m_array.load( std::memory_order_relaxed );
+
+    m_bottom.store( bottom, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    std::int64_t top = m_top.load( std::memory_order_relaxed );
+
+    if ( top > bottom )
+    {
+      m_bottom.store( bottom + 1, std::memory_order_relaxed );
+      return nullptr;
+    }
+
+    T* item = array->load( bottom );
+    if ( top == bottom )
+    {
+      // The last item, which a thief may be taking too
+      if ( !m_top.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+        item = nullptr;
+
+      m_bottom.store( bottom + 1, std::memory_order_relaxed );
+    }
+
+    return item;
+  }
+
+  // Takes the oldest item. Returns nullptr if empty, or if another thread
+  // took it first.
+  T* steal()
+  {
+    std::int64_t top = m_top.load( std::memory_order_acquire );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    const std::int64_t bottom = m_bottom.load( std::memory_order_acquire );
+
+    if ( top >= bottom )
+      return nullptr;
+
+    T* item = m_array.load( std::memory_order_acquire )->load( top );
+    if ( !m_top.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) )
+      return nullptr;
+
+    return item;
+  }
+
+  // A snapshot, which may be stale by the time it's read
+  bool empty() const
+  {
+    return m_bottom.load( std::memory_order_relaxed ) <= m_top.load( std::memory_order_relaxed );
+  }
+
+private:
+
+  Array* grow( Array* array, std::int64_t top, std::int64_t bottom )
+  {
+    Array* grown = new Array( array->capacity() * 2 );
+    for ( std::int64_t i = top; i < bottom; i++ )
+      grown->store( i, array->load( i ) );
+
+    m_retired.push_back( array );
+    m_array.store( grown, std::memory_order_release );
+    return grown;
+  }
+
+  alignas( 64 ) std::atomic<std::int64_t> m_top    = 0;
+  alignas( 64 ) std::atomic<std::int64_t> m_bottom = 0;
+  std::atomic<Array*>                     m_array;
+  Vector<Array*>                          m_retired;
+};
+
+// Runs tasks on a fixed set of worker threads, for parallel work too fine
+// grained to give each piece a ql::Thread of its own.
+//
+// Every worker has a WorkStealingDeque. Tasks spawned by a worker go to its
+// own deque and are run newest first, keeping recursive fork/join work in
+// cache, while idle workers steal the oldest tasks of a random victim.
+// Tasks spawned by other threads go through a shared injection queue.
+// Workers that find nothing to do park on an atomic wait (a futex on
+// Linux), and are woken only when tasks are spawned while some are parked.
+//
+// Tasks are MoveOnlyFunctions kept in pooled jobs, so spawning doesn't
+// allocate once the pool has warmed up. Waiting on work from inside a task
+// should use help_until(), which runs other tasks meanwhile rather than
+// blocking a worker.
+//
+// Destroying the pool runs every task already spawned, then joins the
+// workers. Exceptions thrown by tasks terminate the program.
+class ThreadPool
+{
+  struct Job
+  {
+    template<typename F>
+    explicit Job( F&& f ) : function( ql::forward<F>( f ) ) {}
+
+    MoveOnlyFunction<void()> function;
+    Job*                     next = nullptr; // In the injection queue
+  };
+
+  struct Worker
+  {
+    WorkStealingDeque<Job> deque;
+    ThreadPool*            pool;
+    std::size_t            index;
+    std::uint64_t          random;
+    Thread                 thread;
+  };
+
+public:
+
+  explicit ThreadPool( std::size_t threads = ql::max( std::thread::hardware_concurrency(), 1u ) )
+  {
+    ql::assert( threads > 0, "ThreadPool: needs at least one thread" );
+
+    for ( std::size_t i = 0; i < threads; i++ )
+    {
+      m_workers.push_back( make_unique<Worker>() );
+
+      Worker& worker = *m_workers.back();
+      worker.pool    = this;
+      worker.index   = i;
+      worker.random  = 0x9e3779b97f4a7c15 * ( i + 1 );
+    }
+
+    // Only once every worker exists, as they steal from each other
+    for ( UniquePtr<Worker>& worker : m_workers )
+      worker->thread = [this, worker = worker.get()] { run( *worker ); };
+  }
+
+  ThreadPool( const ThreadPool& ) = delete;
+  ThreadPool& operator=( const ThreadPool& ) = delete;
+
+  ~ThreadPool()
+  {
+    m_stopping.store( true, std::memory_order_relaxed );
+    wake( true );
+
+    for ( UniquePtr<Worker>& worker : m_workers )
+      worker->thread.join();
+
+    ql::assert( m_injected == nullptr, "ThreadPool: tasks spawned during destruction" );
+  }
+
+  // Queues task to run on a worker
+  template<typename F>
+    requires std::invocable<std::decay_t<F>&>
+  void spawn( F&& task )
+  {
+    Job* job = m_jobs.acquire( ql::forward<F>( task ) ).release();
+
+    if ( Worker* worker = current_worker(); worker != nullptr && worker->pool == this )
+    {
+      worker->deque.push( job );
+    }
+    else
+    {
+      std::lock_guard lock( m_mutex );
+
+      if ( m_injectedTail != nullptr )
+        m_injectedTail->next = job;
+      else
+        m_injected = job;
+
+      m_injectedTail = job;
+      m_injectedCount.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    // Pairs with the fence in park(), so either the task is seen or the
+    // sleeper is
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( m_sleepers.load( std::memory_order_relaxed ) != 0 )
+      wake( false );
+  }
+
+  // Runs tasks until done() returns true, for threads waiting on tasks
+  // they've spawned. Any thread may help, not only workers.
+  void help_until( FunctionRef<bool()> done )
+  {
+    Worker* worker = current_worker();
+    if ( worker != nullptr && worker->pool != this )
+      worker = nullptr;
+
+    while ( !done() )
+    {
+      if ( Job* job = find_job( worker ) )
+        execute( job );
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  std::size_t size() const { return m_workers.size(); }
+
+  // The index of the calling worker in [0, size()), or size() for threads
+  // that aren't this pool's workers
+  std::size_t worker_index() const
+  {
+    Worker* worker = current_worker();
+    return worker != nullptr && worker->pool == this ? worker->index : m_workers.size();
+  }
+
+private:
+
+  static Worker*& current_worker()
+  {
+    static thread_local Worker* worker = nullptr;
+    return worker;
+  }
+
+  void run( Worker& worker )
+  {
+    current_worker() = &worker;
+
+    for ( ;; )
+    {
+      if ( Job* job = find_job( &worker ) )
+      {
+        execute( job );
+        continue;
+      }
+
+      if ( !park( worker ) )
+        break;
+    }
+
+    current_worker() = nullptr;
+  }
+
+  void execute( Job* job )
+  {
+    ObjectPool<Job>::Handle handle( job, ObjectPool<Job>::Recycler( &m_jobs ) );
+    handle->function();
+  }
+
+  // Looks in the worker's own deque, then the injection queue, then steals
+  Job* find_job( Worker* worker )
+  {
+    if ( worker != nullptr )
+    {
+      if ( Job* job = worker->deque.pop() )
+        return job;
+    }
+
+    if ( Job* job = take_injected() )
+      return job;
+
+    // Start from a random victim, so thieves spread out
+    const std::size_t count = m_workers.size();
+    const std::size_t start = worker != nullptr ? next_random( *worker ) % count : 0;
+
+    for ( std::size_t i = 0; i < count; i++ )
+    {
+      Worker& victim = *m_workers[ ( start + i ) % count ];
+      if ( &victim == worker )
+        continue;
+
+      if ( Job* job = victim.deque.steal() )
+        return job;
+    }
+
+    return nullptr;
+  }
+
+  Job* take_injected()
+  {
+    if ( m_injectedCount.load( std::memory_order_relaxed ) == 0 )
+      return nullptr;
+
+    std::lock_guard lock( m_mutex );
+
+    Job* job = m_injected;
+    if ( job != nullptr )
+    {
+      m_injected = job->next;
+      if ( m_injected == nullptr )
+        m_injectedTail = nullptr;
+
+      m_injectedCount.fetch_sub( 1, std::memory_order_relaxed );
+    }
+
+    return job;
+  }
+
+  // Waits for tasks to be spawned. Returns false once the pool is stopping
+  // and no tasks are left.
+  bool park( Worker& worker )
+  {
+    // Spinning briefly catches tasks spawned in quick succession without
+    // the cost of sleeping
+    for ( int i = 0; i < 64; i++ )
+    {
+      if ( !worker.deque.empty() || m_injectedCount.load( std::memory_order_relaxed ) != 0 )
+        return true;
+
+      std::this_thread::yield();
+    }
+
+    const std::uint32_t signal = m_signal.load( std::memory_order_acquire );
+    m_sleepers.fetch_add( 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    // Tasks spawned before the sleeper was counted, which won't wake it
+    if ( Job* job = find_job( &worker ) )
+    {
+      m_sleepers.fetch_sub( 1, std::memory_order_relaxed );
+      execute( job );
+      return true;
+    }
+
+    if ( m_stopping.load( std::memory_order_relaxed ) )
+    {
+      m_sleepers.fetch_sub( 1, std::memory_order_relaxed );
+      return false;
+    }
+
+    m_signal.wait( signal, std::memory_order_acquire );
+    m_sleepers.fetch_sub( 1, std::memory_order_relaxed );
+    return true;
+  }
+
+  void wake( bool all )
+  {
+    m_signal.fetch_add( 1, std::memory_order_release );
+
+    if ( all )
+      m_signal.notify_all();
+    else
+      m_signal.notify_one();
+  }
+
+  static std::uint64_t next_random( Worker& worker )
+  {
+    // xorshift64
+    std::uint64_t x = worker.random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return worker.random = x;
+  }
+
+  // Destroyed after the workers, which return jobs to it
+  ObjectPool<Job> m_jobs;
+
+  Vector<UniquePtr<Worker>> m_workers;
+
+  std::mutex               m_mutex;
+  Job*                     m_injected     = nullptr;
+  Job*                     m_injectedTail = nullptr;
+  std::atomic<std::size_t> m_injectedCount = 0;
+
+  std::atomic<std::uint32_t> m_signal   = 0;
+  std::atomic<std::uint32_t> m_sleepers = 0;
+  std::atomic<bool>          m_stopping = false;
+};
+
+} // namespace ql
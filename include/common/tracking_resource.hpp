@@ -0,0 +1,527 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <source_location>
+#include <string_view>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Define QL_ALLOCATION_TRACKING as 0 to compile tracking out. TrackingResource
+// then forwards straight to its upstream, and every statistic reads zero.
+#ifndef QL_ALLOCATION_TRACKING
+  #define QL_ALLOCATION_TRACKING 1
+#endif
+
+namespace ql
+{
+
+// Where an allocation was made. Either a source location, or a label given
+// to an AllocationScope (in which case function holds the label).
+struct AllocationSite
+{
+  const char*   file     = "";
+  const char*   function = "unattributed";
+  std::uint32_t line     = 0;
+
+  bool operator==( const AllocationSite& rhs ) const
+  {
+    return line == rhs.line && std::string_view( file ) == rhs.file &&
+           std::string_view( function ) == rhs.function;
+  }
+};
+
+struct AllocationStatistics
+{
+  // histogram[ i ] counts allocations of up to 2^i bytes; the last bucket
+  // also counts everything larger.
+  static constexpr std::size_t histogram_size = 24;
+
+  std::size_t live_bytes    = 0;
+  std::size_t peak_bytes    = 0;
+  std::size_t total_bytes   = 0;
+  std::size_t allocations   = 0;
+  std::size_t deallocations = 0;
+  std::size_t histogram[ histogram_size ] = {};
+
+  std::size_t live_allocations() const { return allocations - deallocations; }
+};
+
+struct SiteStatistics
+{
+  AllocationSite site;
+  std::size_t    allocations      = 0;
+  std::size_t    total_bytes      = 0;
+  std::size_t    live_allocations = 0;
+  std::size_t    live_bytes       = 0;
+};
+
+enum class ReportFormat
+{
+  text,
+  json
+};
+
+namespace detail
+{
+
+// The innermost AllocationScope of the calling thread
+inline const AllocationSite*& current_allocation_site()
+{
+  static thread_local const AllocationSite* site = nullptr;
+  return site;
+}
+
+} // namespace detail
+
+// Attributes allocations made through any TrackingResource on this thread,
+// while the scope lives, to a label or to the scope's own source location.
+// Scopes nest; the innermost one wins. Resources copy a label the first
+// time they see it, so it only needs to outlive the scope.
+class AllocationScope
+{
+public:
+
+  AllocationScope( const std::source_location& location = std::source_location::current() )
+#if QL_ALLOCATION_TRACKING
+  : m_site { location.file_name(), location.function_name(), location.line() }
+#endif
+  {
+    enter();
+  }
+
+  AllocationScope( const char* label, const std::source_location& location = std::source_location::current() )
+#if QL_ALLOCATION_TRACKING
+  : m_site { location.file_name(), label, location.line() }
+#endif
+  {
+    enter();
+  }
+
+  AllocationScope( const AllocationScope& ) = delete;
+  AllocationScope& operator=( const AllocationScope& ) = delete;
+
+  ~AllocationScope()
+  {
+#if QL_ALLOCATION_TRACKING
+    detail::current_allocation_site() = m_previous;
+#endif
+  }
+
+private:
+
+  void enter()
+  {
+#if QL_ALLOCATION_TRACKING
+    m_previous = detail::current_allocation_site();
+    detail::current_allocation_site() = &m_site;
+#endif
+  }
+
+#if QL_ALLOCATION_TRACKING
+  AllocationSite        m_site;
+  const AllocationSite* m_previous = nullptr;
+#endif
+};
+
+// Wraps another MemoryResource, recording how much is allocated through it,
+// in what sizes and from where. Live allocations are remembered along with
+// their site, so anything still allocated when the resource is destroyed is
+// reported as a leak.
+//
+// Every allocation takes a lock, so this is meant for finding out who
+// allocates on a hot path, not for staying on it.
+class TrackingResource : public MemoryResource
+{
+  struct SiteHash
+  {
+    std::size_t operator()( const AllocationSite& site ) const
+    {
+      return std::hash<std::string_view>()( site.file ) ^ std::hash<std::string_view>()( site.function ) ^
+             site.line;
+    }
+  };
+
+  struct LiveAllocation
+  {
+    std::size_t bytes;
+    std::size_t site;
+  };
+
+public:
+
+  TrackingResource()
+  : TrackingResource( get_default_resource() )
+  {
+  }
+
+  explicit TrackingResource( MemoryResource* upstream, const char* name = "TrackingResource" )
+  : m_upstream( upstream ),
+    m_name( name )
+  {
+  }
+
+  TrackingResource( const TrackingResource& ) = delete;
+  TrackingResource& operator=( const TrackingResource& ) = delete;
+
+  ~TrackingResource() override
+  {
+    if ( m_reportPath == nullptr )
+      return;
+
+    std::FILE* out = std::strcmp( m_reportPath, "-" ) == 0 ? stderr : std::fopen( m_reportPath, "w" );
+    if ( out == nullptr )
+      return;
+
+    report( out, m_reportFormat );
+
+    if ( out != stderr )
+      std::fclose( out );
+  }
+
+  // Allocates as allocate() would, attributing the allocation to site
+  // unless an AllocationScope is active.
+  [[nodiscard]] void* allocate_at( std::size_t bytes, std::size_t alignment, const AllocationSite& site )
+  {
+    void* memory = m_upstream->allocate( bytes, alignment );
+
+#if QL_ALLOCATION_TRACKING
+    const AllocationSite* scope = detail::current_allocation_site();
+    record_allocation( memory, bytes, scope != nullptr ? *scope : site );
+#endif
+
+    return memory;
+  }
+
+  // Writes a report when the resource is destroyed, which for one with
+  // static storage duration means at exit. A path of "-" writes to stderr.
+  void set_exit_report( const char* path, ReportFormat format = ReportFormat::text )
+  {
+    m_reportPath   = path;
+    m_reportFormat = format;
+  }
+
+  AllocationStatistics statistics() const
+  {
+    std::lock_guard lock( m_mutex );
+    return m_statistics;
+  }
+
+  // Statistics for every site seen so far, most bytes allocated first
+  std::vector<SiteStatistics> sites() const
+  {
+    std::lock_guard lock( m_mutex );
+
+    // Sorted by index; std::sort can't swap ql types unambiguously
+    std::vector<std::size_t> order( m_sites.size() );
+    for ( std::size_t i = 0; i < order.size(); i++ )
+      order[ i ] = i;
+
+    std::sort( order.begin(), order.end(), [&]( std::size_t lhs, std::size_t rhs )
+    {
+      return m_sites[ lhs ].total_bytes > m_sites[ rhs ].total_bytes;
+    } );
+
+    std::vector<SiteStatistics> sites;
+    sites.reserve( order.size() );
+    for ( std::size_t i : order )
+      sites.push_back( m_sites[ i ] );
+
+    return sites;
+  }
+
+  void report( std::FILE* out, ReportFormat format = ReportFormat::text ) const
+  {
+    const AllocationStatistics      stats = statistics();
+    const std::vector<SiteStatistics> all = sites();
+
+    if ( format == ReportFormat::json )
+    {
+      std::fprintf( out, "{\"name\":" );
+      write_json_string( out, m_name );
+      std::fprintf( out, ",\"live_bytes\":%zu,\"peak_bytes\":%zu,\"total_bytes\":%zu,"
+                         "\"allocations\":%zu,\"deallocations\":%zu,\"histogram\":[",
+                    stats.live_bytes, stats.peak_bytes, stats.total_bytes, stats.allocations,
+                    stats.deallocations );
+
+      for ( std::size_t i = 0; i < AllocationStatistics::histogram_size; i++ )
+        std::fprintf( out, "%s%zu", i != 0 ? "," : "", stats.histogram[ i ] );
+
+      std::fprintf( out, "],\"sites\":[" );
+
+      for ( std::size_t i = 0; i < all.size(); i++ )
+      {
+        const SiteStatistics& site = all[ i ];
+        std::fprintf( out, "%s{\"file\":", i != 0 ? "," : "" );
+        write_json_string( out, site.site.file );
+        std::fprintf( out, ",\"line\":%u,\"function\":", unsigned( site.site.line ) );
+        write_json_string( out, site.site.function );
+        std::fprintf( out, ",\"allocations\":%zu,\"total_bytes\":%zu,\"live_allocations\":%zu,\"live_bytes\":%zu}",
+                      site.allocations, site.total_bytes, site.live_allocations, site.live_bytes );
+      }
+
+      std::fprintf( out, "]}\n" );
+      return;
+    }
+
+    std::fprintf( out, "%s: %zu bytes live (peak %zu), %zu bytes in %zu allocations, %zu deallocations\n",
+                  m_name, stats.live_bytes, stats.peak_bytes, stats.total_bytes, stats.allocations,
+                  stats.deallocations );
+
+    std::fprintf( out, "  sizes:\n" );
+    for ( std::size_t i = 0; i < AllocationStatistics::histogram_size; i++ )
+    {
+      if ( stats.histogram[ i ] != 0 )
+        std::fprintf( out, "    <= %zu: %zu\n", std::size_t( 1 ) << i, stats.histogram[ i ] );
+    }
+
+    std::fprintf( out, "  sites:\n" );
+    for ( const SiteStatistics& site : all )
+    {
+      std::fprintf( out, "    %s:%u %s: %zu bytes in %zu allocations\n", site.site.file,
+                    unsigned( site.site.line ), site.site.function, site.total_bytes, site.allocations );
+    }
+
+    if ( stats.live_allocations() != 0 )
+    {
+      std::fprintf( out, "  leaks:\n" );
+      for ( const SiteStatistics& site : all )
+      {
+        if ( site.live_allocations != 0 )
+        {
+          std::fprintf( out, "    %s:%u %s: %zu bytes in %zu allocations\n", site.site.file,
+                        unsigned( site.site.line ), site.site.function, site.live_bytes,
+                        site.live_allocations );
+        }
+      }
+    }
+  }
+
+  MemoryResource* upstream_resource() const { return m_upstream; }
+  const char*     name() const { return m_name; }
+
+private:
+
+  // Writes string quoted, escaping what JSON requires, such as the
+  // backslashes of Windows paths and quotes in function signatures
+  static void write_json_string( std::FILE* out, const char* string )
+  {
+    std::fputc( '"', out );
+
+    for ( const char* c = string; *c != '\0'; c++ )
+    {
+      switch ( *c )
+      {
+      case '"':  std::fputs( "\\\"", out ); break;
+      case '\\': std::fputs( "\\\\", out ); break;
+      case '\n': std::fputs( "\\n", out ); break;
+      case '\r': std::fputs( "\\r", out ); break;
+      case '\t': std::fputs( "\\t", out ); break;
+      default:
+        if ( static_cast<unsigned char>( *c ) < 0x20 )
+          std::fprintf( out, "\\u%04x", unsigned( *c ) );
+        else
+          std::fputc( *c, out );
+      }
+    }
+
+    std::fputc( '"', out );
+  }
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    return allocate_at( bytes, alignment, AllocationSite {} );
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+#if QL_ALLOCATION_TRACKING
+    record_deallocation( memory );
+#endif
+
+    m_upstream->deallocate( memory, bytes, alignment );
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  void record_allocation( void* memory, std::size_t bytes, const AllocationSite& site )
+  {
+    const std::size_t bucket =
+      ql::min( std::size_t( std::bit_width( bytes > 1 ? bytes - 1 : 0 ) ), AllocationStatistics::histogram_size - 1 );
+
+    std::lock_guard lock( m_mutex );
+
+    m_statistics.allocations++;
+    m_statistics.total_bytes += bytes;
+    m_statistics.live_bytes += bytes;
+    m_statistics.peak_bytes = ql::max( m_statistics.peak_bytes, m_statistics.live_bytes );
+    m_statistics.histogram[ bucket ]++;
+
+    auto it = m_siteIndices.find( site );
+    if ( it == m_siteIndices.end() )
+    {
+      // Labels may be temporary, but are reported after their scope ends
+      AllocationSite kept = site;
+      kept.function = m_labels.emplace( site.function ).first->c_str();
+
+      it = m_siteIndices.emplace( kept, m_sites.size() ).first;
+      m_sites.push_back( SiteStatistics { .site = kept } );
+    }
+
+    SiteStatistics& stats = m_sites[ it->second ];
+    stats.allocations++;
+    stats.total_bytes += bytes;
+    stats.live_allocations++;
+    stats.live_bytes += bytes;
+
+    m_live[ memory ] = LiveAllocation { bytes, it->second };
+  }
+
+  void record_deallocation( void* memory )
+  {
+    std::lock_guard lock( m_mutex );
+
+    auto it = m_live.find( memory );
+    ql::assert( it != m_live.end(), "TrackingResource: deallocating memory it did not allocate" );
+
+    const LiveAllocation allocation = it->second;
+    m_live.erase( it );
+
+    m_statistics.deallocations++;
+    m_statistics.live_bytes -= allocation.bytes;
+
+    SiteStatistics& stats = m_sites[ allocation.site ];
+    stats.live_allocations--;
+    stats.live_bytes -= allocation.bytes;
+  }
+
+  MemoryResource* m_upstream = nullptr;
+  const char*     m_name     = nullptr;
+
+  const char*  m_reportPath   = nullptr;
+  ReportFormat m_reportFormat = ReportFormat::text;
+
+  mutable std::mutex   m_mutex;
+  AllocationStatistics m_statistics;
+
+  std::vector<SiteStatistics>                                  m_sites;
+  std::unordered_map<AllocationSite, std::size_t, SiteHash>    m_siteIndices;
+  std::unordered_map<void*, LiveAllocation>                    m_live;
+  std::unordered_set<std::string>                              m_labels;
+};
+
+// The TrackingResource used by TrackingAllocator when none is given,
+// drawing from new_delete_resource().
+inline TrackingResource& default_tracking_resource()
+{
+  static TrackingResource resource( new_delete_resource(), "default_tracking_resource" );
+  return resource;
+}
+
+// An allocator that records its allocations in a TrackingResource. Direct
+// calls to allocate() are attributed to the caller. Allocations made by a
+// container are attributed to the library code making them, so wrap the
+// container's use in an AllocationScope to name them.
+template<typename T>
+class TrackingAllocator
+{
+public:
+
+  using value_type = T;
+
+  TrackingAllocator() = default;
+
+  TrackingAllocator( TrackingResource* resource )
+  : m_resource( resource )
+  {
+  }
+
+  template<typename U>
+  TrackingAllocator( const TrackingAllocator<U>& other )
+  : m_resource( other.resource() )
+  {
+  }
+
+  [[nodiscard]] T* allocate( std::size_t size, const std::source_location& location = std::source_location::current() )
+  {
+    const AllocationSite site { location.file_name(), location.function_name(), location.line() };
+    return static_cast<T*>( m_resource->allocate_at( size * sizeof( T ), alignof( T ), site ) );
+  }
+
+  void deallocate( T* memory, std::size_t size )
+  {
+    m_resource->deallocate( memory, size * sizeof( T ), alignof( T ) );
+  }
+
+  TrackingResource* resource() const { return m_resource; }
+
+  template<typename U>
+  bool operator==( const TrackingAllocator<U>& other ) const
+  {
+    return m_resource == other.resource();
+  }
+
+private:
+
+  TrackingResource* m_resource = &default_tracking_resource();
+};
+
+// Measures the allocations made through a TrackingResource during its
+// lifetime, so tests can assert a budget:
+//
+//   ql::AllocationBudget budget( resource, 0 );
+//   hot_loop();
+//   EXPECT_TRUE( budget.within() );
+//
+// With tracking compiled out nothing is counted and every budget is met.
+class AllocationBudget
+{
+public:
+
+  AllocationBudget( const TrackingResource& resource, std::size_t maxAllocations,
+                    std::size_t maxBytes = SIZE_MAX )
+  : m_resource( resource ),
+    m_start( resource.statistics() ),
+    m_maxAllocations( maxAllocations ),
+    m_maxBytes( maxBytes )
+  {
+  }
+
+  std::size_t allocations() const
+  {
+    return m_resource.statistics().allocations - m_start.allocations;
+  }
+
+  std::size_t bytes() const
+  {
+    return m_resource.statistics().total_bytes - m_start.total_bytes;
+  }
+
+  bool within() const
+  {
+    const AllocationStatistics stats = m_resource.statistics();
+    return stats.allocations - m_start.allocations <= m_maxAllocations &&
+           stats.total_bytes - m_start.total_bytes <= m_maxBytes;
+  }
+
+private:
+
+  const TrackingResource&    m_resource;
+  const AllocationStatistics m_start;
+  const std::size_t          m_maxAllocations;
+  const std::size_t          m_maxBytes;
+};
+
+} // namespace ql
@@ -0,0 +1,240 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include "common/vector.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+namespace ql
+{
+
+// A memory resource backed by 2 MiB aligned anonymous mappings, so that the
+// kernel can back them with huge pages and large working sets need far
+// fewer TLB entries.
+//
+// Explicit huge pages (MAP_HUGETLB) are tried first when requested; these
+// come from the pool reserved in /proc/sys/vm/nr_hugepages and fail when it
+// is empty, in which case the resource falls back to ordinary mappings
+// advised with MADV_HUGEPAGE for transparent huge pages.
+//
+// Requests of at least huge_page_size get a mapping of their own, returned
+// to the system when deallocated. Smaller requests are bump allocated from
+// shared regions which are only returned by release() or destruction, so
+// put a pool resource in front if small blocks are freed often. Alignments
+// beyond huge_page_size are honoured with a mapping of their own.
+//
+// The resource isn't thread-safe: the bump pointer and the list of mappings
+// are unguarded, so share it between threads only behind a synchronised
+// resource.
+class HugePageResource : public MemoryResource
+{
+  struct Mapping
+  {
+    byte_t*     address;
+    std::size_t size;
+  };
+
+public:
+
+  static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+
+  explicit HugePageResource( bool tryExplicit = true )
+  : m_tryExplicit( tryExplicit )
+  {
+  }
+
+  HugePageResource( const HugePageResource& ) = delete;
+  HugePageResource& operator=( const HugePageResource& ) = delete;
+
+  ~HugePageResource() override
+  {
+    release();
+  }
+
+  // Unmaps every region, including memory that was never deallocated
+  void release()
+  {
+    for ( const Mapping& mapping : m_mappings )
+      munmap( mapping.address, mapping.size );
+
+    m_mappings.clear();
+    m_current = nullptr;
+    m_end     = nullptr;
+  }
+
+  // The bytes currently mapped by the resource
+  std::size_t mapped_bytes() const
+  {
+    std::size_t bytes = 0;
+    for ( const Mapping& mapping : m_mappings )
+      bytes += mapping.size;
+
+    return bytes;
+  }
+
+  // Whether any mapping was backed by explicit (MAP_HUGETLB) huge pages
+  bool explicit_huge_pages() const { return m_explicitGranted; }
+
+  // The bytes of the resource's mappings that the kernel has actually backed
+  // with huge pages, read from /proc/self/smaps. Transparent huge pages are
+  // only assigned once memory is touched, so this grows as it is used.
+  std::size_t huge_page_bytes() const
+  {
+    std::FILE* smaps = std::fopen( "/proc/self/smaps", "r" );
+    if ( smaps == nullptr )
+      return 0;
+
+    std::size_t bytes   = 0;
+    bool        ours    = false;
+    char        line[ 512 ];
+
+    while ( std::fgets( line, sizeof( line ), smaps ) != nullptr )
+    {
+      std::uintptr_t start = 0;
+      std::uintptr_t end   = 0;
+
+      // Each mapping starts with its address range, followed by its fields
+      if ( std::sscanf( line, "%zx-%zx ", &start, &end ) == 2 && std::strchr( line, ':' ) > std::strchr( line, ' ' ) )
+      {
+        ours = owns( start, end );
+        continue;
+      }
+
+      if ( !ours )
+        continue;
+
+      std::size_t kilobytes = 0;
+      if ( std::sscanf( line, "AnonHugePages: %zu kB", &kilobytes ) == 1 ||
+           std::sscanf( line, "Private_Hugetlb: %zu kB", &kilobytes ) == 1 ||
+           std::sscanf( line, "Shared_Hugetlb: %zu kB", &kilobytes ) == 1 )
+      {
+        bytes += kilobytes * 1024;
+      }
+    }
+
+    std::fclose( smaps );
+    return bytes;
+  }
+
+private:
+
+  static std::size_t round_up( std::size_t bytes, std::size_t alignment )
+  {
+    return ( bytes + alignment - 1 ) & ~( alignment - 1 );
+  }
+
+  bool owns( std::uintptr_t start, std::uintptr_t end ) const
+  {
+    for ( const Mapping& mapping : m_mappings )
+    {
+      const std::uintptr_t address = reinterpret_cast<std::uintptr_t>( mapping.address );
+      if ( start < address + mapping.size && address < end )
+        return true;
+    }
+
+    return false;
+  }
+
+  // Maps size bytes (a multiple of huge_page_size) on an alignment boundary,
+  // alignment being a power of two of at least huge_page_size
+  byte_t* map( std::size_t size, std::size_t alignment = huge_page_size )
+  {
+    constexpr int protection = PROT_READ | PROT_WRITE;
+    constexpr int flags      = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages are only aligned to their own size
+    if ( m_tryExplicit && alignment == huge_page_size )
+    {
+      void* memory = mmap( nullptr, size, protection, flags | MAP_HUGETLB, -1, 0 );
+      if ( memory != MAP_FAILED )
+      {
+        m_explicitGranted = true;
+        return static_cast<byte_t*>( memory );
+      }
+
+      // The reserved pool is empty or missing; don't keep asking
+      m_tryExplicit = false;
+    }
+#endif
+
+    // Over-reserve by the alignment, then trim both ends to align the region
+    void* memory = mmap( nullptr, size + alignment, protection, flags, -1, 0 );
+    if ( memory == MAP_FAILED )
+      throw std::bad_alloc();
+
+    byte_t* start   = static_cast<byte_t*>( memory );
+    byte_t* aligned = reinterpret_cast<byte_t*>( round_up( reinterpret_cast<std::uintptr_t>( start ), alignment ) );
+
+    if ( aligned != start )
+      munmap( start, aligned - start );
+
+    munmap( aligned + size, alignment - ( aligned - start ) );
+
+#ifdef MADV_HUGEPAGE
+    madvise( aligned, size, MADV_HUGEPAGE );
+#endif
+
+    return aligned;
+  }
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    if ( bytes >= huge_page_size || alignment > huge_page_size )
+    {
+      const std::size_t size   = round_up( bytes, huge_page_size );
+      byte_t*           memory = map( size, ql::max( alignment, huge_page_size ) );
+
+      m_mappings.push_back( Mapping { memory, size } );
+      return memory;
+    }
+
+    byte_t* memory = reinterpret_cast<byte_t*>( round_up( reinterpret_cast<std::uintptr_t>( m_current ), alignment ) );
+    if ( m_current == nullptr || memory + bytes > m_end )
+    {
+      memory = map( huge_page_size );
+      m_end  = memory + huge_page_size;
+
+      m_mappings.push_back( Mapping { memory, huge_page_size } );
+    }
+
+    m_current = memory + bytes;
+    return memory;
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    if ( bytes < huge_page_size && alignment <= huge_page_size )
+      return;
+
+    for ( Mapping* mapping = m_mappings.begin(); mapping != m_mappings.end(); mapping++ )
+    {
+      if ( mapping->address == memory )
+      {
+        munmap( mapping->address, mapping->size );
+        m_mappings.erase( mapping );
+        return;
+      }
+    }
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  Vector<Mapping> m_mappings;
+
+  byte_t* m_current = nullptr;
+  byte_t* m_end     = nullptr;
+
+  bool m_tryExplicit     = true;
+  bool m_explicitGranted = false;
+};
+
+} // namespace ql
@@ -15,7 +15,7 @@ public:
 
   Thread() = default;
 
-  Thread( std::invocable auto callable ) { assign( callable ); }
+  Thread( std::invocable auto callable ) { assign( ql::move( callable ) ); }
 
   static Thread current()
   {
@@ -30,7 +30,10 @@ public:
   void join()
   {
     if ( m_thread != invalid_thread )
+    {
       pthread_join( m_thread, nullptr );
+      m_thread = invalid_thread;
+    }
   }
 
   void detach()
@@ -47,7 +50,7 @@ public:
   Thread& operator=( std::invocable auto callable )
   {
     join();
-    assign( callable );
+    assign( ql::move( callable ) );
     return *this;
   }
 
@@ -60,7 +63,7 @@ private:
 
   void assign( std::invocable auto callable )
   {
-    m_function = callable;
+    m_function = ql::move( callable );
     pthread_create( &m_thread, nullptr, &execute_thread, this );
   }
 
@@ -71,8 +74,8 @@ private:
     pthread_exit( nullptr );
   }
 
-  Function<void()> m_function;
-  pthread_t        m_thread = invalid_thread;
+  MoveOnlyFunction<void()> m_function;
+  pthread_t                m_thread = invalid_thread;
 };
 
 } // namespace ql
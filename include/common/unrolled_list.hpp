@@ -0,0 +1,375 @@
+#pragma once
+#include "common/utility.hpp"
+#include "common/algorithm.hpp"
+#include "common/common.hpp"
+#include <cstddef>
+#include <initializer_list>
+
+namespace ql
+{
+
+// A doubly linked list whose nodes each hold a small array of elements,
+// sized so that a node fills roughly NodeBytes (one or two cache lines).
+// Iteration touches one node per node_capacity elements rather than one
+// per element, and inserting or erasing near an iterator only shifts the
+// elements within a single node.
+//
+// Inserting or erasing invalidates iterators into the affected node and,
+// if the node is split or merged, its neighbour.
+template<typename T, std::size_t NodeBytes = 128>
+class UnrolledList
+{
+  static constexpr std::size_t header_size = sizeof( void* ) * 2 + sizeof( std::size_t );
+
+public:
+
+  static constexpr std::size_t node_capacity =
+    NodeBytes > header_size + sizeof( T ) ? ( NodeBytes - header_size ) / sizeof( T ) : 1;
+
+private:
+
+  struct Node
+  {
+    Node*       previous = nullptr;
+    Node*       next     = nullptr;
+    std::size_t count    = 0;
+
+    alignas( T ) byte_t storage[ sizeof( T ) * node_capacity ];
+
+    T* items() { return reinterpret_cast<T*>( storage ); }
+  };
+
+  template<typename Value>
+  class NodeIterator
+  {
+    friend class UnrolledList;
+
+  public:
+
+    NodeIterator( Node* node, std::size_t index ) : m_node( node ), m_index( index ) {}
+    NodeIterator() = delete;
+
+    // Allows an iterator to be converted to a const_iterator
+    operator NodeIterator<const Value>() const
+      requires ( !std::is_const_v<Value> )
+    {
+      return { m_node, m_index };
+    }
+
+    bool operator==( const NodeIterator& rhs ) const
+    {
+      return m_node == rhs.m_node && m_index == rhs.m_index;
+    }
+
+    bool operator!=( const NodeIterator& rhs ) const { return !( *this == rhs ); }
+
+    Value& operator*() const { return m_node->items()[ m_index ]; }
+    Value* operator->() const { return &m_node->items()[ m_index ]; }
+
+    // The end iterator is one past the last element of the tail node,
+    // so only stepping off the end of a node with a successor moves on.
+    NodeIterator& operator++()
+    {
+      if ( ++m_index == m_node->count && m_node->next != nullptr )
+      {
+        m_node  = m_node->next;
+        m_index = 0;
+      }
+
+      return *this;
+    }
+
+    NodeIterator& operator--()
+    {
+      if ( m_index == 0 )
+      {
+        m_node  = m_node->previous;
+        m_index = m_node->count;
+      }
+
+      m_index--;
+      return *this;
+    }
+
+    NodeIterator operator++( int )
+    {
+      NodeIterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+
+    NodeIterator operator--( int )
+    {
+      NodeIterator tmp = *this;
+      --*this;
+      return tmp;
+    }
+
+  private:
+
+    Node*       m_node  = nullptr;
+    std::size_t m_index = 0;
+  };
+
+public:
+
+  using type           = T;
+  using iterator       = NodeIterator<T>;
+  using const_iterator = NodeIterator<const T>;
+
+  UnrolledList() = default;
+
+  UnrolledList( std::initializer_list<type> items )
+  {
+    for ( const type& item : items )
+      push_back( item );
+  }
+
+  UnrolledList( const UnrolledList& src )
+  {
+    for ( const type& item : src )
+      push_back( item );
+  }
+
+  UnrolledList( UnrolledList&& src ) { swap( src ); }
+
+  ~UnrolledList() { clear(); }
+
+  UnrolledList& operator=( const UnrolledList& rhs )
+  {
+    if ( this != &rhs )
+    {
+      clear();
+
+      for ( const type& item : rhs )
+        push_back( item );
+    }
+
+    return *this;
+  }
+
+  UnrolledList& operator=( UnrolledList&& rhs )
+  {
+    if ( this != &rhs )
+    {
+      clear();
+      swap( rhs );
+    }
+
+    return *this;
+  }
+
+  template<typename... Args>
+  type& emplace_back( Args&&... args )
+  {
+    if ( m_tail == nullptr || m_tail->count == node_capacity )
+      insert_node_after( m_tail );
+
+    type* item = ql::construct_at( m_tail->items() + m_tail->count, ql::forward<Args>( args )... );
+    m_tail->count++;
+    m_size++;
+    return *item;
+  }
+
+  template<typename... Args>
+  type& emplace_front( Args&&... args )
+  {
+    return *emplace( begin(), ql::forward<Args>( args )... );
+  }
+
+  void push_back( const type& value ) { emplace_back( value ); }
+  void push_back( type&& value ) { emplace_back( ql::move( value ) ); }
+
+  void push_front( const type& value ) { emplace_front( value ); }
+  void push_front( type&& value ) { emplace_front( ql::move( value ) ); }
+
+  void pop_back() { erase( const_iterator( m_tail, m_tail->count - 1 ) ); }
+  void pop_front() { erase( begin() ); }
+
+  // Inserts a new element before pos. Only the elements of pos' node are
+  // shifted; a full node is split in half first.
+  template<typename... Args>
+  iterator emplace( const_iterator pos, Args&&... args )
+  {
+    if ( pos == cend() )
+    {
+      emplace_back( ql::forward<Args>( args )... );
+      return iterator( m_tail, m_tail->count - 1 );
+    }
+
+    // The arguments may refer to an element that is about to be shifted
+    type value( ql::forward<Args>( args )... );
+
+    Node*       node  = pos.m_node;
+    std::size_t index = pos.m_index;
+
+    if ( node->count == node_capacity )
+    {
+      Node*             next = insert_node_after( node );
+      const std::size_t half = node_capacity / 2;
+
+      relocate( node->items() + half, node->count - half, next->items() );
+      next->count = node->count - half;
+      node->count = half;
+
+      if ( index > half )
+      {
+        node = next;
+        index -= half;
+      }
+    }
+
+    type* items = node->items();
+    if ( index == node->count )
+    {
+      ql::construct_at( items + index, ql::move( value ) );
+    }
+    else
+    {
+      ql::construct_at( items + node->count, ql::move( items[ node->count - 1 ] ) );
+      for ( std::size_t i = node->count - 1; i > index; i-- )
+        items[ i ] = ql::move( items[ i - 1 ] );
+
+      items[ index ] = ql::move( value );
+    }
+
+    node->count++;
+    m_size++;
+    return iterator( node, index );
+  }
+
+  iterator insert( const_iterator pos, const type& value ) { return emplace( pos, value ); }
+  iterator insert( const_iterator pos, type&& value ) { return emplace( pos, ql::move( value ) ); }
+
+  // Removes the element at pos, returning an iterator to the element after
+  // it. Sparse neighbouring nodes are merged to keep nodes densely packed.
+  iterator erase( const_iterator pos )
+  {
+    Node*       node  = pos.m_node;
+    std::size_t index = pos.m_index;
+    type*       items = node->items();
+
+    for ( std::size_t i = index; i + 1 < node->count; i++ )
+      items[ i ] = ql::move( items[ i + 1 ] );
+
+    node->count--;
+    ql::destroy_at( items + node->count );
+    m_size--;
+
+    if ( node->count == 0 )
+    {
+      Node* next = node->next;
+      remove_node( node );
+      return next != nullptr ? iterator( next, 0 ) : end();
+    }
+
+    Node* next = node->next;
+    if ( next != nullptr && node->count + next->count <= node_capacity / 2 )
+    {
+      relocate( next->items(), next->count, items + node->count );
+      node->count += next->count;
+      next->count = 0;
+      remove_node( next );
+    }
+
+    if ( index == node->count && node->next != nullptr )
+      return iterator( node->next, 0 );
+
+    return iterator( node, index );
+  }
+
+  void clear()
+  {
+    Node* node = m_head;
+    while ( node != nullptr )
+    {
+      Node* next = node->next;
+      ql::destroy_n( node->items(), node->count );
+      delete node;
+      node = next;
+    }
+
+    m_head = nullptr;
+    m_tail = nullptr;
+    m_size = 0;
+  }
+
+  void swap( UnrolledList& other )
+  {
+    ql::swap( m_head, other.m_head );
+    ql::swap( m_tail, other.m_tail );
+    ql::swap( m_size, other.m_size );
+  }
+
+  type&       front() { return m_head->items()[ 0 ]; }
+  const type& front() const { return m_head->items()[ 0 ]; }
+
+  type&       back() { return m_tail->items()[ m_tail->count - 1 ]; }
+  const type& back() const { return m_tail->items()[ m_tail->count - 1 ]; }
+
+  iterator       begin() { return iterator( m_head, 0 ); }
+  const_iterator begin() const { return const_iterator( m_head, 0 ); }
+  const_iterator cbegin() const { return begin(); }
+
+  iterator       end() { return iterator( m_tail, m_tail != nullptr ? m_tail->count : 0 ); }
+  const_iterator end() const { return const_iterator( m_tail, m_tail != nullptr ? m_tail->count : 0 ); }
+  const_iterator cend() const { return end(); }
+
+  bool        empty() const { return m_size == 0; }
+  std::size_t size() const { return m_size; }
+
+private:
+
+  // Move-constructs count items into uninitialised memory at out and
+  // destroys the originals.
+  static void relocate( type* items, std::size_t count, type* out )
+  {
+    ql::uninitialized_move( items, items + count, out );
+    ql::destroy_n( items, count );
+  }
+
+  Node* insert_node_after( Node* node )
+  {
+    Node* created = new Node;
+    created->previous = node;
+
+    if ( node == nullptr )
+    {
+      created->next = m_head;
+      m_head        = created;
+    }
+    else
+    {
+      created->next = node->next;
+      node->next    = created;
+    }
+
+    if ( created->next != nullptr )
+      created->next->previous = created;
+    else
+      m_tail = created;
+
+    return created;
+  }
+
+  void remove_node( Node* node )
+  {
+    if ( node->previous != nullptr )
+      node->previous->next = node->next;
+    else
+      m_head = node->next;
+
+    if ( node->next != nullptr )
+      node->next->previous = node->previous;
+    else
+      m_tail = node->previous;
+
+    delete node;
+  }
+
+  Node*       m_head = nullptr;
+  Node*       m_tail = nullptr;
+  std::size_t m_size = 0;
+};
+
+} // namespace ql
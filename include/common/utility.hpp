@@ -36,11 +36,12 @@ constexpr std::remove_reference_t<T>&& move( T&& object )
   return static_cast<std::remove_reference_t<T>&&>( object );
 }
 
-constexpr auto exchange( auto& object, auto&& value )
+template<typename T, typename U = T>
+constexpr T exchange( T& object, U&& value )
 {
-  auto tmp = move( object );
-  object = forward( value );
-  return tmp;
+  T old = ql::move( object );
+  object = ql::forward<U>( value );
+  return old;
 }
 
 template<typename FirstType, typename SecondType>
@@ -1,38 +1,50 @@
 #pragma once
 #include "common/algorithm.hpp"
+#include "common/common.hpp"
 #include "common/memory.hpp"
 #include "common/utility.hpp"
 #include "common/allocator.hpp"
 #include <cstddef>
 #include <initializer_list>
+#include <memory>
 #include <type_traits>
 #include <algorithm>
 
 namespace ql
 {
 
+// A resizable array. Elements are constructed and destroyed through the
+// allocator, so allocator-aware elements (such as a pmr::String) receive it
+// too.
 template<typename T, typename Allocator = ql::Allocator<T>>
 class Vector
 {
+  using allocator_traits = std::allocator_traits<Allocator>;
+
 public:
 
   using type            = T;
+  using allocator_type  = Allocator;
   using iterator        = type*;
   using const_iterator  = const type*;
   using reference       = type&;
   using const_reference = const type&;
 
-  constexpr Vector( std::initializer_list<T> items );
+  constexpr explicit Vector( const Allocator& allocator );
+
+  constexpr Vector( std::initializer_list<T> items, const Allocator& allocator = Allocator() );
 
   constexpr Vector( const Vector& other );
+  constexpr Vector( const Vector& other, const Allocator& allocator );
   constexpr Vector( Vector&& other );
+  constexpr Vector( Vector&& other, const Allocator& allocator );
 
-  constexpr Vector( const T* items, std::size_t size );
+  constexpr Vector( const T* items, std::size_t size, const Allocator& allocator = Allocator() );
 
-  constexpr Vector( std::size_t size );
+  constexpr Vector( std::size_t size, const Allocator& allocator = Allocator() );
 
   template<std::size_t N>
-  constexpr Vector( const T ( &items )[ N ] );
+  constexpr Vector( const T ( &items )[ N ], const Allocator& allocator = Allocator() );
 
   constexpr Vector() = default;
   constexpr ~Vector();
@@ -43,8 +55,10 @@ public:
   template<std::size_t N>
   constexpr Vector& operator=( const type ( *items )[ N ] );
 
+  constexpr allocator_type get_allocator() const { return m_allocator; }
+
   // Capacity
-  constexpr bool        empty() const { return m_items == nullptr; }
+  constexpr bool        empty() const { return m_size == 0; }
   constexpr std::size_t size() const { return m_size; }
   constexpr std::size_t max_size() const { return SIZE_MAX; }
   constexpr void        reserve( std::size_t capacity );
@@ -57,7 +71,7 @@ public:
   constexpr iterator insert( const_iterator pos, const T& value );
   constexpr iterator insert( const_iterator pos, T&& value );
   constexpr iterator insert( const_iterator pos, std::size_t count, const T& value );
-  constexpr iterator insert( const_iterator pos, iterator first, iterator last );
+  constexpr iterator insert( const_iterator pos, const_iterator first, const_iterator last );
   constexpr iterator insert( const_iterator pos, std::initializer_list<type> list );
 
   template<typename... Args>
@@ -103,15 +117,34 @@ public:
 
 private:
 
-  constexpr void assign( std::initializer_list<T> items );
+  template<typename... Args>
+  constexpr void construct( T* item, Args&&... args )
+  {
+    allocator_traits::construct( m_allocator, item, ql::forward<Args>( args )... );
+  }
+
+  constexpr void destroy( T* first, T* last )
+  {
+    for ( ; first != last; first++ )
+      allocator_traits::destroy( m_allocator, first );
+  }
 
-  constexpr void assign( const Vector& other );
-  constexpr void assign( Vector&& other );
+  // The capacity to grow to when a full vector gains an item
+  constexpr std::size_t next_capacity() const
+  {
+    return m_capacity < 4 ? 4 : m_capacity * 2;
+  }
 
-  constexpr void assign( const T* items, std::size_t size );
+  // Moves every item into items, which has room for capacity, and releases
+  // the previous storage.
+  constexpr void relocate( T* items, std::size_t capacity );
 
-  template<std::size_t N>
-  constexpr void assign( const T ( &items )[ N ] );
+  template<typename InputIterator>
+  constexpr void append( InputIterator first, InputIterator last );
+
+  // Takes other's items when its allocator allows, otherwise moves them
+  // one by one.
+  constexpr void take( Vector&& other );
 
   constexpr void destruct();
 
@@ -123,81 +156,118 @@ private:
 };
 
 template<typename T, typename Allocator>
-constexpr Vector<T, Allocator>::Vector( std::size_t size )
+constexpr Vector<T, Allocator>::Vector( const Allocator& allocator )
+: m_allocator( allocator )
+{
+}
+
+template<typename T, typename Allocator>
+constexpr Vector<T, Allocator>::Vector( std::size_t size, const Allocator& allocator )
+: m_allocator( allocator )
 {
   resize( size );
 }
 
 template<typename T, typename Allocator>
 template<std::size_t N>
-constexpr Vector<T, Allocator>::Vector( const T ( &items )[ N ] )
+constexpr Vector<T, Allocator>::Vector( const T ( &items )[ N ], const Allocator& allocator )
+: m_allocator( allocator )
 {
-  assign( items );
+  append( items, items + N );
 }
 
 template<typename T, typename Allocator>
-constexpr Vector<T, Allocator>::Vector( std::initializer_list<T> items )
+constexpr Vector<T, Allocator>::Vector( std::initializer_list<T> items, const Allocator& allocator )
+: m_allocator( allocator )
 {
-  assign( items );
+  append( items.begin(), items.end() );
 }
 
 template<typename T, typename Allocator>
 constexpr Vector<T, Allocator>::Vector( const Vector& other )
+: m_allocator( allocator_traits::select_on_container_copy_construction( other.m_allocator ) )
 {
-  assign( other );
+  append( other.begin(), other.end() );
 }
 
 template<typename T, typename Allocator>
-constexpr Vector<T, Allocator>::Vector( Vector&& other )
+constexpr Vector<T, Allocator>::Vector( const Vector& other, const Allocator& allocator )
+: m_allocator( allocator )
 {
-  assign( move( other ) );
+  append( other.begin(), other.end() );
 }
 
 template<typename T, typename Allocator>
-constexpr Vector<T, Allocator>::Vector( const T* items, std::size_t size )
+constexpr Vector<T, Allocator>::Vector( Vector&& other )
+: m_allocator( other.m_allocator )
 {
-  assign( items, size );
+  swap( other );
 }
 
 template<typename T, typename Allocator>
-constexpr Vector<T, Allocator>::~Vector()
+constexpr Vector<T, Allocator>::Vector( Vector&& other, const Allocator& allocator )
+: m_allocator( allocator )
 {
-  destruct();
+  take( ql::move( other ) );
 }
 
 template<typename T, typename Allocator>
-template<std::size_t N>
-constexpr void Vector<T, Allocator>::assign( const type ( &items )[ N ] )
+constexpr Vector<T, Allocator>::Vector( const T* items, std::size_t size, const Allocator& allocator )
+: m_allocator( allocator )
 {
-  assign( items, N );
+  append( items, items + size );
 }
 
 template<typename T, typename Allocator>
-constexpr void Vector<T, Allocator>::assign( std::initializer_list<type> items )
+constexpr Vector<T, Allocator>::~Vector()
 {
-  assign( items.begin(), items.size() );
+  destruct();
 }
 
 template<typename T, typename Allocator>
-constexpr void Vector<T, Allocator>::assign( const Vector& other )
+template<typename InputIterator>
+constexpr void Vector<T, Allocator>::append( InputIterator first, InputIterator last )
 {
-  assign( other.begin(), other.size() );
+  if constexpr ( requires { last - first; } )
+    reserve( m_size + std::size_t( last - first ) );
+
+  for ( ; first != last; ++first )
+    emplace_back( *first );
 }
 
 template<typename T, typename Allocator>
-constexpr void Vector<T, Allocator>::assign( Vector&& other )
+constexpr void Vector<T, Allocator>::take( Vector&& other )
 {
-  ql::swap( m_size, other.m_size );
-  ql::swap( m_items, other.m_items );
-  ql::swap( m_capacity, other.m_capacity );
+  if ( allocator_traits::is_always_equal::value || m_allocator == other.m_allocator )
+  {
+    ql::swap( m_items, other.m_items );
+    ql::swap( m_size, other.m_size );
+    ql::swap( m_capacity, other.m_capacity );
+  }
+  else
+  {
+    reserve( m_size + other.m_size );
+    for ( T& item : other )
+      emplace_back( ql::move( item ) );
+
+    other.clear();
+  }
 }
 
 template<typename T, typename Allocator>
-constexpr void Vector<T, Allocator>::assign( const type* items, std::size_t size )
+constexpr void Vector<T, Allocator>::relocate( T* items, std::size_t capacity )
 {
-  m_size = size;
-  reserve( m_size );
-  copy_n( items, m_size, m_items );
+  if ( m_items != nullptr )
+  {
+    for ( std::size_t i = 0; i < m_size; i++ )
+      construct( items + i, ql::move( m_items[ i ] ) );
+
+    destroy( begin(), end() );
+    m_allocator.deallocate( m_items, m_capacity );
+  }
+
+  m_items    = items;
+  m_capacity = capacity;
 }
 
 template<typename T, typename Allocator>
@@ -205,35 +275,24 @@ constexpr void Vector<T, Allocator>::reserve( std::size_t capacity )
 {
   if ( capacity > m_capacity )
   {
-    auto result = m_allocator.allocate_at_least( capacity );
-
-    if ( !empty() )
-    {
-      uninitialized_move( begin(), end(), result.ptr );
-      m_allocator.deallocate( m_items, m_capacity );
-    }
-
-    m_capacity = result.size;
-    m_items = result.ptr;
+    auto result = ql::allocate_at_least( m_allocator, capacity );
+    relocate( result.ptr, result.size );
   }
 }
 
 template<typename T, typename Allocator>
 constexpr void Vector<T, Allocator>::shrink_to_fit()
 {
-  if ( m_capacity > m_size )
-  {
-    type* ptr = m_allocator.allocate( m_size );
-
-    if ( !empty() )
-    {
-      uninitialized_move( begin(), end(), ptr );
-      m_allocator.deallocate( m_items, m_capacity );
-    }
+  if ( m_capacity == m_size )
+    return;
 
-    m_items = ptr;
-    m_capacity = m_size;
+  if ( m_size == 0 )
+  {
+    destruct();
+    return;
   }
+
+  relocate( m_allocator.allocate( m_size ), m_size );
 }
 
 template<typename T, typename Allocator>
@@ -241,56 +300,46 @@ constexpr void Vector<T, Allocator>::resize( std::size_t count )
 {
   if ( count < m_size )
   {
-    destroy_n( m_items, m_size - count );
+    destroy( m_items + count, end() );
     m_size = count;
-    shrink_to_fit();
   }
   else if ( count > m_size )
   {
     reserve( count );
-    uninitialized_default_construct_n( m_items + m_size, count - m_size );
-    m_size = count;
+
+    for ( ; m_size < count; m_size++ )
+      construct( m_items + m_size );
   }
 }
 
 template<typename T, typename Allocator>
 constexpr void Vector<T, Allocator>::push_back( const type& item )
 {
-  m_size++;
-
-  if ( size() > capacity() )
-    reserve( capacity() + 1 );
-
-  back() = item;
+  emplace_back( item );
 }
 
 template<typename T, typename Allocator>
 constexpr void Vector<T, Allocator>::push_back( type&& item )
 {
-  m_size++;
-
-  if ( size() > capacity() )
-    reserve( m_capacity + 1 );
-
-  back() = move( item );
+  emplace_back( ql::move( item ) );
 }
 
 template<typename T, typename Allocator>
 template<std::size_t N>
 constexpr Vector<T, Allocator>& Vector<T, Allocator>::operator=( const type ( *items )[ N ] )
 {
-  destruct();
+  clear();
 
-  assign( items );
+  append( *items, *items + N );
   return *this;
 }
 
 template<typename T, typename Allocator>
 constexpr Vector<T, Allocator>& Vector<T, Allocator>::operator=( std::initializer_list<type> items )
 {
-  destruct();
+  clear();
 
-  assign( items );
+  append( items.begin(), items.end() );
   return *this;
 }
 
@@ -300,9 +349,17 @@ constexpr Vector<T, Allocator>& Vector<T, Allocator>::operator=( const Vector& r
   if ( this == ql::addressof( rhs ) )
     return *this;
 
-  destruct();
+  if constexpr ( allocator_traits::propagate_on_container_copy_assignment::value )
+  {
+    if ( m_allocator != rhs.m_allocator )
+      destruct();
+
+    m_allocator = rhs.m_allocator;
+  }
 
-  assign( rhs );
+  clear();
+
+  append( rhs.begin(), rhs.end() );
   return *this;
 }
 
@@ -314,141 +371,177 @@ constexpr Vector<T, Allocator>& Vector<T, Allocator>::operator=( Vector&& rhs )
 
   destruct();
 
-  assign( rhs );
+  if constexpr ( allocator_traits::propagate_on_container_move_assignment::value )
+    m_allocator = rhs.m_allocator;
+
+  take( ql::move( rhs ) );
   return *this;
 }
 
-// inserts value before pos.
+// Inserts value before pos.
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator Vector<T, Allocator>::insert( const_iterator pos, const T& value )
 {
-  if ( pos <= begin() || pos > end() )
-    return end();
-
-  m_size++;
-
-  if ( size() > capacity() )
-    reserve( capacity() + 1 );
-
-  copy( pos, const_iterator( end() - pos ), iterator( pos + 1 ) );
-
-  m_items[ m_size - 1 ] = type();
-  return &m_items[ m_size - 1 ];
+  return emplace( pos, value );
 }
 
-// inserts value before pos.
+// Inserts value before pos.
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator Vector<T, Allocator>::insert( const_iterator pos, T&& value )
 {
-  if ( pos <= begin() || pos > end() )
-    return end();
-
-  m_size++;
-
-  if ( size() > capacity() )
-    reserve( capacity() + 1 );
-
-  copy( pos, end() - pos, iterator( pos ) );
-
-  m_items[ m_size - 1 ] = move( type() );
-  return &m_items[ m_size - 1 ];
+  return emplace( pos, ql::move( value ) );
 }
 
-// inserts count copies of the value before pos.
+// Inserts count copies of value before pos.
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator
 Vector<T, Allocator>::insert( const_iterator pos, std::size_t count, const T& value )
 {
-  for ( std::size_t i = count; i > 0; i-- )
-    insert( std::prev( pos, i ), value );
+  const std::size_t index = pos - begin();
+  const std::size_t size  = m_size;
+
+  if ( count == 0 )
+    return begin() + index;
 
-  return pos - count;
+  // value may be an item of this vector, so only refer to it until the
+  // first copy exists
+  emplace_back( value );
+  for ( std::size_t i = 1; i < count; i++ )
+    emplace_back( m_items[ size ] );
+
+  std::rotate( begin() + index, begin() + size, end() );
+  return begin() + index;
 }
 
+// Inserts [first, last), which must not be items of this vector, before pos.
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator Vector<T, Allocator>::insert( const_iterator pos,
-                                                iterator first, iterator last )
+                                                const_iterator first, const_iterator last )
 {
-  for ( iterator i = first; i != last; i++ )
-    insert( std::prev( pos, std::distance( i, last ) ), *i );
+  const std::size_t index = pos - begin();
+  const std::size_t size  = m_size;
+
+  append( first, last );
 
-  return const_cast<iterator>( std::prev( pos, std::distance( first, last ) ) );
+  std::rotate( begin() + index, begin() + size, end() );
+  return begin() + index;
 }
 
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator
 Vector<T, Allocator>::insert( const_iterator pos, std::initializer_list<type> list )
 {
-  for ( std::size_t i = 0; i < list.size(); i++ )
-    insert( pos + i, list[ i ] );
+  return insert( pos, list.begin(), list.end() );
 }
 
+// Constructs an item from args before pos.
 template<typename T, typename Allocator>
 template<typename... Args>
 constexpr typename Vector<T, Allocator>::iterator Vector<T, Allocator>::emplace( const_iterator pos,
                                                  Args&&... args )
 {
-  if ( pos <= begin() || pos > end() )
-    return end();
+  const std::size_t index = pos - begin();
 
-  m_size++;
+  if ( index == m_size )
+  {
+    emplace_back( ql::forward<Args>( args )... );
+    return begin() + index;
+  }
+
+  if ( m_size == m_capacity )
+  {
+    auto result = ql::allocate_at_least( m_allocator, next_capacity() );
+    T*   items  = result.ptr;
+
+    // Construct the new item first, args may refer to an existing one
+    construct( items + index, ql::forward<Args>( args )... );
+
+    for ( std::size_t i = 0; i < index; i++ )
+      construct( items + i, ql::move( m_items[ i ] ) );
+
+    for ( std::size_t i = index; i < m_size; i++ )
+      construct( items + i + 1, ql::move( m_items[ i ] ) );
 
-  if ( size() > capacity() )
-    reserve( capacity() + 1 );
+    destroy( begin(), end() );
+    m_allocator.deallocate( m_items, m_capacity );
 
-  copy( pos, end() - pos, pos + 1 );
+    m_items    = items;
+    m_capacity = result.size;
+  }
+  else
+  {
+    // Built aside with the allocator before anything shifts, as args may
+    // refer to an item of this vector
+    alignas( T ) byte_t storage[ sizeof( T ) ];
+    T* item = reinterpret_cast<T*>( storage );
+    construct( item, ql::forward<Args>( args )... );
 
-  return construct_object( pos - 1, args... );
+    construct( end(), ql::move( back() ) );
+    std::move_backward( begin() + index, end() - 1, end() );
+    m_items[ index ] = ql::move( *item );
+
+    allocator_traits::destroy( m_allocator, item );
+  }
+
+  m_size++;
+  return begin() + index;
 }
 
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator Vector<T, Allocator>::erase( const_iterator pos )
 {
-  m_size--;
-
-  destroy_at( pos );
-  copy( pos, end() - pos, pos + 1 );
-
-  return end();
+  return erase( pos, pos + 1 );
 }
 
 template<typename T, typename Allocator>
 constexpr typename Vector<T, Allocator>::iterator Vector<T, Allocator>::erase( const_iterator first,
                                                const_iterator last )
 {
+  iterator out = begin() + ( first - begin() );
   if ( first == last )
-    return end();
-
-  m_size -= last - first;
+    return out;
 
-  destroy( first, last );
-  copy( last, end() - last, first );
+  iterator tail = std::move( begin() + ( last - begin() ), end(), out );
+  destroy( tail, end() );
+  m_size = tail - begin();
 
-  return end();
+  return out;
 }
 
 template<typename T, typename Allocator>
 template<typename... Args>
 constexpr typename Vector<T, Allocator>::reference Vector<T, Allocator>::emplace_back( Args&&... args )
 {
-  m_size++;
+  if ( m_size == m_capacity )
+  {
+    auto result = ql::allocate_at_least( m_allocator, next_capacity() );
 
-  if ( size() > capacity() )
-    reserve( m_capacity + 1 );
+    // Construct the new item first, args may refer to an existing one
+    construct( result.ptr + m_size, ql::forward<Args>( args )... );
+    relocate( result.ptr, result.size );
+  }
+  else
+  {
+    construct( m_items + m_size, ql::forward<Args>( args )... );
+  }
 
-  return *construct_at( m_items + m_size - 1, args... );
+  m_size++;
+  return back();
 }
 
 template<typename T, typename Allocator>
 constexpr void Vector<T, Allocator>::pop_back()
 {
   m_size--;
-  destroy_at( m_items + m_size );
+  allocator_traits::destroy( m_allocator, m_items + m_size );
 }
 
 template<typename T, typename Allocator>
 constexpr void Vector<T, Allocator>::swap( Vector& other )
 {
+  if constexpr ( allocator_traits::propagate_on_container_swap::value )
+    ql::swap( m_allocator, other.m_allocator );
+
   ql::swap( m_items, other.m_items );
   ql::swap( m_size, other.m_size );
   ql::swap( m_capacity, other.m_capacity );
@@ -457,15 +550,23 @@ constexpr void Vector<T, Allocator>::swap( Vector& other )
 template<typename T, typename Allocator>
 constexpr void Vector<T, Allocator>::destruct()
 {
-  if ( empty() )
+  if ( m_items == nullptr )
     return;
 
   destroy( begin(), end() );
-  m_allocator.deallocate( m_items, m_size );
+  m_allocator.deallocate( m_items, m_capacity );
 
   m_items    = nullptr;
   m_size     = 0;
   m_capacity = 0;
 }
 
+namespace pmr
+{
+
+template<typename T>
+using Vector = ql::Vector<T, PolymorphicAllocator<T>>;
+
+} // namespace pmr
+
 } // namespace ql
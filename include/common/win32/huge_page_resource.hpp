@@ -0,0 +1,199 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/allocator.hpp"
+#include "common/vector.hpp"
+#include "common/win32/win32.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memoryapi.h>
+
+namespace ql
+{
+
+// A memory resource backed by large-page aligned virtual memory, so that
+// large working sets need far fewer TLB entries.
+//
+// Large pages (MEM_LARGE_PAGES) are tried first when requested. They need
+// the "Lock pages in memory" privilege and physically contiguous memory,
+// and the resource falls back to ordinary pages when they are refused;
+// Windows has no transparent huge pages.
+//
+// Requests of at least huge_page_size get an allocation of their own,
+// returned to the system when deallocated. Smaller requests are bump
+// allocated from shared regions which are only returned by release() or
+// destruction, so put a pool resource in front if small blocks are freed
+// often. Alignments beyond huge_page_size are honoured with a region of
+// their own.
+//
+// The resource isn't thread-safe: the bump pointer and the list of regions
+// are unguarded, so share it between threads only behind a synchronised
+// resource.
+class HugePageResource : public MemoryResource
+{
+  struct Mapping
+  {
+    byte_t*     address;
+    std::size_t size;
+    bool        large;
+  };
+
+public:
+
+  static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+
+  explicit HugePageResource( bool tryExplicit = true )
+  : m_tryExplicit( tryExplicit && GetLargePageMinimum() != 0 )
+  {
+  }
+
+  HugePageResource( const HugePageResource& ) = delete;
+  HugePageResource& operator=( const HugePageResource& ) = delete;
+
+  ~HugePageResource() override
+  {
+    release();
+  }
+
+  // Frees every region, including memory that was never deallocated
+  void release()
+  {
+    for ( const Mapping& mapping : m_mappings )
+      VirtualFree( mapping.address, 0, MEM_RELEASE );
+
+    m_mappings.clear();
+    m_current = nullptr;
+    m_end     = nullptr;
+  }
+
+  // The bytes currently reserved by the resource
+  std::size_t mapped_bytes() const
+  {
+    std::size_t bytes = 0;
+    for ( const Mapping& mapping : m_mappings )
+      bytes += mapping.size;
+
+    return bytes;
+  }
+
+  // Whether any region was backed by large pages
+  bool explicit_huge_pages() const { return m_explicitGranted; }
+
+  // The bytes of the resource's regions backed by large pages. Large pages
+  // are committed up front, so unlike on Linux this doesn't depend on use.
+  std::size_t huge_page_bytes() const
+  {
+    std::size_t bytes = 0;
+    for ( const Mapping& mapping : m_mappings )
+    {
+      if ( mapping.large )
+        bytes += mapping.size;
+    }
+
+    return bytes;
+  }
+
+private:
+
+  // Attempts at reserving an aligned region before giving up
+  static constexpr int max_attempts = 8;
+
+  static std::size_t round_up( std::size_t bytes, std::size_t alignment )
+  {
+    return ( bytes + alignment - 1 ) & ~( alignment - 1 );
+  }
+
+  // Allocates size bytes (a multiple of huge_page_size) on an alignment
+  // boundary, alignment being a power of two of at least huge_page_size
+  Mapping map( std::size_t size, std::size_t alignment = huge_page_size )
+  {
+    // Large pages are only aligned to their own size
+    if ( m_tryExplicit && alignment == huge_page_size )
+    {
+      void* memory = VirtualAlloc( nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+      if ( memory != nullptr )
+      {
+        m_explicitGranted = true;
+        return Mapping { static_cast<byte_t*>( memory ), size, true };
+      }
+
+      // Missing the privilege, or no contiguous memory; don't keep asking
+      m_tryExplicit = false;
+    }
+
+    // Find an aligned address by over-reserving, then reserve exactly there.
+    // Another thread may take the address in between, so retry if it does,
+    // but give up if that keeps happening.
+    for ( int attempt = 0; attempt < max_attempts; attempt++ )
+    {
+      void* probe = VirtualAlloc( nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS );
+      if ( probe == nullptr )
+        throw std::bad_alloc();
+
+      VirtualFree( probe, 0, MEM_RELEASE );
+
+      void* aligned = reinterpret_cast<void*>( round_up( reinterpret_cast<std::uintptr_t>( probe ), alignment ) );
+      void* memory  = VirtualAlloc( aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( memory != nullptr )
+        return Mapping { static_cast<byte_t*>( memory ), size, false };
+    }
+
+    throw std::bad_alloc();
+  }
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    if ( bytes >= huge_page_size || alignment > huge_page_size )
+    {
+      Mapping mapping = map( round_up( bytes, huge_page_size ), ql::max( alignment, huge_page_size ) );
+
+      m_mappings.push_back( mapping );
+      return mapping.address;
+    }
+
+    byte_t* memory = reinterpret_cast<byte_t*>( round_up( reinterpret_cast<std::uintptr_t>( m_current ), alignment ) );
+    if ( m_current == nullptr || memory + bytes > m_end )
+    {
+      Mapping mapping = map( huge_page_size );
+      memory = mapping.address;
+      m_end  = memory + huge_page_size;
+
+      m_mappings.push_back( mapping );
+    }
+
+    m_current = memory + bytes;
+    return memory;
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    if ( bytes < huge_page_size && alignment <= huge_page_size )
+      return;
+
+    for ( Mapping* mapping = m_mappings.begin(); mapping != m_mappings.end(); mapping++ )
+    {
+      if ( mapping->address == memory )
+      {
+        VirtualFree( mapping->address, 0, MEM_RELEASE );
+        m_mappings.erase( mapping );
+        return;
+      }
+    }
+  }
+
+  bool do_is_equal( const MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+
+  Vector<Mapping> m_mappings;
+
+  byte_t* m_current = nullptr;
+  byte_t* m_end     = nullptr;
+
+  bool m_tryExplicit     = true;
+  bool m_explicitGranted = false;
+};
+
+} // namespace ql
@@ -0,0 +1,320 @@
+#pragma once
+#include "common/common.hpp"
+#include "common/algorithm.hpp"
+#include "common/win32/win32.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memoryapi.h>
+#include <new>
+#include <type_traits>
+
+namespace ql
+{
+
+enum class MapMode
+{
+  read_write, // Opens or creates the file, changes are written back to it
+  read_only   // Opens an existing file; processes share its pages
+};
+
+// A vector of trivially copyable items kept in a memory-mapped file. Opening
+// one maps the file rather than reading it, so even huge arrays load
+// instantly and pages are only read in as they are touched.
+//
+// The file starts with a small header recording a magic number, the format
+// version, the item size and the item count; files written for a different
+// item type are refused. Growing extends the file and maps a new view of
+// it, so like ql::Vector, growth invalidates pointers to items. If the file
+// can't grow, std::bad_alloc is thrown and the vector is left as it was.
+//
+// Changes reach the file at the system's leisure, or when flush() is called.
+template<typename T>
+class MappedVector
+{
+  static_assert( std::is_trivially_copyable_v<T>, "MappedVector: T must be trivially copyable" );
+
+  struct Header
+  {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t itemSize;
+    std::uint64_t count;
+  };
+
+  static constexpr std::uint64_t magic   = 0x43455650414d4c51; // "QLMAPVEC"
+  static constexpr std::uint32_t version = 1;
+
+  // Items start on a cache line, or their own alignment if greater
+  static constexpr std::size_t data_offset = alignof( T ) > 64 ? alignof( T ) : 64;
+
+public:
+
+  using type           = T;
+  using iterator       = T*;
+  using const_iterator = const T*;
+
+  MappedVector() = default;
+
+  MappedVector( const char* path, MapMode mode = MapMode::read_write ) { open( path, mode ); }
+
+  MappedVector( const MappedVector& ) = delete;
+  MappedVector& operator=( const MappedVector& ) = delete;
+
+  MappedVector( MappedVector&& other ) { swap( other ); }
+
+  MappedVector& operator=( MappedVector&& other )
+  {
+    if ( this != &other )
+    {
+      close();
+      swap( other );
+    }
+
+    return *this;
+  }
+
+  ~MappedVector()
+  {
+    close();
+  }
+
+  // Maps the file at path, creating it if writable and missing. Returns
+  // false, printing the reason, if the file can't be mapped or was written
+  // for a different item type.
+  bool open( const char* path, MapMode mode = MapMode::read_write )
+  {
+    close();
+
+    const bool writable = mode == MapMode::read_write;
+
+    m_file = CreateFileA( path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, writable ? OPEN_ALWAYS : OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, nullptr );
+    if ( m_file == INVALID_HANDLE_VALUE )
+      return fail( path, detail::win32::get_error() );
+
+    LARGE_INTEGER size;
+    if ( !GetFileSizeEx( m_file, &size ) )
+      return fail( path, detail::win32::get_error() );
+
+    std::size_t fileSize = std::size_t( size.QuadPart );
+    const bool  created  = fileSize == 0 && writable;
+
+    if ( created )
+      fileSize = data_offset;
+    else if ( fileSize < data_offset )
+      return fail( path, "not a MappedVector file" );
+
+    m_writable = writable;
+    if ( !map( fileSize ) )
+      return fail( path, detail::win32::get_error() );
+
+    if ( created )
+    {
+      *header() = Header { magic, version, std::uint32_t( sizeof( T ) ), 0 };
+    }
+    else
+    {
+      const Header& existing = *header();
+      if ( existing.magic != magic || existing.version != version )
+        return fail( path, "not a MappedVector file, or an unsupported version" );
+
+      if ( existing.itemSize != sizeof( T ) )
+        return fail( path, "written for items of a different size" );
+
+      if ( data_offset + existing.count * sizeof( T ) > fileSize )
+        return fail( path, "truncated" );
+    }
+
+    return true;
+  }
+
+  // Unmaps the file, first trimming any spare capacity from it
+  void close()
+  {
+    if ( m_mapping != nullptr )
+    {
+      const std::size_t used = data_offset + size() * sizeof( T );
+      unmap();
+
+      if ( m_writable && used != m_length )
+        set_file_size( used );
+    }
+
+    if ( m_file != INVALID_HANDLE_VALUE )
+      CloseHandle( m_file );
+
+    m_length   = 0;
+    m_file     = INVALID_HANDLE_VALUE;
+    m_writable = false;
+  }
+
+  // Writes changes back to the file. Unless wait is false, returns once
+  // they have reached it.
+  bool flush( bool wait = true )
+  {
+    if ( m_mapping == nullptr || !FlushViewOfFile( m_mapping, m_length ) )
+      return false;
+
+    return !wait || FlushFileBuffers( m_file );
+  }
+
+  void reserve( std::size_t capacity )
+  {
+    if ( capacity > this->capacity() )
+      remap( data_offset + capacity * sizeof( T ) );
+  }
+
+  void resize( std::size_t size )
+  {
+    ql::assert( m_writable, "MappedVector: modified while mapped read-only" );
+    reserve( size );
+
+    if ( size > this->size() )
+      std::memset( static_cast<void*>( data() + this->size() ), 0, ( size - this->size() ) * sizeof( T ) );
+
+    header()->count = size;
+  }
+
+  void push_back( const T& item )
+  {
+    ql::assert( m_writable, "MappedVector: modified while mapped read-only" );
+
+    if ( size() == capacity() )
+    {
+      // item may live in the view that is about to move
+      const T copy = item;
+      reserve( capacity() < 64 ? 64 : capacity() * 2 );
+      data()[ header()->count++ ] = copy;
+      return;
+    }
+
+    data()[ header()->count++ ] = item;
+  }
+
+  void pop_back()
+  {
+    ql::assert( m_writable, "MappedVector: modified while mapped read-only" );
+    ql::assert( !empty(), "MappedVector: pop_back on an empty vector" );
+    header()->count--;
+  }
+
+  void clear()
+  {
+    ql::assert( m_writable, "MappedVector: modified while mapped read-only" );
+    header()->count = 0;
+  }
+
+  bool        is_open() const { return m_mapping != nullptr; }
+  bool        writable() const { return m_writable; }
+  bool        empty() const { return size() == 0; }
+  std::size_t size() const { return m_mapping != nullptr ? header()->count : 0; }
+  std::size_t capacity() const { return m_mapping != nullptr ? ( m_length - data_offset ) / sizeof( T ) : 0; }
+
+  T*       data() { return reinterpret_cast<T*>( m_mapping + data_offset ); }
+  const T* data() const { return reinterpret_cast<const T*>( m_mapping + data_offset ); }
+
+  T&       operator[]( std::size_t i ) { return data()[ i ]; }
+  const T& operator[]( std::size_t i ) const { return data()[ i ]; }
+
+  T&       front() { return data()[ 0 ]; }
+  const T& front() const { return data()[ 0 ]; }
+
+  T&       back() { return data()[ size() - 1 ]; }
+  const T& back() const { return data()[ size() - 1 ]; }
+
+  iterator       begin() { return data(); }
+  const_iterator begin() const { return data(); }
+  iterator       end() { return data() + size(); }
+  const_iterator end() const { return data() + size(); }
+
+  void swap( MappedVector& other )
+  {
+    ql::swap( m_mapping, other.m_mapping );
+    ql::swap( m_length, other.m_length );
+    ql::swap( m_file, other.m_file );
+    ql::swap( m_section, other.m_section );
+    ql::swap( m_writable, other.m_writable );
+  }
+
+private:
+
+  Header*       header() { return reinterpret_cast<Header*>( m_mapping ); }
+  const Header* header() const { return reinterpret_cast<const Header*>( m_mapping ); }
+
+  bool fail( const char* path, const char* reason )
+  {
+    std::fprintf( stderr, "MappedVector: %s: %s\n", path, reason != nullptr ? reason : "unknown error" );
+
+    // Never trim a file we failed to recognise
+    m_writable = false;
+    close();
+    return false;
+  }
+
+  // Maps length bytes of the file, which grows to fit if writable. On
+  // failure the current view, if any, is left in place.
+  bool map( std::size_t length )
+  {
+    const LARGE_INTEGER size { .QuadPart = LONGLONG( length ) };
+
+    HANDLE section = CreateFileMappingA( m_file, nullptr, m_writable ? PAGE_READWRITE : PAGE_READONLY,
+                                         DWORD( size.HighPart ), size.LowPart, nullptr );
+    if ( section == nullptr )
+      return false;
+
+    void* memory = MapViewOfFile( section, m_writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length );
+    if ( memory == nullptr )
+    {
+      CloseHandle( section );
+      return false;
+    }
+
+    m_mapping = static_cast<byte_t*>( memory );
+    m_section = section;
+    m_length  = length;
+    return true;
+  }
+
+  void unmap()
+  {
+    UnmapViewOfFile( m_mapping );
+    CloseHandle( m_section );
+
+    m_mapping = nullptr;
+    m_section = nullptr;
+  }
+
+  bool set_file_size( std::size_t length )
+  {
+    const LARGE_INTEGER size { .QuadPart = LONGLONG( length ) };
+    return SetFilePointerEx( m_file, size, nullptr, FILE_BEGIN ) && SetEndOfFile( m_file );
+  }
+
+  // A view can't be resized in place, so map the grown file afresh before
+  // letting go of the old view, throwing std::bad_alloc if that fails
+  void remap( std::size_t length )
+  {
+    ql::assert( m_writable, "MappedVector: modified while mapped read-only" );
+
+    byte_t* const mapping = m_mapping;
+    const HANDLE  section = m_section;
+
+    // Any growth of the file is trimmed again by close()
+    if ( !map( length ) )
+      throw std::bad_alloc();
+
+    UnmapViewOfFile( mapping );
+    CloseHandle( section );
+  }
+
+  byte_t*     m_mapping  = nullptr;
+  std::size_t m_length   = 0;
+  HANDLE      m_file     = INVALID_HANDLE_VALUE;
+  HANDLE      m_section  = nullptr;
+  bool        m_writable = false;
+};
+
+} // namespace ql
@@ -15,7 +15,7 @@ public:
 
   Thread() = default;
 
-  Thread( std::invocable auto callable ) { assign( callable ); }
+  Thread( std::invocable auto callable ) { assign( ql::move( callable ) ); }
 
   static Thread current()
   {
@@ -24,13 +24,17 @@ public:
 
   ~Thread()
   {
-    if ( m_thread != invalid_thread )
-      join();
+    join();
   }
 
   void join()
   {
-    WaitForSingleObject( m_thread, INFINITE );
+    if ( m_thread != invalid_thread )
+    {
+      WaitForSingleObject( m_thread, INFINITE );
+      CloseHandle( m_thread );
+      m_thread = invalid_thread;
+    }
   }
 
   void detach()
@@ -47,7 +51,7 @@ public:
   Thread& operator=( std::invocable auto callable )
   {
     join();
-    assign( callable );
+    assign( ql::move( callable ) );
     return *this;
   }
 
@@ -61,8 +65,8 @@ private:
 
   void assign( std::invocable auto callable )
   {
-    m_function = callable;
-    m_thread = CreateThread( nullptr, 0, &execute_thread, this, 0, m_threadId );
+    m_function = ql::move( callable );
+    m_thread = CreateThread( nullptr, 0, &execute_thread, this, 0, &m_threadId );
   }
 
   static void* execute_thread( void* arguments )
@@ -72,9 +76,9 @@ private:
     ExitThread( 0 );
   }
 
-  Function<void()> m_function;
-  LPDWORD          m_threadId;
-  HANDLE           m_thread;
+  MoveOnlyFunction<void()> m_function;
+  DWORD                    m_threadId = 0;
+  HANDLE                   m_thread   = invalid_thread;
 };
 
 } // namespace ql
@@ -1,9 +1,36 @@
 #include <cstddef>
 #include <gtest/gtest.h>
 #include "common/tuple.hpp"
+#include "common/functional.hpp"
+#include "common/event_dispatcher.hpp"
 #include "common/memory.hpp"
+#include "common/atomic_shared_ptr.hpp"
+#include "common/ref_ptr.hpp"
 #include "common/variant.hpp"
 #include "common/vector.hpp"
+#include "common/list.hpp"
+#include "common/string.hpp"
+#include "common/memory_resource.hpp"
+#include "common/thread.hpp"
+#include "common/thread_local.hpp"
+#include "common/thread_pool.hpp"
+#include "common/task_graph.hpp"
+#include "common/caching_resource.hpp"
+#include "common/coroutine.hpp"
+#include "common/reclaim.hpp"
+#include "common/tracking_resource.hpp"
+#include "common/huge_page_resource.hpp"
+#include "common/mapped_vector.hpp"
+#include "common/object_pool.hpp"
+#include "common/intrusive_list.hpp"
+#include "common/unrolled_list.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
 #include <variant>
 
 template<std::size_t I, typename... Ts>
@@ -56,6 +83,28 @@ TEST( Tuple, StructuredBindingDeclaration )
   EXPECT_TRUE( b );
 }
 
+TEST( Memory, UniquePtr )
+{
+  int deleted = 0;
+  auto deleter = [&]( int* object ) { deleted += *object; delete object; };
+
+  ql::UniquePtr<int, decltype( deleter )> a( new int( 1 ), deleter );
+  ql::UniquePtr<int, decltype( deleter )> b = ql::move( a );
+  EXPECT_FALSE( a );
+  EXPECT_EQ( *b, 1 );
+
+  b.reset( new int( 2 ) );
+  EXPECT_EQ( deleted, 1 );
+
+  int* released = b.release();
+  EXPECT_FALSE( b );
+  delete released;
+
+  auto made = ql::make_unique<ql::String>( "forwarded" );
+  EXPECT_STREQ( made->data(), "forwarded" );
+  EXPECT_EQ( sizeof( made ), sizeof( ql::String* ) );
+}
+
 TEST( Memory, WeakPtr )
 {
   auto observe = [&]( ql::WeakPtr<int> weakPtr ) -> bool
@@ -82,6 +131,463 @@ TEST( Memory, WeakPtr )
   EXPECT_FALSE( observe( weakPtr ) );
 }
 
+TEST( Memory, SharedPtrAcrossThreads )
+{
+  // Copies and releases the same object's counts from several threads at
+  // once; run under ThreadSanitizer to check the counts for races.
+  ql::SharedPtr<int> shared = ql::make_shared<int>( 7 );
+  ql::WeakPtr<int>   weak   = shared;
+
+  std::atomic<int> sum = 0;
+  {
+    auto work = [&]
+    {
+      for ( int i = 0; i < 10'000; i++ )
+      {
+        ql::SharedPtr<int> copy = shared;
+        ql::WeakPtr<int>   observer = copy;
+
+        if ( ql::SharedPtr<int> locked = weak.lock() )
+          sum.fetch_add( *locked - 7, std::memory_order_relaxed );
+      }
+    };
+
+    ql::Thread a = work;
+    ql::Thread b = work;
+    ql::Thread c = work;
+  }
+
+  EXPECT_EQ( sum.load(), 0 );
+  EXPECT_EQ( shared.use_count(), 1 );
+
+  shared.reset();
+  EXPECT_TRUE( weak.expired() );
+  EXPECT_FALSE( weak.lock() );
+}
+
+TEST( Memory, LocalSharedPtr )
+{
+  ql::LocalWeakPtr<int> weak;
+  {
+    ql::LocalSharedPtr<int> shared = 5;
+    ql::LocalSharedPtr<int> copy   = shared;
+    weak = copy;
+
+    EXPECT_EQ( shared.use_count(), 2 );
+    EXPECT_EQ( *weak.lock(), 5 );
+  }
+
+  EXPECT_TRUE( weak.expired() );
+}
+
+TEST( AtomicSharedPtr, LoadStoreAndCompareExchange )
+{
+  ql::AtomicSharedPtr<int> atomic = ql::make_shared<int>( 1 );
+
+  ql::SharedPtr<int> first = atomic.load();
+  EXPECT_EQ( *first, 1 );
+
+  ql::SharedPtr<int> expected = ql::make_shared<int>( 1 );
+  EXPECT_FALSE( atomic.compare_exchange_strong( expected, ql::make_shared<int>( 2 ) ) );
+  EXPECT_EQ( expected.get(), first.get() );
+
+  EXPECT_TRUE( atomic.compare_exchange_strong( expected, ql::make_shared<int>( 2 ) ) );
+  EXPECT_EQ( *atomic.load(), 2 );
+
+  // The replaced value lives on in the pointers already loaded
+  expected.reset();
+  EXPECT_EQ( *first, 1 );
+  EXPECT_TRUE( first.unique() );
+
+  // Enough loads to spend the references held in advance several times
+  for ( int i = 0; i < 50'000; i++ )
+    EXPECT_EQ( *atomic.load(), 2 );
+
+  // A Reader keeps its reference until it sees the pointer replaced
+  auto reader = atomic.reader();
+  EXPECT_EQ( *reader, 2 );
+
+  ql::SharedPtr<int> cached = reader.get();
+  atomic.store( ql::make_shared<int>( 3 ) );
+  EXPECT_EQ( *reader, 3 );
+  EXPECT_TRUE( cached.unique() );
+
+  ql::SharedPtr<int> previous = atomic.exchange( ql::SharedPtr<int>() );
+  EXPECT_EQ( *previous, 3 );
+  EXPECT_EQ( previous.use_count(), 2 );
+
+  reader.reset();
+  EXPECT_TRUE( previous.unique() );
+  EXPECT_FALSE( atomic.load() );
+}
+
+TEST( AtomicSharedPtr, ConcurrentReadersAndWriter )
+{
+  struct Config
+  {
+    int              version;
+    std::atomic<int>* destroyed;
+
+    ~Config() { destroyed->fetch_add( 1, std::memory_order_relaxed ); }
+  };
+
+  constexpr int versions = 2'000;
+
+  std::atomic<int> destroyed = 0;
+  {
+    ql::AtomicSharedPtr<Config> config = ql::make_shared<Config>( 0, &destroyed );
+    std::atomic<bool>           done   = false;
+
+    auto read = [&]
+    {
+      int last = 0;
+      while ( !done.load( std::memory_order_relaxed ) )
+      {
+        // Versions are published in order, so a reader never goes back
+        ql::SharedPtr<Config> current = config.load();
+        EXPECT_GE( current->version, last );
+        last = current->version;
+      }
+    };
+
+    auto read_cached = [&]
+    {
+      auto reader = config.reader();
+
+      int last = 0;
+      while ( !done.load( std::memory_order_relaxed ) )
+      {
+        EXPECT_GE( reader->version, last );
+        last = reader->version;
+      }
+    };
+
+    ql::Thread a = read;
+    ql::Thread b = read;
+    ql::Thread c = read_cached;
+
+    for ( int version = 1; version <= versions; version++ )
+      config.store( ql::make_shared<Config>( version, &destroyed ) );
+
+    done = true;
+  }
+
+  EXPECT_EQ( destroyed.load(), versions + 1 );
+}
+
+TEST( RefPtr, AdoptAndRetain )
+{
+  struct Node : ql::RefCounted<Node>
+  {
+    ql::RefPtr<Node> child;
+  };
+
+  ql::RefPtr<Node> root = ql::make_ref<Node>();
+  EXPECT_EQ( root->ref_count(), 1u );
+
+  root->child = ql::make_ref<Node>();
+  ql::RefPtr<Node> child = root->child->ref_from_this();
+  EXPECT_EQ( child->ref_count(), 2u );
+  EXPECT_EQ( sizeof( child ), sizeof( Node* ) );
+
+  root.reset();
+  EXPECT_EQ( child->ref_count(), 1u );
+
+  Node* raw = child.detach();
+  EXPECT_FALSE( child );
+
+  child = ql::RefPtr<Node>::adopt( raw );
+  EXPECT_EQ( child->ref_count(), 1u );
+}
+
+// Released objects return to a free list rather than being deleted
+struct Pooled : ql::RefCounted<Pooled, ql::LocalRefCount>
+{
+  static inline ql::Vector<Pooled*> pool;
+
+  static void destroy( Pooled* object ) { pool.push_back( object ); }
+};
+
+TEST( RefPtr, DestroyHook )
+{
+  Pooled object;
+  {
+    ql::RefPtr<Pooled> a = ql::RefPtr<Pooled>::adopt( &object );
+    ql::RefPtr<Pooled> b = a;
+  }
+
+  ASSERT_EQ( Pooled::pool.size(), 1u );
+  EXPECT_EQ( Pooled::pool[ 0 ], &object );
+
+  // Reused objects are retained from zero
+  ql::RefPtr<Pooled> reused = ql::RefPtr<Pooled>::retain( Pooled::pool[ 0 ] );
+  Pooled::pool.clear();
+  EXPECT_EQ( reused->ref_count(), 1u );
+
+  reused.reset();
+  EXPECT_EQ( Pooled::pool.size(), 1u );
+  Pooled::pool = {};
+}
+
+TEST( Function, InlineAndAllocated )
+{
+  ql::SharedPtr<int> counter = ql::make_shared<int>( 0 );
+
+  auto small = [counter]() mutable { return ++*counter; };
+  auto large = [counter, padding = std::array<long, 8>()]() mutable { return ++*counter + int( padding[ 0 ] ); };
+
+  ql::Function<int()> a = small;
+  ql::Function<int()> b = large;
+  EXPECT_NE( a.target<decltype( small )>(), nullptr );
+  EXPECT_EQ( a.target<decltype( large )>(), nullptr );
+  EXPECT_NE( b.target<decltype( large )>(), nullptr );
+  EXPECT_EQ( counter.use_count(), 5u );
+
+  {
+    ql::Function<int()> copy  = b;
+    ql::Function<int()> moved = ql::move( a );
+    EXPECT_FALSE( a );
+    EXPECT_EQ( counter.use_count(), 6u );
+
+    EXPECT_EQ( copy(), 1 );
+    EXPECT_EQ( moved(), 2 );
+    EXPECT_EQ( b(), 3 );
+
+    a = ql::move( copy );
+  }
+
+  EXPECT_EQ( a(), 4 );
+  EXPECT_EQ( counter.use_count(), 5u );
+
+  a = nullptr;
+  b = nullptr;
+  EXPECT_EQ( counter.use_count(), 3u );
+}
+
+TEST( Function, FunctionPointers )
+{
+  int ( *pointer )( int ) = nullptr;
+
+  ql::Function<int( int )> f = pointer;
+  EXPECT_FALSE( f );
+
+  f = []( int x ) { return x * 2; };
+  EXPECT_EQ( f( 21 ), 42 );
+
+  ql::Function g = +[]( int x ) { return x + 1; };
+  EXPECT_EQ( g( 1 ), 2 );
+}
+
+TEST( MoveOnlyFunction, OwnsMoveOnlyState )
+{
+  ql::UniquePtr<int> owned = ql::make_unique<int>( 5 );
+  int*               raw   = owned.get();
+
+  ql::MoveOnlyFunction<int( int )> f = [owned = ql::move( owned )]( int x ) { return *owned + x; };
+  EXPECT_EQ( f( 1 ), 6 );
+
+  // Relocated without copying the capture
+  ql::MoveOnlyFunction<int( int )> g = ql::move( f );
+  EXPECT_FALSE( f );
+  EXPECT_EQ( g( 2 ), 7 );
+  EXPECT_TRUE( std::is_nothrow_move_constructible_v<decltype( g )> );
+
+  // Large captures are allocated, and moved by pointer
+  std::array<long, 16> large {};
+  large[ 15 ] = 10;
+
+  ql::MoveOnlyFunction<long()> h = [large, check = ql::make_unique<int*>( raw )] { return large[ 15 ] + **check; };
+  ql::MoveOnlyFunction<long()> i = ql::move( h );
+  EXPECT_EQ( i(), 15 );
+
+  // Threads take them too
+  int result = 0;
+  {
+    ql::Thread thread = [&result, g = ql::move( g )] { result = g( 10 ); };
+  }
+
+  EXPECT_EQ( result, 15 );
+}
+
+int twice( int x ) { return 2 * x; }
+
+TEST( FunctionRef, Binding )
+{
+  auto apply = []( ql::FunctionRef<int( int )> f, int x ) { return f( x ); };
+
+  int        calls   = 0;
+  const auto counted = [&calls]( int x ) { calls++; return x + 1; };
+
+  EXPECT_EQ( apply( counted, 1 ), 2 );
+  EXPECT_EQ( apply( [&]( int x ) { return x * calls; }, 5 ), 5 );
+  EXPECT_EQ( apply( twice, 4 ), 8 );
+  EXPECT_EQ( apply( &twice, 5 ), 10 );
+  EXPECT_EQ( calls, 1 );
+
+  ql::FunctionRef<int( int )> ref = counted;
+  EXPECT_EQ( sizeof( ref ), 2 * sizeof( void* ) );
+  EXPECT_TRUE( std::is_trivially_copyable_v<decltype( ref )> );
+}
+
+TEST( EventDispatcher, FireAndUnsubscribe )
+{
+  ql::EventDispatcher<void( int )> event;
+  ql::Vector<int>                  calls;
+
+  auto first  = event.subscribe( [&]( int x ) { calls.push_back( x ); } );
+  auto second = event.subscribe( [&]( int x ) { calls.push_back( x * 10 ); } );
+  event.subscribe( [&]( int x ) { calls.push_back( x * 100 ); } );
+
+  event( 1 );
+  ASSERT_EQ( calls.size(), 3 );
+  EXPECT_EQ( calls[ 0 ], 1 );
+  EXPECT_EQ( calls[ 1 ], 10 );
+  EXPECT_EQ( calls[ 2 ], 100 );
+
+  event.unsubscribe( second );
+  EXPECT_EQ( event.size(), 2 );
+
+  // A stale handle is ignored, even once its slot is reused
+  event.subscribe( [&]( int x ) { calls.push_back( -x ); } );
+  event.unsubscribe( second );
+  EXPECT_EQ( event.size(), 3 );
+
+  calls.clear();
+  event( 2 );
+  ASSERT_EQ( calls.size(), 3 );
+  EXPECT_EQ( calls[ 0 ], 2 );
+  EXPECT_EQ( calls[ 1 ], 200 );
+  EXPECT_EQ( calls[ 2 ], -2 );
+
+  event.unsubscribe( first );
+  event.clear();
+  EXPECT_TRUE( event.empty() );
+
+  calls.clear();
+  event( 3 );
+  EXPECT_TRUE( calls.empty() );
+}
+
+TEST( EventDispatcher, GrowthRelocatesListeners )
+{
+  ql::EventDispatcher<void()> event;
+  ql::SharedPtr<int>          counter = ql::make_shared<int>( 0 );
+
+  ql::Vector<ql::EventDispatcher<void()>::Handle> handles;
+  for ( int i = 0; i < 200; i++ )
+    handles.push_back( event.subscribe( [counter]() mutable { ( *counter )++; } ) );
+
+  // Every listener owns a reference, moved rather than copied on growth
+  EXPECT_EQ( counter.use_count(), 201 );
+
+  event.fire();
+  EXPECT_EQ( *counter, 200 );
+
+  for ( std::size_t i = 0; i < handles.size(); i += 2 )
+    event.unsubscribe( handles[ i ] );
+
+  EXPECT_EQ( counter.use_count(), 101 );
+
+  // Listeners may unsubscribe themselves, and stay alive until firing ends
+  ql::EventDispatcher<void()>::Handle self;
+  self = event.subscribe( [&event, &self, counter]
+  {
+    event.unsubscribe( self );
+    EXPECT_EQ( counter.use_count(), 102 );
+  } );
+
+  event.fire();
+  EXPECT_EQ( *counter, 300 );
+  EXPECT_EQ( counter.use_count(), 101 );
+  EXPECT_EQ( event.size(), 100 );
+
+  // Growing drops the dead listeners
+  const std::size_t bytes = event.arena_bytes();
+  for ( int i = 0; i < 200; i++ )
+    event.subscribe( [counter] {} );
+
+  EXPECT_LT( event.arena_bytes(), bytes * 3 );
+  EXPECT_EQ( counter.use_count(), 301 );
+
+  event.clear();
+  EXPECT_EQ( counter.use_count(), 1 );
+}
+
+TEST( EventDispatcher, ListenerThrows )
+{
+  ql::EventDispatcher<void()> event;
+  ql::SharedPtr<int>          counter = ql::make_shared<int>( 0 );
+
+  ql::EventDispatcher<void()>::Handle self;
+  self = event.subscribe( [&event, &self, counter]
+  {
+    event.unsubscribe( self );
+    throw 1;
+  } );
+
+  // The listener unsubscribed before throwing is still destroyed
+  EXPECT_THROW( event.fire(), int );
+  EXPECT_EQ( counter.use_count(), 1 );
+
+  // And the event is no longer firing
+  event.subscribe( [counter]() mutable { ( *counter )++; } );
+  event.fire();
+  EXPECT_EQ( *counter, 1 );
+}
+
+TEST( InplaceFunction, StoresInline )
+{
+  int    calls  = 0;
+  double scale  = 2.5;
+  long   offset = 4;
+
+  ql::InplaceFunction<double( int )> f = [&calls, scale, offset]( int x )
+  {
+    calls++;
+    return x * scale + offset;
+  };
+
+  EXPECT_EQ( sizeof( f ), 2 * sizeof( void* ) + decltype( f )::capacity );
+  EXPECT_DOUBLE_EQ( f( 2 ), 9.0 );
+
+  auto copy  = f;
+  auto moved = ql::move( f );
+  EXPECT_FALSE( f );
+  EXPECT_DOUBLE_EQ( copy( 4 ), 14.0 );
+  EXPECT_DOUBLE_EQ( moved( 0 ), 4.0 );
+  EXPECT_EQ( calls, 3 );
+
+  ql::InplaceFunction<int( int, int )> pointer = +[]( int a, int b ) { return a - b; };
+  EXPECT_EQ( pointer( 7, 2 ), 5 );
+
+  // Like Function, a null pointer leaves it empty
+  pointer = static_cast<int ( * )( int, int )>( nullptr );
+  EXPECT_FALSE( pointer );
+}
+
+TEST( InplaceFunction, NonTrivialCallable )
+{
+  ql::SharedPtr<int> counter = ql::make_shared<int>( 0 );
+
+  // A capture that must be copied and destroyed properly
+  ql::InplaceFunction<void(), 64> f = [counter]() mutable { ( *counter )++; };
+  EXPECT_EQ( counter.use_count(), 2u );
+  {
+    ql::InplaceFunction<void(), 64> copy = f;
+    ql::InplaceFunction<void(), 64> moved = ql::move( copy );
+    EXPECT_EQ( counter.use_count(), 3u );
+
+    moved();
+    f();
+  }
+
+  EXPECT_EQ( *counter, 2 );
+  EXPECT_EQ( counter.use_count(), 2u );
+
+  f = nullptr;
+  EXPECT_TRUE( counter.unique() );
+}
+
 TEST( Variant, TypeChecking )
 {
   ql::Variant<int, float> variant = 66.67f;
@@ -115,6 +621,74 @@ TEST( Vector, Reallocation )
   }
 }
 
+TEST( Vector, InsertAndErase )
+{
+  ql::Vector<std::string> v = { "b", "d" };
+
+  v.insert( v.begin(), "a" );
+  v.insert( v.begin() + 2, "c" );
+  v.insert( v.end(), 2, v.front() );
+
+  const ql::Vector<std::string> expected = { "a", "b", "c", "d", "a", "a" };
+  EXPECT_TRUE( std::equal( v.begin(), v.end(), expected.begin(), expected.end() ) );
+
+  v.erase( v.begin() + 4, v.end() );
+  v.erase( v.begin() );
+  EXPECT_EQ( v.size(), 3 );
+  EXPECT_EQ( v.front(), "b" );
+
+  v.clear();
+  EXPECT_TRUE( v.empty() );
+}
+
+TEST( Vector, OverAligned )
+{
+  struct alignas( 64 ) Lane
+  {
+    float values[ 16 ];
+  };
+
+  ql::Vector<Lane> lanes;
+  for ( int i = 0; i < 5; i++ )
+  {
+    lanes.emplace_back();
+    EXPECT_EQ( reinterpret_cast<std::uintptr_t>( lanes.data() ) % 64, 0 );
+  }
+
+  // Page aligned, and padded to a whole number of pages
+  ql::Vector<float, ql::AlignedAllocator<float, 4096>> buffer;
+  buffer.reserve( 1000 );
+  EXPECT_EQ( reinterpret_cast<std::uintptr_t>( buffer.data() ) % 4096, 0 );
+  EXPECT_EQ( buffer.capacity(), 1024 );
+
+  // Rebinding, as List does for its nodes, keeps the alignment
+  using rebound = std::allocator_traits<ql::AlignedAllocator<int, 128>>::rebind_alloc<double>;
+  EXPECT_EQ( rebound::alignment, 128 );
+
+  ql::List<int, ql::AlignedAllocator<int, 128>> list = { 1, 2 };
+  EXPECT_EQ( list.size(), 2 );
+}
+
+TEST( String, InlineAndAllocated )
+{
+  ql::String empty;
+  EXPECT_TRUE( empty.empty() );
+  EXPECT_STREQ( empty.c_str(), "" );
+
+  ql::String shortString = "short";
+  ql::String longString  = "a string too long for the inline buffer";
+
+  // Moving an inline string must not leave it pointing into the source
+  ql::String movedShort = ql::move( shortString );
+  ql::String movedLong  = ql::move( longString );
+  shortString = "overwritten";
+
+  EXPECT_EQ( movedShort, "short" );
+  EXPECT_EQ( movedLong, "a string too long for the inline buffer" );
+  EXPECT_EQ( movedShort.end() - movedShort.begin(), 5 );
+  EXPECT_TRUE( longString.empty() );
+}
+
 TEST( Variant, Visit )
 {
   ql::Variant<int, float> variant = 66.67f;
@@ -149,3 +723,1273 @@ TEST( Variant, Match )
     []( float f ) { std::cout << "variant<float> = " << f << std::endl; }
   );
 }
+
+TEST( IntrusiveList, LinkAndUnlink )
+{
+  struct Timer : ql::ListHook<>
+  {
+    int deadline = 0;
+  };
+
+  Timer timers[ 4 ];
+  ql::IntrusiveList<Timer> list;
+
+  for ( int i = 0; i < 4; i++ )
+  {
+    timers[ i ].deadline = i;
+    list.push_back( timers[ i ] );
+  }
+
+  EXPECT_EQ( list.size(), 4 );
+  EXPECT_TRUE( timers[ 2 ].is_linked() );
+
+  list.remove( timers[ 2 ] );
+  EXPECT_FALSE( timers[ 2 ].is_linked() );
+
+  int expected[] = { 0, 1, 3 };
+  int i = 0;
+  for ( Timer& timer : list )
+  {
+    EXPECT_EQ( timer.deadline, expected[ i++ ] );
+  }
+
+  EXPECT_EQ( i, 3 );
+  EXPECT_EQ( &list.front(), &timers[ 0 ] );
+  EXPECT_EQ( &list.back(), &timers[ 3 ] );
+
+  list.clear();
+  EXPECT_FALSE( timers[ 0 ].is_linked() );
+}
+
+TEST( IntrusiveList, Splice )
+{
+  struct Entry
+  {
+    int                 value = 0;
+    ql::ListHook<>      hook;
+  };
+
+  using list_type = ql::IntrusiveList<Entry, &Entry::hook>;
+
+  Entry entries[ 6 ];
+  list_type a, b;
+
+  for ( int i = 0; i < 6; i++ )
+  {
+    entries[ i ].value = i;
+    ( i < 3 ? a : b ).push_back( entries[ i ] );
+  }
+
+  // Move the last element of b to the front of a
+  a.splice( a.begin(), b, b.iterator_to( entries[ 5 ] ) );
+  EXPECT_EQ( a.front().value, 5 );
+  EXPECT_EQ( a.size(), 4 );
+  EXPECT_EQ( b.size(), 2 );
+
+  a.splice( a.end(), b );
+  EXPECT_TRUE( b.empty() );
+  EXPECT_EQ( a.size(), 6 );
+
+  int expected[] = { 5, 0, 1, 2, 3, 4 };
+  int i = 0;
+  for ( const Entry& entry : a )
+  {
+    EXPECT_EQ( entry.value, expected[ i++ ] );
+  }
+
+  a.clear();
+}
+
+template<typename Hook>
+concept self_unlinkable = requires( Hook& hook ) { hook.unlink(); };
+
+TEST( IntrusiveList, AutoUnlink )
+{
+  struct Waiter : ql::ListHook<ql::LinkMode::auto_unlink>
+  {
+  };
+
+  ql::IntrusiveList<Waiter> list;
+
+  Waiter first;
+  {
+    Waiter second;
+    list.push_back( first );
+    list.push_back( second );
+    EXPECT_EQ( list.size(), 2 );
+  }
+
+  EXPECT_EQ( list.size(), 1 );
+  EXPECT_EQ( &list.front(), &first );
+
+  // Hooks may unlink themselves without the list's knowledge
+  Waiter third;
+  list.push_back( third );
+  first.unlink();
+  EXPECT_FALSE( first.is_linked() );
+  EXPECT_EQ( list.size(), 1 );
+  EXPECT_EQ( &list.front(), &third );
+
+  // But only auto_unlink ones, as other lists count their elements
+  static_assert( !self_unlinkable<ql::ListHook<>> && self_unlinkable<Waiter> );
+}
+
+TEST( UnrolledList, InsertAndErase )
+{
+  using list_type = ql::UnrolledList<int, 64>;
+  static_assert( list_type::node_capacity > 1 );
+
+  list_type list;
+  for ( int i = 0; i < 100; i++ )
+    list.push_back( i * 2 );
+
+  // Insert the odd numbers in between, splitting nodes as they fill up
+  for ( auto it = list.begin(); it != list.end(); ++it )
+  {
+    int value = *it + 1;
+    it = list.insert( ++it, value );
+  }
+
+  EXPECT_EQ( list.size(), 200 );
+
+  int expected = 0;
+  for ( int value : list )
+    EXPECT_EQ( value, expected++ );
+
+  // Erase the odd numbers again, merging sparse nodes
+  for ( auto it = list.begin(); it != list.end(); )
+  {
+    if ( *it % 2 != 0 )
+      it = list.erase( it );
+    else
+      ++it;
+  }
+
+  EXPECT_EQ( list.size(), 100 );
+
+  expected = 198;
+  for ( auto it = list.end(); it != list.begin(); )
+  {
+    --it;
+    EXPECT_EQ( *it, expected );
+    expected -= 2;
+  }
+}
+
+TEST( UnrolledList, FrontAndBack )
+{
+  ql::UnrolledList<std::string> list = { "b", "c" };
+
+  list.push_front( "a" );
+  list.push_back( "d" );
+  EXPECT_EQ( list.front(), "a" );
+  EXPECT_EQ( list.back(), "d" );
+
+  list.pop_front();
+  list.pop_back();
+  EXPECT_EQ( list.size(), 2 );
+  EXPECT_EQ( list.front(), "b" );
+  EXPECT_EQ( list.back(), "c" );
+}
+
+TEST( List, Sort )
+{
+  struct Entry
+  {
+    int key;
+    int order;
+  };
+
+  ql::List<Entry> list;
+  for ( int i = 0; i < 1000; i++ )
+    list.push_back( { ( i * 7919 ) % 101, i } );
+
+  const Entry* first = &*list.begin();
+
+  list.sort( []( const Entry& lhs, const Entry& rhs ) { return lhs.key < rhs.key; } );
+  EXPECT_EQ( list.size(), 1000 );
+
+  // Sorting relinks nodes, items never move
+  bool found = false;
+  for ( const Entry& entry : list )
+    found = found || &entry == first;
+
+  EXPECT_TRUE( found );
+
+  // Sorted by key, and stable among equal keys
+  auto it = list.begin();
+  Entry previous = *it;
+  for ( ++it; it != list.end(); ++it )
+  {
+    EXPECT_TRUE( previous.key < it->key || ( previous.key == it->key && previous.order < it->order ) );
+    previous = *it;
+  }
+}
+
+TEST( List, MergeAndSplice )
+{
+  ql::List<int> a = { 1, 3, 5, 7 };
+  ql::List<int> b = { 2, 4, 6, 8, 9 };
+
+  a.merge( b );
+  EXPECT_TRUE( b.empty() );
+  EXPECT_EQ( a.size(), 9 );
+
+  int expected = 1;
+  for ( int value : a )
+    EXPECT_EQ( value, expected++ );
+
+  ql::List<int> c = { 10, 11 };
+  a.splice( a.begin(), c );
+  EXPECT_TRUE( c.empty() );
+  EXPECT_EQ( *a.begin(), 10 );
+  EXPECT_EQ( a.size(), 11 );
+
+  // Move 10 back to the end of c
+  c.splice( c.end(), a, a.begin() );
+  EXPECT_EQ( a.size(), 10 );
+  EXPECT_EQ( c.size(), 1 );
+  EXPECT_EQ( *a.begin(), 11 );
+  EXPECT_EQ( *c.begin(), 10 );
+}
+
+TEST( List, UniqueAndReverse )
+{
+  ql::List<int> list = { 1, 1, 2, 3, 3, 3, 4 };
+
+  EXPECT_EQ( list.unique(), 3 );
+  EXPECT_EQ( list.size(), 4 );
+
+  list.reverse();
+
+  int expected = 4;
+  for ( int value : list )
+    EXPECT_EQ( value, expected-- );
+
+  EXPECT_EQ( expected, 0 );
+}
+
+// Counts the allocations that reach it before forwarding them upstream
+class CountingResource : public ql::MemoryResource
+{
+public:
+
+  std::size_t allocations   = 0;
+  std::size_t deallocations = 0;
+
+private:
+
+  void* do_allocate( std::size_t bytes, std::size_t alignment ) override
+  {
+    allocations++;
+    return ql::new_delete_resource()->allocate( bytes, alignment );
+  }
+
+  void do_deallocate( void* memory, std::size_t bytes, std::size_t alignment ) override
+  {
+    deallocations++;
+    ql::new_delete_resource()->deallocate( memory, bytes, alignment );
+  }
+
+  bool do_is_equal( const ql::MemoryResource& other ) const override
+  {
+    return this == &other;
+  }
+};
+
+TEST( List, ThrowingConstructorFreesNode )
+{
+  struct Throws
+  {
+    Throws( int value )
+    {
+      if ( value < 0 )
+        throw value;
+    }
+  };
+
+  CountingResource      resource;
+  ql::pmr::List<Throws> list( &resource );
+
+  list.emplace_back( 1 );
+  EXPECT_THROW( list.emplace_back( -1 ), int );
+
+  EXPECT_EQ( list.size(), 1 );
+  EXPECT_EQ( resource.allocations - resource.deallocations, 1 );
+}
+
+TEST( MonotonicBufferResource, InitialBufferAndGrowth )
+{
+  CountingResource upstream;
+  alignas( std::max_align_t ) std::byte buffer[ 256 ];
+
+  {
+    ql::MonotonicBufferResource arena( buffer, sizeof( buffer ), &upstream );
+
+    void* first = arena.allocate( 100, 1 );
+    EXPECT_EQ( first, buffer );
+
+    void* aligned = arena.allocate( 8, 64 );
+    EXPECT_EQ( reinterpret_cast<std::uintptr_t>( aligned ) % 64, 0 );
+    EXPECT_EQ( upstream.allocations, 0 );
+
+    // Exhaust the buffer, spilling into upstream chunks
+    for ( int i = 0; i < 100; i++ )
+    {
+      void* p = arena.allocate( 64, 16 );
+      EXPECT_EQ( reinterpret_cast<std::uintptr_t>( p ) % 16, 0 );
+    }
+
+    EXPECT_GT( upstream.allocations, 0 );
+    EXPECT_LT( upstream.allocations, 4 );
+
+    arena.release();
+    EXPECT_EQ( upstream.deallocations, upstream.allocations );
+    EXPECT_EQ( arena.allocate( 1, 1 ), buffer );
+  }
+
+  EXPECT_EQ( upstream.deallocations, upstream.allocations );
+}
+
+TEST( MonotonicBufferResource, ScopedRewind )
+{
+  CountingResource upstream;
+  ql::MonotonicBufferResource arena( 1024, &upstream );
+
+  void* persistent = arena.allocate( 32 );
+
+  void* firstFrame = nullptr;
+  for ( int frame = 0; frame < 10; frame++ )
+  {
+    ql::ScopedArena scope( arena );
+
+    void* p = scope.allocate( 64 );
+    if ( frame == 0 )
+      firstFrame = p;
+
+    // Every frame starts from the same place
+    EXPECT_EQ( p, firstFrame );
+    EXPECT_NE( p, persistent );
+
+    // Grow well past the first chunk
+    for ( int i = 0; i < 100; i++ )
+      EXPECT_NE( scope.allocate( 256 ), nullptr );
+  }
+
+  // Chunks acquired by the first frame are reused by later ones
+  const std::size_t allocations = upstream.allocations;
+  {
+    ql::ScopedArena scope( arena );
+    for ( int i = 0; i < 100; i++ )
+      EXPECT_NE( scope.allocate( 256 ), nullptr );
+  }
+
+  EXPECT_EQ( upstream.allocations, allocations );
+}
+
+TEST( PoolResource, ReusesBlocks )
+{
+  CountingResource upstream;
+  ql::UnsynchronizedPoolResource pool( ql::PoolOptions { .largest_required_pool_block = 256 }, &upstream );
+
+  void* a = pool.allocate( 24, 8 );
+  void* b = pool.allocate( 24, 8 );
+  EXPECT_NE( a, b );
+  EXPECT_EQ( upstream.allocations, 1 );
+
+  pool.deallocate( a, 24, 8 );
+  EXPECT_EQ( pool.allocate( 20, 8 ), a );
+
+  // Blocks are aligned to their size class
+  void* aligned = pool.allocate( 8, 64 );
+  EXPECT_EQ( reinterpret_cast<std::uintptr_t>( aligned ) % 64, 0 );
+
+  // Anything larger than the largest pool goes straight upstream
+  const std::size_t before = upstream.allocations;
+  void* large = pool.allocate( 1000 );
+  EXPECT_EQ( upstream.allocations, before + 1 );
+
+  pool.deallocate( large, 1000 );
+  EXPECT_EQ( upstream.deallocations, 1 );
+
+  pool.release();
+  EXPECT_EQ( upstream.deallocations, upstream.allocations );
+}
+
+TEST( PoolResource, Statistics )
+{
+  ql::UnsynchronizedPoolResource pool;
+
+  void* blocks[ 8 ];
+  for ( void*& block : blocks )
+    block = pool.allocate( 40 );
+
+  ql::PoolStatistics stats = pool.statistics();
+  EXPECT_EQ( stats.allocations, 8 );
+  EXPECT_EQ( stats.bytes_requested, 8 * 40 );
+  EXPECT_EQ( stats.bytes_in_use, 8 * 64 );
+  EXPECT_DOUBLE_EQ( stats.internal_fragmentation(), 1.0 - 40.0 / 64.0 );
+  EXPECT_GE( stats.bytes_reserved, stats.bytes_in_use );
+
+  for ( void* block : blocks )
+    pool.deallocate( block, 40 );
+
+  stats = pool.statistics();
+  EXPECT_EQ( stats.bytes_in_use, 0 );
+  EXPECT_EQ( stats.peak_bytes_in_use, 8 * 64 );
+  EXPECT_DOUBLE_EQ( stats.external_fragmentation(), 1.0 );
+}
+
+TEST( PoolResource, Synchronized )
+{
+  ql::SynchronizedPoolResource pool;
+
+  auto churn = [&]
+  {
+    void* blocks[ 64 ];
+    for ( int round = 0; round < 100; round++ )
+    {
+      for ( std::size_t i = 0; i < 64; i++ )
+        blocks[ i ] = pool.allocate( 16 + i * 8 );
+
+      for ( std::size_t i = 0; i < 64; i++ )
+        pool.deallocate( blocks[ i ], 16 + i * 8 );
+    }
+  };
+
+  {
+    ql::Thread threads[ 4 ];
+    for ( ql::Thread& thread : threads )
+      thread = churn;
+  }
+
+  ql::PoolStatistics stats = pool.statistics();
+  EXPECT_EQ( stats.allocations, 4 * 100 * 64 );
+  EXPECT_EQ( stats.bytes_in_use, 0 );
+}
+
+TEST( ThreadLocal, PerThreadInstances )
+{
+  struct Counter
+  {
+    int value = 0;
+  };
+
+  ql::ThreadLocal<Counter> counter;
+  counter->value = 1;
+
+  {
+    ql::Thread threads[ 4 ];
+    for ( ql::Thread& thread : threads )
+      thread = [&] { counter->value += 10; };
+  }
+
+  // Instances of exited threads are gone, the main thread's is untouched
+  int instances = 0;
+  counter.for_each( [&]( Counter& ) { instances++; } );
+  EXPECT_EQ( instances, 1 );
+  EXPECT_EQ( counter->value, 1 );
+}
+
+TEST( ThreadLocal, ReusedIndex )
+{
+  {
+    ql::ThreadLocal<int> first;
+    *first = 5;
+  }
+
+  // A new ThreadLocal may take the destroyed one's place in this thread's
+  // table, but never its instance
+  ql::ThreadLocal<int> second;
+  EXPECT_EQ( *second, 0 );
+
+  *second = 7;
+  second.clear();
+  EXPECT_EQ( *second, 0 );
+}
+
+TEST( Thread, JoinIsIdempotent )
+{
+  std::atomic<int> runs = 0;
+
+  ql::Thread thread = [&] { runs++; };
+  thread.join();
+  thread.join();
+
+  // Reassigning after a join starts a fresh thread
+  thread = [&] { runs++; };
+  thread.join();
+
+  EXPECT_EQ( runs, 2 );
+}
+
+static void parallel_sum( ql::ThreadPool& pool, const std::uint64_t* values, std::size_t count, std::atomic<std::uint64_t>& sum )
+{
+  if ( count <= 64 )
+  {
+    std::uint64_t local = 0;
+    for ( std::size_t i = 0; i < count; i++ )
+      local += values[ i ];
+
+    sum.fetch_add( local, std::memory_order_relaxed );
+    return;
+  }
+
+  // Fork the upper half, then help until it's done
+  const std::size_t half = count / 2;
+  std::atomic<bool> done = false;
+
+  pool.spawn( [&]
+  {
+    parallel_sum( pool, values + half, count - half, sum );
+    done.store( true, std::memory_order_release );
+  } );
+
+  parallel_sum( pool, values, half, sum );
+  pool.help_until( [&] { return done.load( std::memory_order_acquire ); } );
+}
+
+TEST( ThreadPool, ForkJoin )
+{
+  ql::ThreadPool pool( 4 );
+  EXPECT_EQ( pool.size(), 4 );
+  EXPECT_EQ( pool.worker_index(), 4 );
+
+  ql::Vector<std::uint64_t> values;
+  for ( std::uint64_t i = 0; i < 100'000; i++ )
+    values.push_back( i );
+
+  std::atomic<std::uint64_t> sum = 0;
+  std::atomic<bool>          done = false;
+
+  // The calling thread helps too, so may run some of the tasks itself
+  pool.spawn( [&]
+  {
+    parallel_sum( pool, values.data(), values.size(), sum );
+    done = true;
+  } );
+
+  pool.help_until( [&] { return done.load(); } );
+  EXPECT_EQ( sum, 99'999ull * 100'000 / 2 );
+}
+
+TEST( ThreadPool, DrainsOnDestruction )
+{
+  std::atomic<int> runs = 0;
+
+  {
+    ql::ThreadPool pool( 2 );
+
+    // Move-only tasks, some spawning more from the workers
+    for ( int i = 0; i < 1000; i++ )
+    {
+      pool.spawn( [&, owned = ql::make_unique<int>( i )]
+      {
+        runs++;
+        if ( *owned % 10 == 0 )
+          pool.spawn( [&] { runs++; } );
+      } );
+    }
+  }
+
+  EXPECT_EQ( runs, 1100 );
+}
+
+TEST( TaskGraph, RunsInDependencyOrder )
+{
+  ql::ThreadPool pool( 3 );
+  ql::TaskGraph  graph;
+
+  // Each task records the step it finished at
+  std::atomic<int> step = 0;
+  std::array<std::atomic<int>, 6> finished {};
+
+  auto record = [&]( int task ) { return [&, task] { finished[ task ] = ++step; }; };
+
+  auto input   = graph.add( "input", record( 0 ) );
+  auto physics = graph.add( "physics", record( 1 ), { input } );
+  auto audio   = graph.add( "audio", record( 2 ), { input } );
+  auto animate = graph.add( "animate", record( 3 ), { input } );
+  auto render  = graph.add( "render", record( 4 ), { physics, animate } );
+  auto present = graph.add( "present", record( 5 ) );
+  graph.precede( render, present );
+  graph.precede( audio, present );
+
+  for ( int run = 0; run < 50; run++ )
+  {
+    step = 0;
+    graph.run( pool );
+
+    EXPECT_EQ( step, 6 );
+    EXPECT_LT( finished[ 0 ], finished[ 1 ] );
+    EXPECT_LT( finished[ 0 ], finished[ 2 ] );
+    EXPECT_LT( finished[ 3 ], finished[ 4 ] );
+    EXPECT_LT( finished[ 1 ], finished[ 4 ] );
+    EXPECT_EQ( finished[ 5 ], 6 );
+  }
+}
+
+TEST( TaskGraph, CriticalPath )
+{
+  ql::ThreadPool pool( 2 );
+  ql::TaskGraph  graph;
+
+  auto sleep = []( int ms ) { return [ms] { std::this_thread::sleep_for( std::chrono::milliseconds( ms ) ); }; };
+
+  auto load    = graph.add( "load", sleep( 2 ) );
+  auto decode  = graph.add( "decode", sleep( 20 ), { load } );
+  auto log     = graph.add( "log", sleep( 1 ), { load } );
+  auto publish = graph.add( "publish", sleep( 1 ), { decode, log } );
+
+  graph.run( pool );
+
+  EXPECT_TRUE( graph.timing( load ).critical() );
+  EXPECT_TRUE( graph.timing( decode ).critical() );
+  EXPECT_TRUE( graph.timing( publish ).critical() );
+  EXPECT_FALSE( graph.timing( log ).critical() );
+  EXPECT_GE( graph.timing( log ).slack, graph.timing( decode ).duration - graph.timing( log ).duration );
+
+  EXPECT_GE( graph.critical_path_time(), 23'000'000 );
+  EXPECT_GE( graph.elapsed_time(), graph.critical_path_time() );
+  EXPECT_STREQ( graph.timing( decode ).name, "decode" );
+}
+
+static ql::Task<int> add_one( int x )
+{
+  co_return x + 1;
+}
+
+static ql::Task<int> count_to( int n )
+{
+  int value = 0;
+  for ( int i = 0; i < n; i++ )
+    value = co_await add_one( value );
+
+  co_return value;
+}
+
+static ql::Task<void> throw_after( int n )
+{
+  co_await count_to( n );
+  throw n;
+}
+
+TEST( Coroutine, TaskAndSyncWait )
+{
+  CountingResource frames;
+  ql::set_coroutine_resource( &frames );
+
+  EXPECT_EQ( ql::sync_wait( count_to( 10 ) ), 10 );
+
+  // One frame per task, and one for sync_wait itself
+  EXPECT_EQ( frames.allocations, 12 );
+  EXPECT_EQ( frames.deallocations, 12 );
+
+  ql::set_coroutine_resource( nullptr );
+
+  // Exceptions reach the awaiting coroutine, and from there the caller
+  EXPECT_THROW( ql::sync_wait( throw_after( 3 ) ), int );
+
+  // Tasks are lazy, so nothing runs until awaited
+  ql::Task<void> task = throw_after( 1 );
+  EXPECT_TRUE( task.valid() );
+  EXPECT_FALSE( task.done() );
+}
+
+static ql::Generator<std::uint64_t> fibonacci()
+{
+  std::uint64_t a = 0, b = 1;
+  for ( ;; )
+  {
+    co_yield a;
+    a = ql::exchange( b, a + b );
+  }
+}
+
+static ql::Generator<int> countdown( int from )
+{
+  for ( int i = from; i > 0; i-- )
+    co_yield i;
+}
+
+TEST( Coroutine, Generator )
+{
+  ql::Vector<std::uint64_t> values;
+  for ( std::uint64_t value : fibonacci() )
+  {
+    if ( values.size() == 10 )
+      break;
+
+    values.push_back( value );
+  }
+
+  ASSERT_EQ( values.size(), 10 );
+  EXPECT_EQ( values[ 2 ], 1 );
+  EXPECT_EQ( values[ 9 ], 34 );
+
+  int sum = 0;
+  for ( int value : countdown( 4 ) )
+    sum = sum * 10 + value;
+
+  EXPECT_EQ( sum, 4321 );
+}
+
+static ql::Task<int> square_on( ql::Scheduler& scheduler, int x )
+{
+  // when_any() leaves tasks running after the test's scheduler is gone,
+  // though not its pool
+  ql::ThreadPool& pool = scheduler.pool();
+  co_await scheduler.schedule();
+
+  // Now on one of the pool's workers
+  EXPECT_LT( pool.worker_index(), pool.size() );
+  co_return x * x;
+}
+
+static ql::Task<void> increment_on( ql::Scheduler& scheduler, std::atomic<int>& counter )
+{
+  co_await scheduler.schedule();
+  counter++;
+}
+
+TEST( Coroutine, SchedulerWhenAllAndAny )
+{
+  ql::ThreadPool pool( 3 );
+  ql::Scheduler  scheduler( pool );
+
+  ql::Vector<ql::Task<int>> squares;
+  for ( int i = 0; i < 20; i++ )
+    squares.push_back( square_on( scheduler, i ) );
+
+  ql::Vector<int> results = ql::sync_wait( ql::when_all( ql::move( squares ) ) );
+  ASSERT_EQ( results.size(), 20 );
+  for ( int i = 0; i < 20; i++ )
+    EXPECT_EQ( results[ i ], i * i );
+
+  std::atomic<int>           counter = 0;
+  ql::Vector<ql::Task<void>> increments;
+  for ( int i = 0; i < 10; i++ )
+    increments.push_back( increment_on( scheduler, counter ) );
+
+  ql::sync_wait( ql::when_all( ql::move( increments ) ) );
+  EXPECT_EQ( counter, 10 );
+
+  // The rest keep running after the first finishes
+  ql::Vector<ql::Task<int>> racers;
+  for ( int i = 0; i < 5; i++ )
+    racers.push_back( square_on( scheduler, i ) );
+
+  ql::WhenAny<int> first = ql::sync_wait( ql::when_any( ql::move( racers ) ) );
+  EXPECT_LT( first.index, 5 );
+  EXPECT_EQ( first.value, int( first.index * first.index ) );
+
+  // Detached tasks run on their own
+  for ( int i = 0; i < 10; i++ )
+    scheduler.spawn( increment_on( scheduler, counter ) );
+
+  while ( counter.load() != 20 )
+    std::this_thread::yield();
+}
+
+TEST( ThreadCachingResource, ReusesLocalBlocks )
+{
+  CountingResource upstream;
+
+  {
+    ql::ThreadCachingResource resource( &upstream );
+
+    void* a = resource.allocate( 24 );
+    resource.deallocate( a, 24 );
+    EXPECT_EQ( resource.allocate( 32 ), a );
+    EXPECT_EQ( resource.slab_count(), 1 );
+
+    EXPECT_EQ( ql::ThreadCachingResource::usable_size( 40, 8 ), 64 );
+
+    void* aligned = resource.allocate( 8, 128 );
+    EXPECT_EQ( reinterpret_cast<std::uintptr_t>( aligned ) % 128, 0 );
+
+    // Anything larger than the largest size class goes straight upstream
+    const std::size_t before = upstream.allocations;
+    void* large = resource.allocate( 4096 );
+    EXPECT_EQ( upstream.allocations, before + 1 );
+    resource.deallocate( large, 4096 );
+  }
+
+  EXPECT_EQ( upstream.deallocations, upstream.allocations );
+}
+
+TEST( ThreadCachingResource, CrossThreadFree )
+{
+  ql::ThreadCachingResource resource;
+
+  constexpr std::size_t count = 1000;
+  void* blocks[ count ];
+
+  for ( void*& block : blocks )
+    block = resource.allocate( 48 );
+
+  // Blocks freed on another thread find their way back to this one
+  {
+    ql::Thread consumer = [&]
+    {
+      for ( void* block : blocks )
+        resource.deallocate( block, 48 );
+    };
+  }
+
+  for ( void*& block : blocks )
+    block = resource.allocate( 48 );
+
+  EXPECT_EQ( resource.slab_count(), 1 );
+
+  for ( void* block : blocks )
+    resource.deallocate( block, 48 );
+
+  ql::Vector<int, ql::ThreadCachingAllocator<int>> vector;
+  for ( int i = 0; i < 100; i++ )
+    vector.push_back( i );
+
+  EXPECT_EQ( vector[ 99 ], 99 );
+}
+
+TEST( PolymorphicAllocator, NestedContainers )
+{
+  CountingResource upstream;
+
+  {
+    ql::MonotonicBufferResource arena( &upstream );
+
+    // Nothing below may fall back on the default resource
+    ql::MemoryResource* previous = ql::set_default_resource( ql::null_memory_resource() );
+
+    ql::pmr::Vector<ql::pmr::String> names( &arena );
+    names.emplace_back( "a string too long for the inline buffer" );
+    names.emplace_back( "short" );
+    EXPECT_EQ( names[ 0 ].get_allocator().resource(), &arena );
+
+    ql::pmr::List<ql::pmr::Vector<int>> lists( &arena );
+    lists.emplace_back().push_back( 1 );
+    EXPECT_EQ( lists.begin()->get_allocator().resource(), &arena );
+
+    ql::pmr::Vector<ql::pmr::String> copy( names, &arena );
+    EXPECT_EQ( copy[ 0 ], "a string too long for the inline buffer" );
+    EXPECT_EQ( copy[ 1 ].get_allocator(), names.get_allocator() );
+
+    ql::set_default_resource( previous );
+  }
+
+  EXPECT_EQ( upstream.allocations, 1 );
+}
+
+TEST( Memory, AllocateShared )
+{
+  CountingResource counting;
+
+  ql::WeakPtr<ql::pmr::Vector<int>> weak;
+  {
+    // The vector receives the resource, and it and its counts share one
+    // allocation
+    auto shared = ql::allocate_shared<ql::pmr::Vector<int>>( &counting, 3 );
+    weak = shared;
+
+    EXPECT_EQ( counting.allocations, 2u );
+    EXPECT_EQ( shared->get_allocator().resource(), &counting );
+    EXPECT_EQ( shared->size(), 3u );
+
+    auto made = ql::make_shared<ql::String>( "in place" );
+    EXPECT_STREQ( made->data(), "in place" );
+  }
+
+  // The vector is destroyed, but the counts outlive it for the WeakPtr
+  EXPECT_EQ( counting.deallocations, 1u );
+  weak.reset();
+  EXPECT_EQ( counting.deallocations, 2u );
+}
+
+TEST( Reclaim, EpochDefersWhilePinned )
+{
+  struct Counted
+  {
+    int* destroyed;
+    ~Counted() { ( *destroyed )++; }
+  };
+
+  int destroyed = 0;
+
+  ql::reclaim::EpochDomain domain;
+  {
+    auto guard = domain.pin();
+    domain.retire( new Counted { &destroyed } );
+
+    for ( int i = 0; i < 4; i++ )
+      domain.collect();
+
+    EXPECT_EQ( destroyed, 0 );
+    EXPECT_EQ( domain.pending(), 1u );
+  }
+
+  domain.collect();
+  domain.collect();
+  EXPECT_EQ( destroyed, 1 );
+  EXPECT_EQ( domain.pending(), 0u );
+}
+
+TEST( Reclaim, HazardProtects )
+{
+  struct Counted
+  {
+    int* destroyed;
+    ~Counted() { ( *destroyed )++; }
+  };
+
+  int destroyed = 0;
+
+  ql::reclaim::HazardDomain domain;
+  std::atomic<Counted*>     shared = new Counted { &destroyed };
+
+  auto     hazard    = domain.hazard();
+  Counted* protected_ = hazard.protect( shared );
+
+  domain.retire( shared.exchange( nullptr ) );
+  domain.collect();
+  EXPECT_EQ( destroyed, 0 );
+  EXPECT_NE( protected_->destroyed, nullptr );
+
+  hazard.reset();
+  domain.collect();
+  EXPECT_EQ( destroyed, 1 );
+}
+
+// A Treiber stack popped and pushed by several threads at once, whose popped
+// nodes are retired to Domain. Run under AddressSanitizer to catch nodes
+// freed while another thread still reads them.
+template<typename Domain>
+std::size_t reclaim_stress( auto read )
+{
+  struct Node
+  {
+    int   value;
+    Node* next;
+  };
+
+  // The domain frees into the pool, so must go first
+  ql::SynchronizedPoolResource pool;
+  Domain                       domain;
+  std::atomic<Node*>           head = nullptr;
+
+  auto push = [&]( int value )
+  {
+    Node* node = static_cast<Node*>( pool.allocate( sizeof( Node ), alignof( Node ) ) );
+    node->value = value;
+    node->next  = head.load( std::memory_order_relaxed );
+
+    while ( !head.compare_exchange_weak( node->next, node, std::memory_order_release, std::memory_order_relaxed ) )
+      ;
+  };
+
+  for ( int i = 0; i < 64; i++ )
+    push( i );
+
+  std::atomic<long> sum = 0;
+  {
+    auto work = [&]
+    {
+      for ( int i = 0; i < 5'000; i++ )
+      {
+        if ( Node* node = read( domain, head ) )
+        {
+          const int value = node->value;
+          domain.retire( node, &pool );
+
+          sum.fetch_add( value, std::memory_order_relaxed );
+          push( value );
+        }
+      }
+    };
+
+    ql::Thread a = work;
+    ql::Thread b = work;
+    ql::Thread c = work;
+  }
+
+  EXPECT_GT( sum.load(), 0 );
+
+  while ( Node* node = head.load() )
+  {
+    head = node->next;
+    pool.deallocate( node, sizeof( Node ), alignof( Node ) );
+  }
+
+  domain.collect();
+  return domain.pending();
+}
+
+TEST( Reclaim, ConcurrentStacks )
+{
+  reclaim_stress<ql::reclaim::EpochDomain>( []<typename Node>( auto& domain, std::atomic<Node*>& head ) -> Node*
+  {
+    auto  guard = domain.pin();
+    Node* node  = head.load( std::memory_order_acquire );
+
+    while ( node != nullptr &&
+            !head.compare_exchange_weak( node, node->next, std::memory_order_acquire, std::memory_order_acquire ) )
+      ;
+
+    return node;
+  } );
+
+  const std::size_t pending =
+    reclaim_stress<ql::reclaim::HazardDomain>( []<typename Node>( auto& domain, std::atomic<Node*>& head ) -> Node*
+  {
+    auto hazard = domain.hazard();
+    for ( ;; )
+    {
+      Node* node = hazard.protect( head );
+      if ( node == nullptr || head.compare_exchange_strong( node, node->next, std::memory_order_acquire ) )
+        return node;
+    }
+  } );
+
+  // Each thread leaves at most a scan's worth behind
+  EXPECT_LE( pending, 3 * ql::reclaim::HazardDomain::min_scan );
+}
+
+TEST( ObjectPool, RecyclesObjects )
+{
+  struct Message
+  {
+    int  id;
+    int* live;
+
+    Message( int id, int* live ) : id( id ), live( live ) { ( *live )++; }
+    ~Message() { ( *live )--; }
+  };
+
+  CountingResource       counting;
+  ql::ObjectPool<Message> pool( 64, &counting );
+
+  int   live = 0;
+  void* first;
+  {
+    auto message = pool.acquire( 1, &live );
+    EXPECT_EQ( message->id, 1 );
+    EXPECT_EQ( live, 1 );
+    first = message.get();
+  }
+
+  EXPECT_EQ( live, 0 );
+
+  // The returned object is the first reused
+  auto again = pool.acquire( 2, &live );
+  EXPECT_EQ( static_cast<void*>( again.get() ), first );
+
+  ql::Vector<ql::ObjectPool<Message>::Handle> many;
+  for ( int i = 0; i < 100; i++ )
+    many.push_back( pool.acquire( i, &live ) );
+
+  EXPECT_EQ( live, 101 );
+  EXPECT_EQ( pool.slab_count(), 2u );
+  EXPECT_EQ( counting.allocations, 2u );
+
+  // Returned and reacquired on another thread
+  {
+    ql::Thread thread = [&]
+    {
+      many.clear();
+      for ( int i = 0; i < 100; i++ )
+        many.push_back( pool.acquire( i, &live ) );
+    };
+  }
+
+  EXPECT_EQ( live, 101 );
+  EXPECT_EQ( pool.slab_count(), 2u );
+}
+
+template<typename Pool>
+concept acquires_with_arguments = requires( Pool& pool ) { pool.acquire( 1 ); };
+
+TEST( ObjectPool, ResetHook )
+{
+  using pool_type = ql::ObjectPool<ql::Vector<int>, ql::PoolMode::reset>;
+  pool_type pool( []( ql::Vector<int>& buffer ) { buffer.clear(); } );
+
+  // Objects are already constructed, so acquire() takes no arguments
+  static_assert( !acquires_with_arguments<pool_type> );
+
+  int* storage;
+  {
+    auto buffer = pool.acquire();
+    for ( int i = 0; i < 100; i++ )
+      buffer->push_back( i );
+
+    storage = buffer->data();
+  }
+
+  // Cleared, but its storage kept for the next user
+  auto buffer = pool.acquire();
+  EXPECT_TRUE( buffer->empty() );
+  EXPECT_EQ( buffer->data(), storage );
+}
+
+// Throws from its third construction
+struct Fragile
+{
+  Fragile()
+  {
+    if ( ++constructed == 3 )
+      throw 3;
+  }
+
+  ~Fragile() { destroyed++; }
+
+  static inline int constructed = 0;
+  static inline int destroyed   = 0;
+};
+
+TEST( ObjectPool, ThrowingSlab )
+{
+  CountingResource                             counting;
+  ql::ObjectPool<Fragile, ql::PoolMode::reset> pool( []( Fragile& ) {}, 8, &counting );
+
+  // The objects built before the throw are destroyed, and the slab freed
+  EXPECT_THROW( (void) pool.acquire(), int );
+  EXPECT_EQ( Fragile::destroyed, 2 );
+  EXPECT_EQ( counting.deallocations, counting.allocations );
+  EXPECT_EQ( pool.slab_count(), 0u );
+}
+
+// Without tracking the statistics all read zero
+#if QL_ALLOCATION_TRACKING
+
+TEST( TrackingResource, StatisticsAndSites )
+{
+  ql::TrackingResource tracker( ql::new_delete_resource() );
+
+  void* small = tracker.allocate( 16 );
+  {
+    // Labels needn't outlive their scope
+    std::string         label = "parse";
+    ql::AllocationScope scope( label.c_str() );
+    void* large = tracker.allocate( 1000 );
+    tracker.deallocate( large, 1000 );
+    label.assign( 64, 'x' );
+  }
+
+  ql::AllocationStatistics stats = tracker.statistics();
+  EXPECT_EQ( stats.allocations, 2 );
+  EXPECT_EQ( stats.live_bytes, 16 );
+  EXPECT_EQ( stats.peak_bytes, 1016 );
+  EXPECT_EQ( stats.histogram[ 4 ], 1 );
+  EXPECT_EQ( stats.histogram[ 10 ], 1 );
+
+  // Sites are sorted by bytes, and only the unattributed one is leaking
+  std::vector<ql::SiteStatistics> sites = tracker.sites();
+  ASSERT_EQ( sites.size(), 2 );
+  EXPECT_STREQ( sites[ 0 ].site.function, "parse" );
+  EXPECT_EQ( sites[ 0 ].live_bytes, 0 );
+  EXPECT_EQ( sites[ 1 ].live_allocations, 1 );
+
+  tracker.deallocate( small, 16 );
+  EXPECT_EQ( tracker.statistics().live_allocations(), 0 );
+}
+
+TEST( TrackingResource, AllocationBudget )
+{
+  ql::TrackingResource tracker( ql::new_delete_resource() );
+
+  ql::Vector<int, ql::TrackingAllocator<int>> vector( &tracker );
+  vector.reserve( 100 );
+
+  {
+    // Filling reserved capacity must not allocate
+    ql::AllocationBudget budget( tracker, 0 );
+    for ( int i = 0; i < 100; i++ )
+      vector.push_back( i );
+
+    EXPECT_TRUE( budget.within() );
+  }
+
+  ql::AllocationBudget budget( tracker, 0 );
+  vector.push_back( 100 );
+  EXPECT_FALSE( budget.within() );
+  EXPECT_EQ( budget.allocations(), 1 );
+}
+
+#endif
+
+TEST( HugePageResource, AlignedRegions )
+{
+  constexpr std::size_t huge_page = ql::HugePageResource::huge_page_size;
+
+  ql::HugePageResource resource;
+
+  // Small requests share a region
+  ql::byte_t* first  = static_cast<ql::byte_t*>( resource.allocate( 64 ) );
+  ql::byte_t* second = static_cast<ql::byte_t*>( resource.allocate( 64 ) );
+  EXPECT_EQ( reinterpret_cast<std::uintptr_t>( first ) % huge_page, 0 );
+  EXPECT_EQ( second, first + 64 );
+
+  // Large ones get their own, returned when deallocated
+  void* large = resource.allocate( huge_page + 1 );
+  EXPECT_EQ( reinterpret_cast<std::uintptr_t>( large ) % huge_page, 0 );
+  EXPECT_EQ( resource.mapped_bytes(), huge_page * 3 );
+
+  std::memset( large, 1, huge_page + 1 );
+  EXPECT_LE( resource.huge_page_bytes(), resource.mapped_bytes() );
+
+  resource.deallocate( large, huge_page + 1 );
+  EXPECT_EQ( resource.mapped_bytes(), huge_page );
+}
+
+TEST( HugePageResource, OverAligned )
+{
+  constexpr std::size_t huge_page = ql::HugePageResource::huge_page_size;
+  constexpr std::size_t alignment = 8 * huge_page;
+
+  ql::HugePageResource resource;
+
+  // Even small requests get a region of their own, trimmed to its size
+  void* memory = resource.allocate( 64, alignment );
+  EXPECT_EQ( reinterpret_cast<std::uintptr_t>( memory ) % alignment, 0 );
+  EXPECT_EQ( resource.mapped_bytes(), huge_page );
+
+  std::memset( memory, 1, 64 );
+
+  resource.deallocate( memory, 64, alignment );
+  EXPECT_EQ( resource.mapped_bytes(), 0 );
+}
+
+TEST( MappedVector, PersistsAcrossOpens )
+{
+  const std::string path = testing::TempDir() + "ql_mapped_vector.bin";
+  std::remove( path.c_str() );
+
+  {
+    ql::MappedVector<std::uint64_t> table( path.c_str() );
+    ASSERT_TRUE( table.is_open() );
+
+    for ( std::uint64_t i = 0; i < 1000; i++ )
+      table.push_back( i * i );
+
+    EXPECT_TRUE( table.flush() );
+  }
+
+  {
+    ql::MappedVector<std::uint64_t> table( path.c_str(), ql::MapMode::read_only );
+    ASSERT_TRUE( table.is_open() );
+    EXPECT_FALSE( table.writable() );
+    EXPECT_EQ( table.size(), 1000 );
+    EXPECT_EQ( table.capacity(), 1000 );
+    EXPECT_EQ( table[ 999 ], 999 * 999 );
+  }
+
+  // Files written for another item type are refused, and left untouched
+  ql::MappedVector<std::uint32_t> wrong;
+  EXPECT_FALSE( wrong.open( path.c_str() ) );
+
+  ql::MappedVector<std::uint64_t> table( path.c_str() );
+  EXPECT_EQ( table.size(), 1000 );
+
+  table.close();
+  std::remove( path.c_str() );
+}